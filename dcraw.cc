@@ -142,6 +142,17 @@ ifpReadCount = 0;
 ifpSize = 0;
 ifpStepProgress = 0;
 eofCount = 0;
+ifpData = NULL;
+ifpDataSize = 0;
+ifpDataPos = 0;
+ifpDataFile = NULL;
+ifpMapping = NULL;
+huff_bitbuf = 0;
+huff_vbits = huff_reset = 0;
+ph1_bitbuf = 0, ph1_vbits = 0;
+pana_vbits = 0;
+sony_p = 0;
+ljpeg_cs[0] = 0;
 }
 
 CLASS ~DCRaw()
@@ -165,8 +176,33 @@ void CLASS ifpProgress(unsigned readCount) {
     ifpStepProgress = newStepProgress;
 }
 
+void CLASS ifp_set_data(FILE *stream, const void *data, size_t size) {
+    ifpData = (const uchar *)data;
+    ifpDataSize = size;
+    ifpDataFile = data ? stream : NULL;
+    ifpDataPos = data ? ::ftell(stream) : 0;
+}
+
+/* Sync the stdio position before handing ifp to libraries that read it */
+void CLASS ifp_sync() {
+    if (ifpData && ifp == ifpDataFile)
+        ::fseek(ifp, ifpDataPos, SEEK_SET);
+}
+
+#define IFP_DATA(stream) (ifpData && (stream) == ifpDataFile)
+
 size_t CLASS fread(void *ptr, size_t size, size_t nmemb, FILE *stream) {
-    size_t num = ::fread(ptr, size, nmemb, stream);
+    size_t num;
+    if (IFP_DATA(stream)) {
+        size_t bytes = size * nmemb, left = 0;
+        if (ifpDataPos < (off_t)ifpDataSize)
+            left = ifpDataSize - ifpDataPos;
+        if (bytes > left) bytes = left;
+        memcpy(ptr, ifpData + ifpDataPos, bytes);
+        ifpDataPos += bytes;
+        num = size ? bytes / size : 0;
+    } else
+        num = ::fread(ptr, size, nmemb, stream);
     if ( num != nmemb ) {
         if (eofCount < 10)
             // Maybe this should be a DCRAW_WARNING
@@ -190,7 +226,17 @@ size_t CLASS fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream) {
 }
 
 char *CLASS fgets(char *s, int size, FILE *stream) {
-    char *str = ::fgets(s, size, stream);
+    char *str;
+    if (IFP_DATA(stream)) {
+        int i = 0;
+        while (i < size - 1 && ifpDataPos < (off_t)ifpDataSize) {
+            s[i] = ifpData[ifpDataPos++];
+            if (s[i++] == '\n') break;
+        }
+        if (size > 0) s[i] = '\0';
+        str = i > 0 ? s : NULL;
+    } else
+        str = ::fgets(s, size, stream);
     if (str == NULL) {
         if (eofCount < 10)
             // Maybe this should be a DCRAW_WARNING
@@ -206,19 +252,75 @@ char *CLASS fgets(char *s, int size, FILE *stream) {
 }
 
 int CLASS fgetc(FILE *stream) {
-    int chr = ::fgetc(stream);
+    int chr;
+    if (IFP_DATA(stream))
+        chr = ifpDataPos < (off_t)ifpDataSize ? ifpData[ifpDataPos++] : EOF;
+    else
+        chr = ::fgetc(stream);
     if (stream==ifp) ifpProgress(1);
     return chr;
 }
 
 int CLASS fscanf(FILE *stream, const char *format, void *ptr) {
-    int count = ::fscanf(stream, format, ptr);
+    int count;
+    if (IFP_DATA(stream)) {
+        // Only single numbers are scanned, so a short window is enough
+        char buf[128], fmt[16];
+        size_t len = 0;
+        int used = 0;
+        if (ifpDataPos < (off_t)ifpDataSize)
+            len = ifpDataSize - ifpDataPos;
+        if (len > sizeof buf - 1) len = sizeof buf - 1;
+        memcpy(buf, ifpData + ifpDataPos, len);
+        buf[len] = '\0';
+        snprintf(fmt, sizeof fmt, "%s%%n", format);
+        count = sscanf(buf, fmt, ptr, &used);
+        if (count > 0) ifpDataPos += used;
+    } else
+        count = ::fscanf(stream, format, ptr);
     if ( count != 1 )
         dcraw_message(DCRAW_WARNING, "%s: fscanf %d != 1\n",
                 ifname_display, count);
     return 1;
 }
 
+int CLASS fseek(FILE *stream, long offset, int whence) {
+    if (!IFP_DATA(stream))
+        return ::fseek(stream, offset, whence);
+    off_t pos = offset;
+    if (whence == SEEK_CUR) pos += ifpDataPos;
+    else if (whence == SEEK_END) pos += ifpDataSize;
+    if (pos < 0) return -1;
+    ifpDataPos = pos;
+    return 0;
+}
+
+long CLASS ftell(FILE *stream) {
+    if (!IFP_DATA(stream))
+        return ::ftell(stream);
+    return ifpDataPos;
+}
+
+#ifdef HAVE_FSEEKO
+int CLASS fseeko(FILE *stream, off_t offset, int whence) {
+    if (!IFP_DATA(stream))
+        return ::fseeko(stream, offset, whence);
+    return fseek(stream, offset, whence);
+}
+
+off_t CLASS ftello(FILE *stream) {
+    if (!IFP_DATA(stream))
+        return ::ftello(stream);
+    return ifpDataPos;
+}
+#endif
+
+int CLASS feof(FILE *stream) {
+    if (!IFP_DATA(stream))
+        return ::feof(stream);
+    return ifpDataPos >= (off_t)ifpDataSize;
+}
+
 #define FORC(cnt) for (c=0; c < cnt; c++)
 #define FORC3 FORC(3)
 #define FORC4 FORC(4)
@@ -360,6 +462,10 @@ void CLASS merror (void *ptr, const char *where)
 
 void CLASS derror()
 {
+#ifdef _OPENMP
+#pragma omp critical(dcraw_derror)
+#endif
+  {
   if (!data_error) {
     dcraw_message (DCRAW_WARNING, "%s: ", ifname_display);
     if (feof(ifp))
@@ -373,6 +479,7 @@ void CLASS derror()
 #endif
   }
   data_error++;
+  }
 }
 
 ushort CLASS sget2 (uchar *s)
@@ -672,16 +779,15 @@ int CLASS canon_s2is()
 
   for (row=0; row < 100; row++) {
     fseek (ifp, row*3340 + 3284, SEEK_SET);
-    if (getc(ifp) > 15) return 1;
+    if (fgetc(ifp) > 15) return 1;
   }
   return 0;
 }
 
 unsigned CLASS getbithuff (int nbits, ushort *huff)
 {
-  // TODO: The following static variables are not thread-safe
-  static unsigned bitbuf=0;
-  static int vbits=0, reset=0;
+  unsigned &bitbuf=huff_bitbuf;
+  int &vbits=huff_vbits, &reset=huff_reset;
   unsigned c;
 
   if (nbits > 25) return 0;
@@ -897,8 +1003,15 @@ void CLASS canon_load_raw()
 struct jhead {
   int algo, bits, high, wide, clrs, sraw, psv, restart, vpred[6];
   ushort quant[64], idct[64], *huff[20], *free[20], *row;
+  int *fast[6];
+  UINT64 bitbuf;
+  int vbits, reset, parallel;
+  const uchar *data, *bp, *bend;
 };
 
+/* Number of bits looked up at once by ljpeg_fast_diff() */
+#define LJPEG_FAST_BITS 12
+
 int CLASS ljpeg_start (struct jhead *jh, int info_only)
 {
   ushort c, tag, len;
@@ -925,7 +1038,7 @@ int CLASS ljpeg_start (struct jhead *jh, int info_only)
 	jh->high = data[1] << 8 | data[2];
 	jh->wide = data[3] << 8 | data[4];
 	jh->clrs = data[5] + jh->sraw;
-	if (len == 9 && !dng_version) getc(ifp);
+	if (len == 9 && !dng_version) fgetc(ifp);
 	break;
       case 0xffc4:
 	if (info_only) break;
@@ -954,16 +1067,141 @@ int CLASS ljpeg_start (struct jhead *jh, int info_only)
   }
   jh->row = (ushort *) calloc (jh->wide*jh->clrs, 4);
   merror (jh->row, "ljpeg_start()");
+  ljpeg_fast_start (jh);
   return zero_after_ff = 1;
 }
 
 void CLASS ljpeg_end (struct jhead *jh)
 {
-  int c;
+  int c, i;
   FORC4 if (jh->free[c]) free (jh->free[c]);
+  FORC(6) {
+    for (i=0; i < c && jh->fast[i] != jh->fast[c]; i++);
+    if (i == c) free (jh->fast[c]);
+  }
   free (jh->row);
 }
 
+/*
+   When the input is held in memory, ljpeg_row() decodes with its own bit
+   reader in jhead. It follows the rules of getbithuff() with zero_after_ff
+   set, but keeps a 64-bit reservoir that is refilled eagerly up to the
+   next 0xff byte. Bytes from 0xff on are only read when their bits are
+   needed, so markers are consumed exactly as getbithuff() would.
+
+   For every Huffman table, fast[] maps the next LJPEG_FAST_BITS bits to
+   the code length plus, when it fits, the already sign-extended diff:
+     bits 0-6: bits to consume, bit 7: diff is complete,
+     bits 8-15: diff length, bits 16-31: diff.
+   Zero means the code is longer than LJPEG_FAST_BITS.
+
+   The reader keeps its own position, so that independent streams such as
+   DNG tiles can be decoded concurrently. With jh->parallel set,
+   ljpeg_row() leaves the progress report and the ifp position to the
+   caller.
+ */
+void CLASS ljpeg_fast_start (struct jhead *jh)
+{
+  int c, i, idx, e, clen, len, diff, done;
+  ushort *huff;
+
+  if (!ifpData || ifp != ifpDataFile) return;
+  jh->data = jh->bp = ifpData + MIN(ifpDataPos, (off_t) ifpDataSize);
+  jh->bend = ifpData + ifpDataSize;
+  FORC(jh->clrs) {
+    for (i=0; i < c && jh->huff[i] != jh->huff[c]; i++);
+    if (i < c) {
+      jh->fast[c] = jh->fast[i];
+      continue;
+    }
+    huff = jh->huff[c];
+    jh->fast[c] = (int *) calloc (1 << LJPEG_FAST_BITS, sizeof (int));
+    merror (jh->fast[c], "ljpeg_fast_start()");
+    for (idx=0; idx < 1 << LJPEG_FAST_BITS; idx++) {
+      if (huff[0] >= LJPEG_FAST_BITS)
+	e = huff[1 + (idx << (huff[0] - LJPEG_FAST_BITS))];
+      else
+	e = huff[1 + (idx >> (LJPEG_FAST_BITS - huff[0]))];
+      clen = e >> 8;
+      len = e & 0xff;
+      if (!clen || clen > LJPEG_FAST_BITS) continue;
+      diff = done = 0;
+      if (len == 16 && (!dng_version || dng_version >= 0x1010000)) {
+	diff = -32768;
+	done = 1;
+      } else if (len <= 16 && clen + len <= LJPEG_FAST_BITS) {
+	diff = idx >> (LJPEG_FAST_BITS - clen - len) & ((1 << len) - 1);
+	if (len && (diff & (1 << (len-1))) == 0)
+	  diff -= (1 << len) - 1;
+	clen += len;
+	done = 1;
+      }
+      jh->fast[c][idx] = (int) ((unsigned) diff << 16) | len << 8 |
+		done << 7 | clen;
+    }
+  }
+  if (jh->clrs < 6)
+    for (c=jh->clrs; c < 6; c++) jh->fast[c] = jh->fast[0];
+}
+
+/* getbithuff() on the bit reader of jh */
+unsigned CLASS ljpeg_getbithuff (struct jhead *jh, int nbits, ushort *huff)
+{
+  unsigned c;
+
+  if (nbits > 25) return 0;
+  if (nbits == 0 || jh->vbits < 0) return 0;
+  while (!jh->reset && jh->vbits < nbits && jh->bp < jh->bend) {
+    c = *jh->bp++;
+    if (c == 0xff && (jh->bp >= jh->bend || *jh->bp++)) {
+      jh->reset = 1;
+      break;
+    }
+    jh->bitbuf = (jh->bitbuf << 8) + c;
+    jh->vbits += 8;
+  }
+  if (jh->vbits > 0)
+    c = jh->bitbuf << (64-jh->vbits) >> (64-nbits);
+  else	/* getbithuff() shifts its 32-bit buffer by 32 here */
+    c = (unsigned) jh->bitbuf >> (32-nbits);
+  if (huff) {
+    jh->vbits -= huff[c] >> 8;
+    c = (uchar) huff[c];
+  } else
+    jh->vbits -= nbits;
+  if (jh->vbits < 0) derror();
+  return c;
+}
+
+int CLASS ljpeg_fast_diff (struct jhead *jh, int c)
+{
+  ushort *huff = jh->huff[c];
+  int e, len, diff;
+
+  if (!huff)
+    longjmp(failure, 2);
+
+  while (jh->vbits <= 56 && !jh->reset && jh->bp < jh->bend &&
+	*jh->bp != 0xff) {
+    jh->bitbuf = jh->bitbuf << 8 | *jh->bp++;
+    jh->vbits += 8;
+  }
+  if (jh->vbits >= LJPEG_FAST_BITS && jh->vbits >= huff[0] &&
+      (e = jh->fast[c][jh->bitbuf << (64-jh->vbits) >> (64-LJPEG_FAST_BITS)])) {
+    jh->vbits -= e & 0x7f;
+    if (e & 0x80) return e >> 16;
+    len = e >> 8 & 0xff;
+  } else {
+    len = ljpeg_getbithuff (jh, *huff, huff+1);
+    if (len == 16 && (!dng_version || dng_version >= 0x1010000))
+      return -32768;
+  }
+  diff = ljpeg_getbithuff (jh, len, 0);
+  if ((diff & (1 << (len-1))) == 0)
+    diff -= (1 << len) - 1;
+  return diff;
+}
+
 int CLASS ljpeg_diff (ushort *huff)
 {
   int len, diff;
@@ -984,20 +1222,32 @@ ushort * CLASS ljpeg_row (int jrow, struct jhead *jh)
 {
   int col, c, diff, pred, spred=0;
   ushort mark=0, *row[3];
+  const uchar *start, *p;
 
+  start = jh->bp;
   if (jrow * jh->wide % jh->restart == 0) {
     FORC(6) jh->vpred[c] = 1 << (jh->bits-1);
-    if (jrow) {
-      fseek (ifp, -2, SEEK_CUR);
-      do mark = (mark << 8) + (c = fgetc(ifp));
-      while (c != EOF && mark >> 4 != 0xffd);
+    if (jh->fast[0]) {
+      if (jrow) {
+	p = jh->bp - 2;
+	do mark = (mark << 8) + (c = p < jh->bend ? *p++ : EOF);
+	while (c != EOF && mark >> 4 != 0xffd);
+	jh->bp = p;
+      }
+      jh->bitbuf = jh->vbits = jh->reset = 0;
+    } else {
+      if (jrow) {
+	fseek (ifp, -2, SEEK_CUR);
+	do mark = (mark << 8) + (c = fgetc(ifp));
+	while (c != EOF && mark >> 4 != 0xffd);
+      }
+      getbits(-1);
     }
-    getbits(-1);
   }
   FORC3 row[c] = jh->row + jh->wide*jh->clrs*((jrow+c) & 1);
   for (col=0; col < jh->wide; col++)
     FORC(jh->clrs) {
-      diff = ljpeg_diff (jh->huff[c]);
+      diff = jh->fast[0] ? ljpeg_fast_diff (jh, c) : ljpeg_diff (jh->huff[c]);
       if (jh->sraw && c <= jh->sraw && (col | c))
 		    pred = spred;
       else if (col) pred = row[0][-jh->clrs];
@@ -1016,6 +1266,10 @@ ushort * CLASS ljpeg_row (int jrow, struct jhead *jh)
       if (c <= jh->sraw) spred = **row;
       row[0]++; row[1]++;
     }
+  if (jh->fast[0] && !jh->parallel) {
+    ifpProgress (jh->bp - start);
+    ifpDataPos = jh->bp - ifpData;
+  }
   return row[2];
 }
 
@@ -1151,7 +1405,7 @@ void CLASS ljpeg_idct (struct jhead *jh)
 {
   int c, i, j, len, skip, coef;
   float work[3][8][8];
-  static float cs[106] = { 0 };
+  float *cs=ljpeg_cs;
   static const uchar zigzag[80] =
   {  0, 1, 8,16, 9, 2, 3,10,17,24,32,25,18,11, 4, 5,12,19,26,33,
     40,48,41,34,27,20,13, 6, 7,14,21,28,35,42,49,56,57,50,43,36,
@@ -1183,10 +1437,35 @@ void CLASS ljpeg_idct (struct jhead *jh)
   FORC(64) jh->idct[c] = CLIP(((float *)work[2])[c]+0.5);
 }
 
+/* Decode one lossless JPEG tile of a DNG */
+void CLASS lossless_dng_tile (struct jhead *jh, unsigned trow, unsigned tcol)
+{
+  unsigned jwide, jrow, jcol, row, col;
+  ushort *rp;
+
+  jwide = jh->wide;
+  if (filters) jwide *= jh->clrs;
+  jwide /= MIN (is_raw, tiff_samples);
+  for (row=col=jrow=0; jrow < (unsigned) jh->high; jrow++) {
+    rp = ljpeg_row (jrow, jh);
+    for (jcol=0; jcol < jwide; jcol++) {
+      adobe_copy_pixel (trow+row, tcol+col, &rp);
+      if (++col >= tile_width || col >= raw_width)
+	row += 1 + (col = 0);
+    }
+  }
+}
+
+/*
+   With the input in memory, the 0xc3 tiles are only parsed here and are
+   decoded afterwards in parallel, each with the bit reader of its jhead.
+ */
 void CLASS lossless_dng_load_raw()
 {
-  unsigned save, trow=0, tcol=0, jwide, jrow, jcol, row, col, i, j;
-  struct jhead jh;
+  unsigned save, trow=0, tcol=0, jrow, jcol, row, col, i, j;
+  struct jhead jh, *tiles=0;
+  unsigned (*tpos)[2]=0;
+  int ntiles=0, queued, t;
   ushort *rp;
 
   while (trow < raw_height) {
@@ -1194,9 +1473,7 @@ void CLASS lossless_dng_load_raw()
     if (tile_length < INT_MAX)
       fseek (ifp, get4(), SEEK_SET);
     if (!ljpeg_start (&jh, 0)) break;
-    jwide = jh.wide;
-    if (filters) jwide *= jh.clrs;
-    jwide /= MIN (is_raw, tiff_samples);
+    queued = 0;
     switch (jh.algo) {
       case 0xc1:
 	jh.vpred[0] = 16384;
@@ -1214,20 +1491,36 @@ void CLASS lossless_dng_load_raw()
 	}
 	break;
       case 0xc3:
-	for (row=col=jrow=0; jrow < (unsigned) jh.high; jrow++) {
-	  rp = ljpeg_row (jrow, &jh);
-	  for (jcol=0; jcol < jwide; jcol++) {
-	    adobe_copy_pixel (trow+row, tcol+col, &rp);
-	    if (++col >= tile_width || col >= raw_width)
-	      row += 1 + (col = 0);
-	  }
-	}
+	if (jh.fast[0]) {
+	  tiles = (struct jhead *) realloc (tiles, (ntiles+1) * sizeof *tiles);
+	  tpos = (unsigned (*)[2]) realloc (tpos, (ntiles+1) * sizeof *tpos);
+	  merror (tiles, "lossless_dng_load_raw()");
+	  merror (tpos, "lossless_dng_load_raw()");
+	  jh.parallel = 1;
+	  tiles[ntiles] = jh;
+	  tpos[ntiles][0] = trow;
+	  tpos[ntiles][1] = tcol;
+	  ntiles++;
+	  queued = 1;
+	} else
+	  lossless_dng_tile (&jh, trow, tcol);
     }
     fseek (ifp, save+4, SEEK_SET);
     if ((tcol += tile_width) >= raw_width)
       trow += tile_length + (tcol = 0);
-    ljpeg_end (&jh);
+    if (!queued) ljpeg_end (&jh);
+  }
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for (t=0; t < ntiles; t++)
+    lossless_dng_tile (&tiles[t], tpos[t][0], tpos[t][1]);
+  for (t=0; t < ntiles; t++) {
+    ifpProgress (tiles[t].bp - tiles[t].data);
+    ljpeg_end (&tiles[t]);
   }
+  free (tiles);
+  free (tpos);
 }
 
 void CLASS packed_dng_load_raw()
@@ -1801,9 +2094,8 @@ void CLASS phase_one_load_raw()
 
 unsigned CLASS ph1_bithuff (int nbits, ushort *huff)
 {
-  // TODO: The following static variables are not thread-safe
-  static UINT64 bitbuf=0;
-  static int vbits=0;
+  UINT64 &bitbuf=ph1_bitbuf;
+  int &vbits=ph1_vbits;
   unsigned c;
 
   if (nbits == -1)
@@ -2103,8 +2395,8 @@ void CLASS canon_rmf_load_raw()
 
 unsigned CLASS pana_bits (int nbits)
 {
-  static uchar buf[0x4000];
-  static int vbits;
+  uchar *buf=pana_buf;
+  int &vbits=pana_vbits;
   int byte;
 
   if (!nbits) return vbits=0;
@@ -2393,12 +2685,11 @@ void CLASS lossy_dng_load_raw() {}
 METHODDEF(boolean)
 fill_input_buffer (j_decompress_ptr cinfo)
 {
-  // TODO: The following static variable is not thread-safe
-  static uchar jpeg_buffer[4096];
   size_t nbytes;
   DCRaw *d = (DCRaw*)cinfo->client_data;
+  uchar *jpeg_buffer = d->jpeg_buffer;
 
-  nbytes = fread (jpeg_buffer, 1, 4096, d->ifp);
+  nbytes = d->fread (jpeg_buffer, 1, 4096, d->ifp);
 #if defined(__MINGW64_VERSION_MAJOR) && __MINGW64_VERSION_MAJOR < 4
   swab ((char *) jpeg_buffer, (char *) jpeg_buffer, nbytes);
 #else
@@ -2494,6 +2785,7 @@ void CLASS lossy_dng_load_raw()
     fseek (ifp, save+=4, SEEK_SET);
     if (tile_length < INT_MAX)
       fseek (ifp, get4(), SEEK_SET);
+    ifp_sync();
     jpeg_stdio_src (&cinfo, ifp);
     jpeg_read_header (&cinfo, TRUE);
     jpeg_start_decompress (&cinfo);
@@ -2756,8 +3048,7 @@ void CLASS kodak_thumb_load_raw()
 
 void CLASS sony_decrypt (unsigned *data, int len, int start, int key)
 {
-  // TODO: The following static variables are not thread-safe
-  static unsigned pad[128], p;
+  unsigned *pad=sony_pad, &p=sony_p;
 
   if (start) {
     for (p=0; p < 4; p++)
@@ -3156,8 +3447,7 @@ void CLASS redcine_load_raw()
 
 void CLASS foveon_decoder (int size, unsigned code)
 {
-  // TODO: The following static variable is not thread-safe
-  static unsigned huff[1024];
+  unsigned *huff=foveon_codes;
   struct decode *cur;
   int i, len;
 
@@ -3265,8 +3555,8 @@ void CLASS foveon_huff (ushort *huff)
 
   huff[0] = 8;
   for (i=0; i < 13; i++) {
-    clen = getc(ifp);
-    code = getc(ifp);
+    clen = fgetc(ifp);
+    code = fgetc(ifp);
     for (j=0; j < 256 >> clen; )
       huff[code+ ++j] = clen << 8 | i;
   }
@@ -5954,7 +6244,7 @@ void CLASS parse_gps (int base)
     tiff_get (base, &tag, &type, &len, &save);
     switch (tag) {
       case 1: case 3: case 5:
-	gpsdata[29+tag/2] = getc(ifp);			break;
+	gpsdata[29+tag/2] = fgetc(ifp);			break;
       case 2: case 4: case 7:
 	FORC(6) gpsdata[tag/3*6+c] = get4();		break;
       case 6:
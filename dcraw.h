@@ -114,6 +114,34 @@ public:
     int fscanf(FILE *stream, const char *format, void *ptr);
 // calling with more variables would triger a link error
 //int fscanf(FILE *stream, const char *format, void *ptr1, void *ptr2, ...);
+    int fseek(FILE *stream, long offset, int whence);
+    long ftell(FILE *stream);
+#ifdef HAVE_FSEEKO
+    int fseeko(FILE *stream, off_t offset, int whence);
+    off_t ftello(FILE *stream);
+#endif
+    int feof(FILE *stream);
+
+// When ifpData is set, reads from ifpDataFile are served from this buffer
+// instead of stdio. The caller owns the buffer (usually a memory map) and
+// ifpMapping can be used to keep track of it.
+    const uchar *ifpData;
+    size_t ifpDataSize;
+    off_t ifpDataPos;
+    FILE *ifpDataFile;
+    void *ifpMapping;
+    unsigned huff_bitbuf; // getbithuff() state
+    int huff_vbits, huff_reset;
+    unsigned long long ph1_bitbuf; // ph1_bithuff() state
+    int ph1_vbits;
+    uchar pana_buf[0x4000]; // pana_bits() state
+    int pana_vbits;
+    unsigned sony_pad[128], sony_p; // sony_decrypt() state
+    unsigned foveon_codes[1024]; // foveon_decoder() state
+    float ljpeg_cs[106]; // ljpeg_idct() cosine table
+    uchar jpeg_buffer[4096]; // libjpeg input buffer of kodak_jpeg_load_raw()
+    void ifp_set_data(FILE *stream, const void *data, size_t size);
+    void ifp_sync();
 
     /* Initialization of the variables is done here */
     DCRaw();
@@ -148,11 +176,15 @@ public:
     int ljpeg_start(struct jhead *jh, int info_only);
     void ljpeg_end(struct jhead *jh);
     int ljpeg_diff(ushort *huff);
+    void ljpeg_fast_start(struct jhead *jh);
+    unsigned ljpeg_getbithuff(struct jhead *jh, int nbits, ushort *huff);
+    int ljpeg_fast_diff(struct jhead *jh, int c);
     ushort * ljpeg_row(int jrow, struct jhead *jh);
     void lossless_jpeg_load_raw();
     void canon_sraw_load_raw();
     void adobe_copy_pixel(unsigned row, unsigned col, ushort **rp);
     void ljpeg_idct(struct jhead *jh);
+    void lossless_dng_tile(struct jhead *jh, unsigned trow, unsigned tcol);
     void lossless_dng_load_raw();
     void packed_dng_load_raw();
     void pentax_load_raw();
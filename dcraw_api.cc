@@ -72,7 +72,73 @@ extern "C" {
     void fuji_rotate_INDI(gushort(**image_p)[4], int *height_p, int *width_p,
                           int *fuji_width_p, const int colors, const double step, void *dcraw);
 
+    /* Regular files are read through a memory map, which saves the stdio
+     * copies and the seeks of the decoders. Pipes and other files that
+     * cannot be mapped are still read through stdio. */
+    static void dcraw_map_input(DCRaw *d)
+    {
+#if GLIB_CHECK_VERSION(2,32,0)
+        GMappedFile *map = g_mapped_file_new_from_fd(fileno(d->ifp), FALSE, NULL);
+#else
+        GMappedFile *map = g_mapped_file_new(d->ifname, FALSE, NULL);
+#endif
+        if (map == NULL)
+            return;
+        if (g_mapped_file_get_length(map) == 0) {
+#if GLIB_CHECK_VERSION(2,22,0)
+            g_mapped_file_unref(map);
+#else
+            g_mapped_file_free(map);
+#endif
+            return;
+        }
+        d->ifpMapping = map;
+        d->ifp_set_data(d->ifp, g_mapped_file_get_contents(map),
+                        g_mapped_file_get_length(map));
+    }
+
+    static void dcraw_unmap_input(DCRaw *d)
+    {
+        GMappedFile *map = (GMappedFile *)d->ifpMapping;
+        if (map == NULL)
+            return;
+        d->ifp_set_data(NULL, NULL, 0);
+        d->ifpMapping = NULL;
+#if GLIB_CHECK_VERSION(2,22,0)
+        g_mapped_file_unref(map);
+#else
+        g_mapped_file_free(map);
+#endif
+    }
+
+    static void dcraw_close_input(DCRaw *d)
+    {
+        dcraw_unmap_input(d);
+        fclose(d->ifp);
+    }
+
+    static int dcraw_open_input(dcraw_data *h, char *filename,
+                                void *buffer, size_t size);
+
     int dcraw_open(dcraw_data *h, char *filename)
+    {
+        return dcraw_open_input(h, filename, NULL, 0);
+    }
+
+#ifdef HAVE_FMEMOPEN
+    /* Open a raw file that was already read into memory, for example
+     * by decompressing it. filename is only used in messages.
+     * buffer must stay valid until the input is closed by dcraw_load_raw()
+     * or dcraw_close(). */
+    int dcraw_open_buffer(dcraw_data *h, char *filename,
+                          void *buffer, size_t size)
+    {
+        return dcraw_open_input(h, filename, buffer, size);
+    }
+#endif
+
+    static int dcraw_open_input(dcraw_data *h, char *filename,
+                                void *buffer, size_t size)
     {
         DCRaw *d = new DCRaw;
         int c, i;
@@ -92,7 +158,15 @@ extern "C" {
             delete d;
             return DCRAW_ERROR;
         }
-        if (!(d->ifp = g_fopen(d->ifname, "rb"))) {
+#ifdef HAVE_FMEMOPEN
+        /* libjpeg still reads through the FILE, so the buffer is opened
+         * as a stream as well. */
+        if (buffer != NULL)
+            d->ifp = fmemopen(buffer, size, "rb");
+        else
+#endif
+            d->ifp = g_fopen(d->ifname, "rb");
+        if (d->ifp == NULL) {
             gchar *err_u8 = g_locale_to_utf8(strerror(errno), -1, NULL, NULL, NULL);
             d->dcraw_message(DCRAW_OPEN_ERROR, _("Cannot open file %s: %s\n"),
                              d->ifname_display, err_u8);
@@ -101,13 +175,17 @@ extern "C" {
             delete d;
             return DCRAW_OPEN_ERROR;
         }
+        if (buffer != NULL)
+            d->ifp_set_data(d->ifp, buffer, size);
+        else
+            dcraw_map_input(d);
         d->identify();
         /* We first check if dcraw recognizes the file, this is equivalent
          * to 'dcraw -i' succeeding */
         if (!d->make[0]) {
             d->dcraw_message(DCRAW_OPEN_ERROR, _("%s: unsupported file format.\n"),
                              d->ifname_display);
-            fclose(d->ifp);
+            dcraw_close_input(d);
             h->message = d->messageBuffer;
             int lastStatus = d->lastStatus;
             delete d;
@@ -117,7 +195,7 @@ extern "C" {
         if (!d->is_raw) {
             d->dcraw_message(DCRAW_OPEN_ERROR, _("Cannot decode file %s\n"),
                              d->ifname_display);
-            fclose(d->ifp);
+            dcraw_close_input(d);
             h->message = d->messageBuffer;
             int lastStatus = d->lastStatus;
             delete d;
@@ -347,6 +425,12 @@ extern "C" {
         DCRaw * volatile d = (DCRaw *)h->dcraw;
         int c, i, j;
         double dmin;
+        /* State kept between the shots of multishot and Fuji images,
+         * which are loaded by going back to 'start' for each shot. */
+        dcraw_image_type * volatile tmp = NULL;
+        guint16 * volatile saved_raw_image = NULL;
+        int saved_fuji_dr = 0;
+        float saved_cam_mul[4];
 
 start:
         g_free(d->messageBuffer);
@@ -357,6 +441,8 @@ start:
             d->dcraw_message(DCRAW_ERROR, _("Fatal internal error\n"));
             h->message = d->messageBuffer;
             delete d;
+            g_free(tmp);
+            g_free(saved_raw_image);
             return DCRAW_ERROR;
         }
         h->raw.height = d->iheight = (h->height + h->shrink) >> h->shrink;
@@ -375,9 +461,9 @@ start:
         }
         d->dcraw_message(DCRAW_VERBOSE, _("Loading %s %s image from %s ...\n"),
                          d->make, d->model, d->ifname_display);
-        fseek(d->ifp, 0, SEEK_END);
-        d->ifpSize = ftell(d->ifp);
-        fseek(d->ifp, d->data_offset, SEEK_SET);
+        d->fseek(d->ifp, 0, SEEK_END);
+        d->ifpSize = d->ftell(d->ifp);
+        d->fseek(d->ifp, d->data_offset, SEEK_SET);
         (d->*d->load_raw)();
 
         /* multishot support, for now Pentax only. */
@@ -385,7 +471,6 @@ start:
 
             int row, col, i;
             int positions[4][2] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
-            static dcraw_image_type *tmp = NULL;
 
             if (!tmp)
                 tmp = d->image = g_new0(dcraw_image_type, d->height * d->width + d->meta_length);
@@ -402,7 +487,7 @@ start:
 
             if (d->shot_select < 3) {
                 d->shot_select++;
-                fseek(d->ifp, 0, SEEK_SET);
+                d->fseek(d->ifp, 0, SEEK_SET);
                 d->identify();
                 goto start;
             }
@@ -431,10 +516,6 @@ start:
         /* Fuji Super CCD SR and EXR support */
         if (d->is_raw == 2 && !strncasecmp(d->make, "Fujifilm", 8)) {
 
-            static int saved_fuji_dr;
-            static float saved_cam_mul[4];
-            static guint16 *saved_raw_image = NULL;
-
             if (!saved_raw_image) {
 
                 saved_raw_image = d->raw_image;
@@ -443,14 +524,14 @@ start:
                 FORC4 saved_cam_mul[c] = d->cam_mul[c];
 
                 d->shot_select++;
-                fseek(d->ifp, 0, SEEK_SET);
+                d->fseek(d->ifp, 0, SEEK_SET);
                 d->identify();
                 goto start;
             }
 
             fuji_merge(d, saved_raw_image, saved_cam_mul, saved_fuji_dr);
 
-            free(saved_raw_image);
+            g_free(saved_raw_image);
             saved_raw_image = NULL;
             d->shot_select--;
 
@@ -484,7 +565,7 @@ start:
             h->raw.width = h->width = d->width;
             h->raw.height = h->height = d->height;
         }
-        fclose(d->ifp);
+        dcraw_close_input(d);
         h->ifp = NULL;
         // TODO: Go over the following settings to see if they change during
         // load_raw. If they change, document where. If not, move to dcraw_open().
@@ -517,6 +598,17 @@ start:
         return d->lastStatus;
     }
 
+    /* Close the input file without loading the raw image, for when
+     * h->raw was obtained some other way. */
+    void dcraw_release_input(dcraw_data *h)
+    {
+        DCRaw *d = (DCRaw *)h->dcraw;
+        if (h->ifp == NULL)
+            return;
+        dcraw_close_input(d);
+        h->ifp = NULL;
+    }
+
     int dcraw_load_thumb(dcraw_data *h, dcraw_image_data *thumb)
     {
         DCRaw *d = (DCRaw *)h->dcraw;
@@ -550,43 +642,6 @@ start:
         return d->lastStatus;
     }
 
-    /* Grab a pixel from the raw data, doing dark frame removal on the fly.
-     *
-     * The most obvious algorithm for dark frame removal is to simply
-     * subtract the dark frame from the image (rounding negative values to
-     * zero).  However, this leaves holes in the resulting image that need
-     * to be interpolated from the surrounding pixels.
-     *
-     * The processing works by subtracting the dark frame as usual for most
-     * pixels.  For all pixels where the dark frame is brighter than a given
-     * threshold, the result is instead calculated as the average of the
-     * dark-adjusted values of the 4 surrounding pixels.  By this method,
-     * only hot pixels (as determined by the threshold) are examined and
-     * recalculated.
-     */
-    static int get_dark_pixel(const dcraw_data *h, const dcraw_data *dark,
-                              int i, int cl)
-    {
-        return MAX(h->raw.image[i][cl] - dark->raw.image[i][cl], 0);
-    }
-
-    static int get_pixel(const dcraw_data *h, const dcraw_data *dark,
-                         int i, int cl, int pixels)
-    {
-        int pixel = h->raw.image[i][cl];
-        if (dark != 0) {
-            int w = h->raw.width;
-            pixel = (dark->raw.image[i][cl] <= dark->thresholds[cl])
-                    ? MAX(pixel - dark->raw.image[i][cl], 0)
-                    : (get_dark_pixel(h, dark, i + ((i >= 1) ? -1 : 1), cl) +
-                       get_dark_pixel(h, dark, i + ((i < pixels - 1) ? 1 : -1), cl) +
-                       get_dark_pixel(h, dark, i + ((i >= w) ? -w : w), cl) +
-                       get_dark_pixel(h, dark, i + ((i < pixels - w) ? w : -w), cl))
-                    / 4;
-        }
-        return pixel;
-    }
-
     /*
      * fcol_INDI() optimizing wrapper.
      * fcol_sequence() cooks up the filter color sequence for a row knowing that
@@ -743,11 +798,87 @@ start:
         return d->lastStatus;
     }
 
-    int dcraw_image_resize(dcraw_image_data *image, int size)
+    /* Weight of the resize filter at distance x, in output pixels */
+    static double resize_kernel(int filter, double x)
+    {
+        x = fabs(x);
+        switch (filter) {
+            case dcraw_lanczos3_resize:
+                if (x < 1e-8) return 1;
+                if (x >= 3) return 0;
+                return 3 * sin(G_PI * x) * sin(G_PI * x / 3) / (G_PI * G_PI * x * x);
+            case dcraw_mitchell_resize:
+                /* Mitchell-Netravali with B = C = 1/3 */
+                if (x < 1) return (7 * x * x * x - 12 * x * x + 16.0 / 3) / 6;
+                if (x < 2) return (-7.0 / 3 * x * x * x + 12 * x * x - 20 * x + 32.0 / 3) / 6;
+                return 0;
+        }
+        return 0;
+    }
+
+    /* Calculate the weights for resizing one axis from 'in' to 'out'
+     * pixels, where out = in * mul / div (rounded down). Output pixel i is
+     * made of the input pixels first[i] ... first[i] + *taps - 1 with the
+     * weights weight[i * *taps] ... */
+    static float *resize_weights(int filter, int in, int out, int mul, int div,
+                                 int *taps, int **first)
     {
-        int h, w, wid, r, ri, rii, c, ci, cii, cl, norm;
-        guint64 riw, riiw, ciw, ciiw;
-        guint64(*iBuf)[4];
+        double scale = (double)div / mul;
+        double radius = filter == dcraw_lanczos3_resize ? 3 : 2;
+        int i, t, c;
+        /* The box filter covers at most div/mul+2 input pixels */
+        if (filter == dcraw_box_resize)
+            *taps = MIN(div / mul + 2, in);
+        else
+            *taps = MIN(2 * (int)ceil(radius * scale) + 2, in);
+        *first = g_new(int, out);
+        float *weight = g_new(float, out * *taps);
+        for (i = 0; i < out; i++) {
+            float *w = weight + i * *taps;
+            double center = (i + 0.5) * scale - 0.5, sum = 0;
+            if (filter == dcraw_box_resize)
+                c = i * div / mul;
+            else
+                c = (int)floor(center - radius * scale);
+            /* Keep all taps inside the image. Those that are not needed
+             * get a zero weight. */
+            (*first)[i] = LIM(c, 0, in - *taps);
+            for (t = 0; t < *taps; t++) {
+                c = (*first)[i] + t;
+                if (filter == dcraw_box_resize) {
+                    /* Output pixel i covers [i*div, (i+1)*div) and input
+                     * pixel c covers [c*mul, (c+1)*mul). */
+                    int overlap = MIN((c + 1) * mul, (i + 1) * div) -
+                                  MAX(c * mul, i * div);
+                    w[t] = overlap > 0 ? (double)overlap / div : 0;
+                } else {
+                    w[t] = resize_kernel(filter, (c - center) / scale);
+                    sum += w[t];
+                }
+            }
+            if (filter != dcraw_box_resize)
+                for (t = 0; t < *taps; t++) w[t] /= sum;
+        }
+        return weight;
+    }
+
+    /* Number of rows resized horizontally together in a temporary buffer */
+#define RESIZE_BAND 64
+    /* Number of columns resized vertically together by one thread */
+#define RESIZE_STRIP 16
+
+    /*
+     * Downsize the image in place so that max(height,width) becomes size.
+     * The two axes are resized separately. Rows are resized in bands that
+     * are written back over input rows that were already consumed. Columns
+     * are then resized in strips, each thread holding one strip of the
+     * input in a small private buffer.
+     */
+    int dcraw_image_resize(dcraw_image_data *image, int size, int filter)
+    {
+        int h, w, wid, hei, colors, taps, *first, band, r, c, cl, t;
+        float *weight;
+        dcraw_image_type *bandBuf;
         int mul = size, div = MAX(image->height, image->width);
 
         if (mul > div) return DCRAW_ERROR;
@@ -756,48 +887,74 @@ start:
         h = image->height * mul / div;
         w = image->width * mul / div;
         wid = image->width;
-        iBuf = (guint64(*)[4])g_new0(guint64, h * w * 4);
-        norm = div * div;
-
-        for (r = 0; r < image->height; r++) {
-            /* r should be divided between ri and rii */
-            ri = r * mul / div;
-            rii = (r + 1) * mul / div;
-            /* with weights riw and riiw (riw+riiw==mul) */
-            riw = rii * div - r * mul;
-            riiw = (r + 1) * mul - rii * div;
-            if (rii >= h) {
-                rii = h - 1;
-                riiw = 0;
-            }
-            if (ri >= h) {
-                ri = h - 1;
-                riw = 0;
-            }
-            for (c = 0; c < image->width; c++) {
-                ci = c * mul / div;
-                cii = (c + 1) * mul / div;
-                ciw = cii * div - c * mul;
-                ciiw = (c + 1) * mul - cii * div;
-                if (cii >= w) {
-                    cii = w - 1;
-                    ciiw = 0;
-                }
-                if (ci >= w) {
-                    ci = w - 1;
-                    ciw = 0;
+        hei = image->height;
+        colors = image->colors;
+
+        /* Resize the rows from wid to w pixels. Band rows start at input
+         * row band and are stored at band * w, which is below the input
+         * rows of the following bands. */
+        weight = resize_weights(filter, wid, w, mul, div, &taps, &first);
+        bandBuf = g_new0(dcraw_image_type, RESIZE_BAND * w);
+        for (band = 0; band < hei; band += RESIZE_BAND) {
+            int rows = MIN(RESIZE_BAND, hei - band);
+#ifdef _OPENMP
+            #pragma omp parallel for schedule(static) private(r,c,cl,t)
+#endif
+            for (r = 0; r < rows; r++) {
+                dcraw_image_type *in = image->image + (band + r) * wid;
+                for (c = 0; c < w; c++) {
+                    const float *wc = weight + c * taps;
+                    dcraw_image_type *pix = in + first[c];
+                    for (cl = 0; cl < colors; cl++) {
+                        float sum = 0.5;
+                        for (t = 0; t < taps; t++)
+                            sum += wc[t] * pix[t][cl];
+                        bandBuf[r * w + c][cl] = CLIP(sum);
+                    }
                 }
-                for (cl = 0; cl < image->colors; cl++) {
-                    iBuf[ri * w + ci ][cl] += image->image[r * wid + c][cl] * riw * ciw ;
-                    iBuf[ri * w + cii][cl] += image->image[r * wid + c][cl] * riw * ciiw;
-                    iBuf[rii * w + ci ][cl] += image->image[r * wid + c][cl] * riiw * ciw ;
-                    iBuf[rii * w + cii][cl] += image->image[r * wid + c][cl] * riiw * ciiw;
+            }
+            memcpy(image->image + band * w, bandBuf,
+                   rows * w * sizeof(dcraw_image_type));
+        }
+        g_free(bandBuf);
+        g_free(weight);
+        g_free(first);
+
+        /* Resize the columns from hei to h pixels. Each strip of columns
+         * is copied aside, since its output rows overwrite input rows. */
+        weight = resize_weights(filter, hei, h, mul, div, &taps, &first);
+#ifdef _OPENMP
+        #pragma omp parallel default(shared) private(r,c,cl,t)
+#endif
+        {
+            dcraw_image_type *strip = g_new(dcraw_image_type, hei * RESIZE_STRIP);
+            int s;
+#ifdef _OPENMP
+            #pragma omp for schedule(dynamic)
+#endif
+            for (s = 0; s < w; s += RESIZE_STRIP) {
+                int cols = MIN(RESIZE_STRIP, w - s);
+                for (r = 0; r < hei; r++)
+                    memcpy(strip + r * cols, image->image + r * w + s,
+                           cols * sizeof(dcraw_image_type));
+                for (r = 0; r < h; r++) {
+                    const float *wr = weight + r * taps;
+                    dcraw_image_type *out = image->image + r * w + s;
+                    for (c = 0; c < cols; c++) {
+                        dcraw_image_type *pix = strip + first[r] * cols + c;
+                        for (cl = 0; cl < colors; cl++) {
+                            float sum = 0.5;
+                            for (t = 0; t < taps; t++)
+                                sum += wr[t] * pix[t * cols][cl];
+                            out[c][cl] = CLIP(sum);
+                        }
+                    }
                 }
             }
+            g_free(strip);
         }
-        for (c = 0; c < h * w; c++) for (cl = 0; cl < image->colors; cl++)
-                image->image[c][cl] = iBuf[c][cl] / norm;
-        g_free(iBuf);
+        g_free(weight);
+        g_free(first);
         image->height = h;
         image->width = w;
         return DCRAW_SUCCESS;
@@ -888,40 +1045,93 @@ start:
     /*
      * Do black level adjustment, dark frame subtraction and white balance
      * (plus normalization to use the full 16 bit pixel value range) in one
-     * pass.
-     *
-     * TODO: recode and optimize dark frame path
+     * pass, by dcraw_finalize_raw_row().
      */
     void dcraw_finalize_raw(dcraw_data *h, dcraw_data *dark, int rgbWB[4])
     {
-        const int pixels = h->raw.width * h->raw.height;
-        const unsigned black = dark ? MAX(h->black - dark->black, 0) : h->black;
+        const int w = h->raw.width, height = h->raw.height;
+        dcraw_image_type *image = h->raw.image, *src = image;
         if (h->colors == 3)
             rgbWB[3] = rgbWB[1];
         if (dark) {
+            /* The neighbours of hot dark pixels are read unfinalized */
+            src = g_new(dcraw_image_type, w * height);
+            memcpy(src, image, w * height * sizeof(dcraw_image_type));
+        }
 #ifdef _OPENMP
-            #pragma omp parallel for schedule(static) default(none) \
-            shared(h,dark,rgbWB)
-#endif
-            for (int i = 0; i < pixels; i++) {
-                int cc;
-                for (cc = 0; cc < 4; cc++) {
-                    gint32 p = (gint64)(get_pixel(h, dark, i, cc, pixels) - black) *
-                               rgbWB[cc] / 0x10000;
-                    h->raw.image[i][cc] = MIN(MAX(p, 0), 0xFFFF);
-                }
-            }
-        } else {
-#ifdef _OPENMP
-            #pragma omp parallel for schedule(static) default(none) \
-            shared(h,dark,rgbWB)
+        #pragma omp parallel for schedule(static) default(none) \
+        shared(h,dark,rgbWB,image,src)
 #endif
-            for (int i = 0; i < pixels; i++) {
-                int cc;
-                for (cc = 0; cc < 4; cc++)
-                    h->raw.image[i][cc] = MIN(MAX(
-                                                  ((gint64)h->raw.image[i][cc] - black) *
-                                                  rgbWB[cc] / 0x10000, 0), 0xFFFF);
+        for (int y = 0; y < height; y++)
+            dcraw_finalize_raw_row(h, dark, rgbWB, y,
+                                   dark && y > 0 ? src + (y - 1) * w : NULL,
+                                   src + y * w,
+                                   dark && y + 1 < height ? src + (y + 1) * w : NULL,
+                                   image + y * w);
+        if (src != image)
+            g_free(src);
+    }
+
+    /*
+     * dcraw_finalize_raw() of row y alone, for callers that process the
+     * raw image in bands. 'row' is read and the result written to 'out'.
+     *
+     * The most obvious algorithm for dark frame removal is to simply
+     * subtract the dark frame from the image (rounding negative values to
+     * zero).  However, this leaves holes in the resulting image that need
+     * to be interpolated from the surrounding pixels.
+     *
+     * The processing works by subtracting the dark frame as usual for most
+     * pixels.  For all pixels where the dark frame is brighter than a given
+     * threshold, the result is instead calculated as the average of the
+     * dark-adjusted values of the 4 surrounding pixels.  By this method,
+     * only hot pixels (as determined by the threshold) are examined and
+     * recalculated. These neighbours are read from 'row', 'above' and
+     * 'below', so 'out' must then be a different buffer. 'above' and
+     * 'below' are NULL at the image borders.
+     */
+    void dcraw_finalize_raw_row(const dcraw_data *h, const dcraw_data *dark,
+                                const int rgbWB[4], int y,
+                                const dcraw_image_type *above,
+                                const dcraw_image_type *row,
+                                const dcraw_image_type *below,
+                                dcraw_image_type *out)
+    {
+        const int w = h->raw.width;
+        const unsigned black = dark ? MAX(h->black - dark->black, 0) : h->black;
+        const int wb[4] = { rgbWB[0], rgbWB[1], rgbWB[2],
+                            h->colors == 3 ? rgbWB[1] : rgbWB[3]
+                          };
+        if (dark == NULL) {
+            for (int x = 0; x < w; x++)
+                for (int cc = 0; cc < 4; cc++)
+                    out[x][cc] = MIN(MAX(((gint64)row[x][cc] - black) *
+                                         wb[cc] / 0x10000, 0), 0xFFFF);
+            return;
+        }
+        // Mirror the missing neighbours at the image borders
+        const dcraw_image_type *d = dark->raw.image + y * w;
+        const dcraw_image_type *dAbove = above != NULL ? d - w :
+                                         below != NULL ? d + w : d;
+        const dcraw_image_type *dBelow = below != NULL ? d + w : dAbove;
+        if (above == NULL)
+            above = below != NULL ? below : row;
+        if (below == NULL)
+            below = above;
+        for (int x = 0; x < w; x++) {
+            int left = x > 0 ? x - 1 : MIN(x + 1, w - 1);
+            int right = x < w - 1 ? x + 1 : MAX(x - 1, 0);
+            for (int cc = 0; cc < 4; cc++) {
+                int pixel;
+                if (d[x][cc] <= dark->thresholds[cc])
+                    pixel = MAX(row[x][cc] - d[x][cc], 0);
+                else
+                    pixel = (MAX(row[left][cc] - d[left][cc], 0) +
+                             MAX(row[right][cc] - d[right][cc], 0) +
+                             MAX(above[x][cc] - dAbove[x][cc], 0) +
+                             MAX(below[x][cc] - dBelow[x][cc], 0)) / 4;
+                gint32 p = ((gint64)pixel - black) * wb[cc] / 0x10000;
+                out[x][cc] = MIN(MAX(p, 0), 0xFFFF);
             }
         }
     }
@@ -1014,6 +1224,7 @@ start:
     {
         DCRaw *d = (DCRaw *)h->dcraw;
         g_free(h->raw.image);
+        dcraw_unmap_input(d);
         delete d;
     }
 
@@ -56,19 +56,28 @@ enum { dcraw_ahd_interpolation,
        dcraw_ppg_interpolation, dcraw_bilinear_interpolation,
        dcraw_xtrans_interpolation, dcraw_none_interpolation
      };
+enum { dcraw_box_resize, dcraw_lanczos3_resize, dcraw_mitchell_resize };
 enum { unknown_thumb_type, jpeg_thumb_type, ppm_thumb_type };
 int dcraw_open(dcraw_data *h, char *filename);
+int dcraw_open_buffer(dcraw_data *h, char *filename, void *buffer, size_t size);
 int dcraw_load_raw(dcraw_data *h);
+void dcraw_release_input(dcraw_data *h);
 int dcraw_load_thumb(dcraw_data *h, dcraw_image_data *thumb);
 int dcraw_finalize_shrink(dcraw_image_data *f, dcraw_data *h,
                           int scale);
-int dcraw_image_resize(dcraw_image_data *image, int size);
+int dcraw_image_resize(dcraw_image_data *image, int size, int filter);
 int dcraw_image_stretch(dcraw_image_data *image, double pixel_aspect);
 int dcraw_flip_image(dcraw_image_data *image, int flip);
 int dcraw_set_color_scale(dcraw_data *h, int useCameraWB);
 void dcraw_wavelet_denoise(dcraw_data *h, float threshold);
 void dcraw_wavelet_denoise_shrinked(dcraw_image_data *f, float threshold);
 void dcraw_finalize_raw(dcraw_data *h, dcraw_data *dark, int rgbWB[4]);
+void dcraw_finalize_raw_row(const dcraw_data *h, const dcraw_data *dark,
+                            const int rgbWB[4], int y,
+                            const dcraw_image_type *above,
+                            const dcraw_image_type *row,
+                            const dcraw_image_type *below,
+                            dcraw_image_type *out);
 int dcraw_finalize_interpolate(dcraw_image_data *f, dcraw_data *h,
                                int interpolation, int smoothing);
 void dcraw_close(dcraw_data *h);
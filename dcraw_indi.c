@@ -114,6 +114,15 @@ static void CLASS hat_transform(float *temp, float *base, int st, int size, int
         temp[i] = 2 * base[st * i] + base[st * (i - sc)] + base[st * (2 * size - 2 - (i + sc))];
 }
 
+/* The planes are denoised in strips of up to WAVELET_STRIP rows, so that
+ * more than four threads can work on them and the temporary buffers do not
+ * grow with the image size. Each strip is transformed together with
+ * WAVELET_HALO rows above and below it. This is the reach of the five
+ * levels of the a-trous transform (1+2+4+8+16 rows), so the result is
+ * the same as when transforming the whole plane. */
+#define WAVELET_STRIP 256
+#define WAVELET_HALO 31
+
 void CLASS wavelet_denoise_INDI(ushort(*image)[4], const int black,
                                 const int iheight, const int iwidth,
                                 const int height, const int width,
@@ -123,45 +132,68 @@ void CLASS wavelet_denoise_INDI(ushort(*image)[4], const int black,
 {
     float *fimg = 0, thold, mul[2], avg, diff;
     int size, lev, hpass, lpass, row, col, nc, c, i, wlast;
-    ushort *window[4];
+    int strips, stripHeight, task, top, start, end, bottom, b;
+    ushort *window[4], (*halo)[4], (*src)[4];
     static const float noise[] =
     { 0.8002, 0.2735, 0.1202, 0.0585, 0.0291, 0.0152, 0.0080, 0.0044 };
 
 //  dcraw_message (dcraw, DCRAW_VERBOSE,_("Wavelet denoising...\n")); /*UF*/
 
     /* Scaling is done somewhere else - NKBJ*/
-    size = iheight * iwidth;
-    float temp[iheight + iwidth];
     if ((nc = colors) == 3 && filters) nc++;
-    progress(PROGRESS_WAVELET_DENOISE, -nc * 5);
+    strips = MAX((iheight + WAVELET_STRIP - 1) / WAVELET_STRIP, 1);
+    stripHeight = (iheight + strips - 1) / strips;
+    /* Each strip overwrites its own rows of image. Save the rows around
+     * the boundaries between strips first, since the neighbouring strips
+     * also read them. Boundary b is at row (b+1)*stripHeight. */
+    halo = g_new(dcraw_image_type,
+                 (size_t)(strips - 1) * 2 * WAVELET_HALO * iwidth);
+    for (b = 0; b < strips - 1; b++) {
+        top = (b + 1) * stripHeight - WAVELET_HALO;
+        bottom = MIN((b + 1) * stripHeight + WAVELET_HALO, iheight);
+        memcpy(halo + (size_t)b * 2 * WAVELET_HALO * iwidth,
+               image + (size_t)top * iwidth,
+               (size_t)(bottom - top) * iwidth * sizeof * image);
+    }
+    progress(PROGRESS_WAVELET_DENOISE, -nc * strips * 5);
 #ifdef _OPENMP
-#if defined(__sun) && !defined(__GNUC__)	/* Fix bug #3205673 - NKBJ */
-    #pragma omp parallel for				\
-    default(none)					\
-    shared(nc,image,size,noise)				\
-    private(c,i,hpass,lev,lpass,row,col,thold,fimg,temp)
-#else
-    #pragma omp parallel for				\
-    default(none)					\
-    shared(nc,image,size)				\
-    private(c,i,hpass,lev,lpass,row,col,thold,fimg,temp)
+    #pragma omp parallel for schedule(dynamic) default(shared)	\
+    private(c,i,hpass,lev,lpass,row,col,thold,fimg,size,b,top,start,end,bottom,src)
 #endif
-#endif
-    FORC(nc) {			/* denoise R,G1,B,G3 individually */
+    for (task = 0; task < nc * strips; task++) {
+        /* denoise R,G1,B,G3 individually */
+        c = task % nc;
+        b = task / nc;
+        start = b * stripHeight;
+        end = MIN(start + stripHeight, iheight);
+        top = MAX(start - WAVELET_HALO, 0);
+        bottom = MIN(end + WAVELET_HALO, iheight);
+        size = (bottom - top) * iwidth;
+        float temp[MAX(bottom - top, iwidth)];
         fimg = (float *) malloc(size * 3 * sizeof * fimg);
-        for (i = 0; i < size; i++)
-            fimg[i] = 256 * sqrt(image[i][c] /*<< scale*/);
+        for (row = top; row < bottom; row++) {
+            if (row < start)
+                src = halo + ((size_t)(b - 1) * 2 * WAVELET_HALO
+                              + row - start + WAVELET_HALO) * iwidth;
+            else if (row >= end)
+                src = halo + ((size_t)b * 2 * WAVELET_HALO
+                              + row - end + WAVELET_HALO) * iwidth;
+            else
+                src = image + (size_t)row * iwidth;
+            for (col = 0; col < iwidth; col++)
+                fimg[(row - top) * iwidth + col] = 256 * sqrt(src[col][c] /*<< scale*/);
+        }
         for (hpass = lev = 0; lev < 5; lev++) {
             progress(PROGRESS_WAVELET_DENOISE, 1);
             lpass = size * ((lev & 1) + 1);
-            for (row = 0; row < iheight; row++) {
+            for (row = 0; row < bottom - top; row++) {
                 hat_transform(temp, fimg + hpass + row * iwidth, 1, iwidth, 1 << lev);
                 for (col = 0; col < iwidth; col++)
                     fimg[lpass + row * iwidth + col] = temp[col] * 0.25;
             }
             for (col = 0; col < iwidth; col++) {
-                hat_transform(temp, fimg + lpass + col, iwidth, iheight, 1 << lev);
-                for (row = 0; row < iheight; row++)
+                hat_transform(temp, fimg + lpass + col, iwidth, bottom - top, 1 << lev);
+                for (row = 0; row < bottom - top; row++)
                     fimg[lpass + row * iwidth + col] = temp[row] * 0.25;
             }
             thold = threshold * noise[lev];
@@ -174,10 +206,11 @@ void CLASS wavelet_denoise_INDI(ushort(*image)[4], const int black,
             }
             hpass = lpass;
         }
-        for (i = 0; i < size; i++)
-            image[i][c] = CLIP(SQR(fimg[i] + fimg[lpass + i]) / 0x10000);
+        for (i = (start - top) * iwidth; i < (end - top) * iwidth; i++)
+            image[top * iwidth + i][c] = CLIP(SQR(fimg[i] + fimg[lpass + i]) / 0x10000);
         free(fimg);
     }
+    g_free(halo);
     if (filters && colors == 3) {  /* pull G1 and G3 closer together */
         for (row = 0; row < 2; row++)
             mul[row] = 0.125 * pre_mul[FC(row + 1, 0) | 1] / pre_mul[FC(row, 0) | 1];
@@ -556,33 +589,51 @@ void CLASS ppg_interpolate_INDI(ushort(*image)[4], const unsigned filters,
     }
 }
 
-void CLASS cielab_INDI(ushort rgb[3], short lab[3], const int colors,
-                       const float rgb_cam[3][4])
+static float cielab_cbrt[0x10000];
+
+static gpointer cielab_cbrt_build(gpointer data)
 {
-    int c, i, j, k;
-    float r, xyz[3];
-    static float cbrt[0x10000], xyz_cam[3][4];
-
-    if (!rgb) {
-        for (i = 0; i < 0x10000; i++) {
-            r = i / 65535.0;
-            cbrt[i] = r > 0.008856 ? pow(r, (float)(1 / 3.0)) : 7.787 * r + 16 / 116.0;
-        }
-        for (i = 0; i < 3; i++)
-            for (j = 0; j < colors; j++)
-                for (xyz_cam[i][j] = k = 0; k < 3; k++)
-                    xyz_cam[i][j] += xyz_rgb[i][k] * rgb_cam[k][j] / d65_white[i];
-        return;
+    int i;
+    float r;
+    (void)data;
+    for (i = 0; i < 0x10000; i++) {
+        r = i / 65535.0;
+        cielab_cbrt[i] = r > 0.008856 ? pow(r, (float)(1 / 3.0)) : 7.787 * r + 16 / 116.0;
     }
+    return cielab_cbrt;
+}
+
+/* The cube root table is the same for all images and is built only once.
+ * The camera to XYZ matrix belongs to the caller, so that several images
+ * can be interpolated at the same time. */
+static void CLASS cielab_init_INDI(float xyz_cam[3][4], const int colors,
+                                   const float rgb_cam[3][4])
+{
+    static GOnce once = G_ONCE_INIT;
+    int i, j, k;
+
+    g_once(&once, cielab_cbrt_build, NULL);
+    for (i = 0; i < 3; i++)
+        for (j = 0; j < colors; j++)
+            for (xyz_cam[i][j] = k = 0; k < 3; k++)
+                xyz_cam[i][j] += xyz_rgb[i][k] * rgb_cam[k][j] / d65_white[i];
+}
+
+static void CLASS cielab_INDI(ushort rgb[3], short lab[3], const int colors,
+                              float xyz_cam[3][4])
+{
+    int c;
+    float xyz[3];
+
     xyz[0] = xyz[1] = xyz[2] = 0.5;
     FORCC {
         xyz[0] += xyz_cam[0][c] * rgb[c];
         xyz[1] += xyz_cam[1][c] * rgb[c];
         xyz[2] += xyz_cam[2][c] * rgb[c];
     }
-    xyz[0] = cbrt[CLIP((int) xyz[0])];
-    xyz[1] = cbrt[CLIP((int) xyz[1])];
-    xyz[2] = cbrt[CLIP((int) xyz[2])];
+    xyz[0] = cielab_cbrt[CLIP((int) xyz[0])];
+    xyz[1] = cielab_cbrt[CLIP((int) xyz[1])];
+    xyz[2] = cielab_cbrt[CLIP((int) xyz[2])];
     lab[0] = 64 * (116 * xyz[1] - 16);
     lab[1] = 64 * 500 * (xyz[0] - xyz[1]);
     lab[2] = 64 * 200 * (xyz[1] - xyz[2]);
@@ -610,10 +661,11 @@ void CLASS xtrans_interpolate_INDI(ushort(*image)[4], const unsigned filters,
     short(*lab)    [TS][3], (*lix)[3];
     float(*drv)[TS][TS], diff[6], tr;
     char(*homo)[TS][TS], *buffer;
+    float xyz_cam[3][4];
 
     dcraw_message(dcraw, DCRAW_VERBOSE, _("%d-pass X-Trans interpolation...\n"), passes); /*NKBJ*/
 
-    cielab_INDI(0, 0, colors, rgb_cam);
+    cielab_init_INDI(xyz_cam, colors, rgb_cam);
     ndir = 4 << (passes > 1);
 
     /* Map a green hexagon around each non-green pixel and vice versa:      */
@@ -792,7 +844,7 @@ void CLASS xtrans_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                 for (d = 0; d < ndir; d++) {
                     for (row = 2; row < mrow - 2; row++)
                         for (col = 2; col < mcol - 2; col++)
-                            cielab_INDI(rgb[d][row][col], lab[row][col], colors, rgb_cam);
+                            cielab_INDI(rgb[d][row][col], lab[row][col], colors, xyz_cam);
                     for (f = dir[d & 3], row = 3; row < mrow - 3; row++)
                         for (col = 3; col < mcol - 3; col++) {
                             lix = &lab[row][col];
@@ -864,7 +916,10 @@ void CLASS ahd_interpolate_INDI(ushort(*image)[4], const unsigned filters,
     short(*lab)[TS][TS][3], (*lix)[3];
     char(*homo)[TS][TS], *buffer;
 
+    float xyz_cam[3][4];
+
     dcraw_message(dcraw, DCRAW_VERBOSE, _("AHD interpolation...\n")); /*UF*/
+    cielab_init_INDI(xyz_cam, colors, rgb_cam);
 
 #ifdef _OPENMP
     #pragma omp parallel				\
@@ -872,7 +927,6 @@ void CLASS ahd_interpolate_INDI(ushort(*image)[4], const unsigned filters,
     private(top, left, row, col, pix, rix, lix, c, val, d, tc, tr, i, j, ldiff, abdiff, leps, abeps, hm, buffer, rgb, lab, homo)
 #endif
     {
-        cielab_INDI(0, 0, colors, rgb_cam);
         border_interpolate_INDI(height, width, image, filters, colors, 5, h);
         buffer = (char *) malloc(26 * TS * TS);
         merror(buffer, "ahd_interpolate()");
@@ -923,7 +977,7 @@ void CLASS ahd_interpolate_INDI(ushort(*image)[4], const unsigned filters,
                             rix[0][c] = CLIP(val);
                             c = FC(row, col);
                             rix[0][c] = pix[0][c];
-                            cielab_INDI(rix[0], lix[0], colors, rgb_cam);
+                            cielab_INDI(rix[0], lix[0], colors, xyz_cam);
                         }
                 /*  Build homogeneity maps from the CIELab images: */
                 memset(homo, 0, 2 * TS * TS);
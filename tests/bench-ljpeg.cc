@@ -0,0 +1,128 @@
+/*
+ * UFRaw - Unidentified Flying Raw converter for digital camera images
+ *
+ * bench-ljpeg.cc - Compare and time the lossless JPEG decoders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Decodes $UFRAW_TEST_RAW once through stdio, which uses getbithuff(),
+ * and once from memory, which uses the table driven ljpeg_row(). The
+ * decoded images must be identical. The test is skipped for files that
+ * are not lossless JPEG (CR2, sRaw or lossless DNG).
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include "uf_glib.h"
+#include "dcraw_api.h"
+#include "dcraw.h"
+#include "check.h"
+
+typedef struct {
+    ushort *raw_image;
+    size_t raw_size;
+    ushort(*image)[4];
+    size_t image_size;
+    double seconds;
+} decoded;
+
+/* Decode filename, from data if it is not NULL, the best of 'runs' times */
+static int decode(char *filename, const void *data, size_t size, int runs,
+                  decoded *out)
+{
+    memset(out, 0, sizeof(*out));
+    for (int run = 0; run < runs; run++) {
+        DCRaw *d = new DCRaw;
+        d->verbose = 0;
+        d->ifname = g_strdup(filename);
+        d->ifname_display = g_strdup(filename);
+        d->ifp = g_fopen(filename, "rb");
+        if (d->ifp == NULL) {
+            g_printerr("Cannot open %s\n", filename);
+            return 1;
+        }
+        if (data != NULL)
+            d->ifp_set_data(d->ifp, data, size);
+        if (setjmp(d->failure)) {
+            g_printerr("%s: decoding failed\n", filename);
+            return 1;
+        }
+        d->identify();
+        if (d->load_raw != &DCRaw::lossless_jpeg_load_raw &&
+                d->load_raw != &DCRaw::canon_sraw_load_raw &&
+                d->load_raw != &DCRaw::lossless_dng_load_raw) {
+            g_printerr("%s %s: not a lossless JPEG raw file\n",
+                       d->make, d->model);
+            fclose(d->ifp);
+            delete d;
+            return CHECK_SKIP;
+        }
+        d->iheight = d->height;
+        d->iwidth = d->width;
+        out->raw_size = (size_t)(d->raw_height + 7) * d->raw_width * 4;
+        out->image_size = (size_t)d->iheight * d->iwidth + d->meta_length;
+        d->raw_image = g_new0(ushort, out->raw_size);
+        d->image = g_new0(dcraw_image_type, out->image_size);
+        d->meta_data = (char *)(d->image + d->iheight * d->iwidth);
+        d->fseek(d->ifp, 0, SEEK_END);
+        d->ifpSize = d->ftell(d->ifp);
+        d->fseek(d->ifp, d->data_offset, SEEK_SET);
+        GTimer *timer = g_timer_new();
+        (d->*d->load_raw)();
+        double seconds = g_timer_elapsed(timer, NULL);
+        g_timer_destroy(timer);
+        if (run == 0 || seconds < out->seconds)
+            out->seconds = seconds;
+        g_free(out->raw_image);
+        g_free(out->image);
+        out->raw_image = d->raw_image;
+        out->image = d->image;
+        d->raw_image = NULL;
+        d->image = NULL;
+        fclose(d->ifp);
+        delete d;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    char *filename = check_raw_file(argc, argv);
+    int runs = argc > 2 ? atoi(argv[2]) : 3;
+    gchar *data;
+    gsize size;
+    decoded ref, mem;
+    int status;
+
+    if (runs < 1) runs = 1;
+    if (!g_file_get_contents(filename, &data, &size, NULL)) {
+        g_printerr("Cannot read %s\n", filename);
+        return 1;
+    }
+    if ((status = decode(filename, NULL, 0, runs, &ref)) != 0)
+        return status;
+    if ((status = decode(filename, data, size, runs, &mem)) != 0)
+        return status;
+    if (memcmp(ref.raw_image, mem.raw_image,
+               ref.raw_size * sizeof(ushort)) != 0 ||
+            memcmp(ref.image, mem.image, ref.image_size * 4 * sizeof(ushort))) {
+        g_printerr("%s: the decoders differ\n", filename);
+        return 1;
+    }
+    g_print("%s: identical, getbithuff %.3f s, table %.3f s\n",
+            filename, ref.seconds, mem.seconds);
+    g_free(ref.raw_image);
+    g_free(ref.image);
+    g_free(mem.raw_image);
+    g_free(mem.image);
+    g_free(data);
+    return 0;
+}
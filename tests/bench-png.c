@@ -0,0 +1,127 @@
+/*
+ * UFRaw - Unidentified Flying Raw converter for digital camera images
+ *
+ * bench-png.c - Compare and time the PNG writers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Saves $UFRAW_TEST_RAW as 8 and 16 bit PNG with one OpenMP thread, which
+ * uses png_row_writer(), and with several threads, which uses
+ * png_parallel_row_writer(). The files read back with libpng must have
+ * the same pixels. The times include developing the image.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+#include "check.h"
+#ifdef HAVE_LIBPNG
+#include <png.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if defined(HAVE_LIBPNG) && defined(_OPENMP)
+
+/* Read the pixels of a PNG file, return NULL on failure */
+static guint8 *read_png(const char *filename, size_t *size)
+{
+    FILE *in = g_fopen(filename, "rb");
+    png_structp png;
+    png_infop info;
+    guint8 * volatile pixels = NULL;
+    if (in == NULL)
+        return NULL;
+    png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    info = png_create_info_struct(png);
+    if (setjmp(png_jmpbuf(png))) {
+        g_free(pixels);
+        png_destroy_read_struct(&png, &info, NULL);
+        fclose(in);
+        return NULL;
+    }
+    png_init_io(png, in);
+    png_read_png(png, info, PNG_TRANSFORM_IDENTITY, NULL);
+    png_bytepp rows = png_get_rows(png, info);
+    png_uint_32 height = png_get_image_height(png, info);
+    size_t rowbytes = png_get_rowbytes(png, info);
+    png_uint_32 y;
+    *size = rowbytes * height;
+    pixels = g_malloc(*size);
+    for (y = 0; y < height; y++)
+        memcpy(pixels + y * rowbytes, rows[y], rowbytes);
+    png_destroy_read_struct(&png, &info, NULL);
+    fclose(in);
+    return pixels;
+}
+
+int main(int argc, char **argv)
+{
+    char *filename = check_raw_file(argc, argv);
+    int threads[2] = { 1, MAX(2, omp_get_num_procs()) };
+    const char *output[2] = { "bench-png-serial.png", "bench-png-parallel.png" };
+    int depth, t, errors = 0;
+    conf_data rc;
+    ufraw_data *uf;
+
+    check_conf(&rc);
+    rc.type = png_type;
+    if ((uf = check_load(filename, &rc)) == NULL)
+        return 1;
+    for (depth = 8; depth <= 16; depth += 8) {
+        guint8 *pixels[2];
+        size_t size[2];
+        double seconds[2];
+        struct stat st[2];
+        uf->conf->profile[out_profile]
+        [uf->conf->profileIndex[out_profile]].BitDepth = depth;
+        for (t = 0; t < 2; t++) {
+            omp_set_num_threads(threads[t]);
+            g_strlcpy(uf->conf->outputFilename, output[t], max_path);
+            GTimer *timer = g_timer_new();
+            int status = ufraw_write_image(uf);
+            if (status != UFRAW_SUCCESS && status != UFRAW_WARNING) {
+                g_printerr("%s: %s\n", output[t], ufraw_get_message(uf));
+                return 1;
+            }
+            seconds[t] = g_timer_elapsed(timer, NULL);
+            g_timer_destroy(timer);
+            pixels[t] = read_png(output[t], &size[t]);
+            if (pixels[t] == NULL || g_stat(output[t], &st[t]) != 0) {
+                g_printerr("Cannot read back %s\n", output[t]);
+                return 1;
+            }
+            g_unlink(output[t]);
+        }
+        if (size[0] != size[1] || memcmp(pixels[0], pixels[1], size[0]) != 0) {
+            g_printerr("%d-bit: the PNG writers differ\n", depth);
+            errors++;
+        }
+        g_print("%d-bit: libpng %.3f s, %ld bytes; "
+                "%d threads %.3f s, %ld bytes\n", depth,
+                seconds[0], (long)st[0].st_size, threads[1],
+                seconds[1], (long)st[1].st_size);
+        g_free(pixels[0]);
+        g_free(pixels[1]);
+    }
+    check_close(uf);
+    return errors > 0;
+}
+
+#else
+
+int main(void)
+{
+    g_printerr("The parallel PNG writer needs libpng and OpenMP\n");
+    return CHECK_SKIP;
+}
+
+#endif
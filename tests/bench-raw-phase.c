@@ -0,0 +1,95 @@
+/*
+ * UFRaw - Unidentified Flying Raw converter for digital camera images
+ *
+ * bench-raw-phase.c - Compare and time the raw phase conversions
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Converts the raw phase of $UFRAW_TEST_RAW, which copies and finalizes
+ * the raw image in one sweep over bands of rows, and compares it with the
+ * passes it replaced: a copy of the whole raw image, then
+ * dcraw_finalize_raw() over the copy. Both must give the same image.
+ * Despeckling and the TCA correction, which take passes of their own in
+ * the raw phase, are turned off, so that both sides time the same steps.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include "dcraw_api.h"
+#include "check.h"
+
+int main(int argc, char **argv)
+{
+    char *filename = check_raw_file(argc, argv);
+    int runs = argc > 2 ? atoi(argv[2]) : 3;
+    double seconds[2] = { 0, 0 };
+    conf_data rc;
+    ufraw_data *uf;
+    int run, i;
+
+    if (runs < 1) runs = 1;
+    check_conf(&rc);
+    /* Without denoising, hot pixel shaving and despeckling the raw phase
+     * is only the copy and dcraw_finalize_raw() */
+    rc.threshold = 0;
+    rc.hotpixel = 0;
+    for (i = 0; i < 3; i++)
+        rc.despeckleWindow[i] = 0;
+    if ((uf = check_load(filename, &rc)) == NULL)
+        return 1;
+#ifdef HAVE_LENSFUN
+    /* Nor the TCA correction */
+    ufarray_set_index(ufgroup_element(ufgroup_element(uf->conf->ufobject,
+                                      ufLensfun), ufTCA), 0);
+#endif
+    /* Set up the white balance and the phase buffers */
+    ufraw_convert_image(uf);
+
+    dcraw_data *raw = uf->raw;
+    size_t size = (size_t)raw->raw.width * raw->raw.height *
+                  sizeof(dcraw_image_type);
+    dcraw_data ref = *raw;
+    ref.raw.image = NULL;
+    for (run = 0; run < runs; run++) {
+        ufraw_invalidate_layer(uf, ufraw_raw_phase);
+        GTimer *timer = g_timer_new();
+        ufraw_convert_image_area(uf, 0, ufraw_raw_phase);
+        double fused = g_timer_elapsed(timer, NULL);
+
+        int rgbWB[4];
+        memcpy(rgbWB, uf->developer->rgbWB, sizeof rgbWB);
+        g_free(ref.raw.image);
+        g_timer_start(timer);
+        ref.raw.image = g_memdup(raw->raw.image, size);
+        dcraw_finalize_raw(&ref, NULL, rgbWB);
+        double multi = g_timer_elapsed(timer, NULL);
+        g_timer_destroy(timer);
+        if (run == 0 || fused < seconds[0])
+            seconds[0] = fused;
+        if (run == 0 || multi < seconds[1])
+            seconds[1] = multi;
+    }
+    ufraw_image_data *img = &uf->Images[ufraw_raw_phase];
+    int status = 0;
+    if ((size_t)img->height * img->rowstride != size ||
+            memcmp(img->buffer, ref.raw.image, size) != 0) {
+        g_printerr("%s: the raw phases differ\n", filename);
+        status = 1;
+    }
+    const char *names[2] = { "one sweep", "copy and finalize" };
+    for (i = 0; i < 2; i++)
+        g_print("%s: %.3f s\n", names[i], seconds[i]);
+    g_print("%d x %d raw image: %.0f%% of the time\n",
+            raw->raw.width, raw->raw.height,
+            100.0 * seconds[0] / MAX(seconds[1], 1e-9));
+    g_free(ref.raw.image);
+    check_close(uf);
+    return status;
+}
@@ -0,0 +1,95 @@
+/*
+ * UFRaw - Unidentified Flying Raw converter for digital camera images
+ *
+ * bench-wb-presets.c - Compare and time the white balance preset lookups
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Looks up the presets of every row of wb_preset[] with wb_preset_find()
+ * and with a linear scan of the table, with the make and model in upper
+ * case. Both must return the same span of the table.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include "ufraw.h"
+#include "check.h"
+
+/* The search wb_preset_find() replaced */
+static const wb_data *wb_preset_scan(const char *make, const char *model,
+                                     const char *name, int *count)
+{
+    int i, first;
+    for (first = 0; first < wb_preset_count; first++)
+        if (g_ascii_strcasecmp(wb_preset[first].make, make) == 0 &&
+                g_ascii_strcasecmp(wb_preset[first].model, model) == 0 &&
+                (name == NULL || strcmp(wb_preset[first].name, name) == 0))
+            break;
+    if (first == wb_preset_count) {
+        *count = 0;
+        return NULL;
+    }
+    for (i = first + 1; i < wb_preset_count &&
+            g_ascii_strcasecmp(wb_preset[i].make, make) == 0 &&
+            g_ascii_strcasecmp(wb_preset[i].model, model) == 0 &&
+            (name == NULL || strcmp(wb_preset[i].name, name) == 0); i++);
+    *count = i - first;
+    return &wb_preset[first];
+}
+
+int main(void)
+{
+    const wb_data *(*lookup[2])(const char *, const char *, const char *,
+                                int *) = { wb_preset_scan, wb_preset_find };
+    double seconds[2];
+    int i, l, count[2], errors = 0;
+
+    /* Build the index before timing */
+    wb_preset_find("", "", NULL, &count[0]);
+    for (l = 0; l < 2; l++) {
+        GTimer *timer = g_timer_new();
+        for (i = 0; i < wb_preset_count; i++) {
+            char *make = g_ascii_strup(wb_preset[i].make, -1);
+            char *model = g_ascii_strup(wb_preset[i].model, -1);
+            lookup[l](make, model, wb_preset[i].name, &count[0]);
+            lookup[l](make, model, NULL, &count[0]);
+            g_free(make);
+            g_free(model);
+        }
+        seconds[l] = g_timer_elapsed(timer, NULL);
+        g_timer_destroy(timer);
+    }
+    for (i = 0; i < wb_preset_count; i++) {
+        const wb_data *p = &wb_preset[i];
+        char *make = g_ascii_strup(p->make, -1);
+        char *model = g_ascii_strup(p->model, -1);
+        if (wb_preset_scan(make, model, p->name, &count[0]) !=
+                wb_preset_find(make, model, p->name, &count[1]) ||
+                count[0] != count[1] ||
+                wb_preset_scan(make, model, NULL, &count[0]) !=
+                wb_preset_find(make, model, NULL, &count[1]) ||
+                count[0] != count[1]) {
+            g_printerr("%s %s %s: the lookups differ\n",
+                       p->make, p->model, p->name);
+            errors++;
+        }
+        g_free(make);
+        g_free(model);
+    }
+    if (wb_preset_find("No such", "camera", NULL, &count[1]) != NULL ||
+            count[1] != 0) {
+        g_printerr("Found presets of an unknown camera\n");
+        errors++;
+    }
+    g_print("%d presets, %d lookups: scan %.3f us, index %.3f us each\n",
+            wb_preset_count, 2 * wb_preset_count,
+            seconds[0] * 1e6 / (2 * wb_preset_count),
+            seconds[1] * 1e6 / (2 * wb_preset_count));
+    return errors > 0;
+}
@@ -0,0 +1,52 @@
+#!/bin/sh
+# Check that a --raw-cache hit gives the same image as decoding the raw
+# file, and that a modified raw file misses the cache.
+
+raw=${1:-$UFRAW_TEST_RAW}
+batch=${UFRAW_BATCH:-../ufraw-batch}
+if [ -z "$raw" ] || [ ! -f "$raw" ]; then
+    echo "Set UFRAW_TEST_RAW to a raw file to run this check"
+    exit 77
+fi
+tmp=`mktemp -d` || exit 1
+trap 'rm -rf "$tmp"' 0 1 2 15
+
+in="$tmp/in.${raw##*.}"
+cp "$raw" "$in" || exit 1
+convert() {
+    out=$1
+    shift
+    "$batch" --silent --create-id=no --out-type=ppm --overwrite \
+        --output="$out" "$@" "$in" || {
+        echo "Converting $in to $out failed"
+        exit 1
+    }
+}
+entries() {
+    ls "$tmp/cache" | grep -c '\.rawcache$'
+}
+inode() {
+    ls -i "$tmp"/cache/*.rawcache | awk '{ print $1 }'
+}
+
+convert "$tmp/fresh.ppm"
+convert "$tmp/miss.ppm" --raw-cache="$tmp/cache"
+[ "`entries`" = 1 ] || { echo "The decoded image was not cached"; exit 1; }
+# A hit must read the cache file, not write it again
+cached=`inode`
+touch "$tmp/marker"
+sleep 1
+convert "$tmp/hit.ppm" --raw-cache="$tmp/cache"
+[ "`entries`" = 1 ] && [ "`inode`" = "$cached" ] &&
+    [ -z "`find "$tmp/cache" -name '*.rawcache' -newer "$tmp/marker"`" ] || {
+    echo "A cached image was decoded again"
+    exit 1
+}
+cmp "$tmp/fresh.ppm" "$tmp/miss.ppm" || exit 1
+cmp "$tmp/fresh.ppm" "$tmp/hit.ppm" || exit 1
+
+touch -t 200101010000 "$in"
+convert "$tmp/modified.ppm" --raw-cache="$tmp/cache"
+[ "`entries`" = 2 ] || { echo "A modified raw file hit the cache"; exit 1; }
+cmp "$tmp/fresh.ppm" "$tmp/modified.ppm" || exit 1
+echo "The raw cache gives the decoded image"
@@ -0,0 +1,119 @@
+/*
+ * UFRaw - Unidentified Flying Raw converter for digital camera images
+ *
+ * check-reuse.c - Check ufraw_reuse_raw()
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Converts $UFRAW_TEST_RAW, then reuses it with the same settings, with
+ * another curve and with another denoising threshold. Only the last one
+ * may convert the raw and first phases again, and each reused image must
+ * be saved exactly like the same settings without reuse.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <glib/gstdio.h>
+#include "check.h"
+
+typedef enum { same_conf, curve_conf, threshold_conf } check_change;
+
+static void check_change_conf(conf_data *conf, check_change change)
+{
+    if (change == curve_conf)
+        conf->curveIndex = conf->curveIndex == linear_curve ?
+                           manual_curve : linear_curve;
+    else if (change == threshold_conf)
+        conf->threshold += 100;
+}
+
+/* Open and configure filename, without loading it */
+static ufraw_data *check_open(char *filename, conf_data *rc,
+                              check_change change, const char *output)
+{
+    ufraw_data *uf = ufraw_open(filename);
+    if (uf == NULL || ufraw_config(uf, rc, NULL, NULL) == UFRAW_ERROR) {
+        g_printerr("%s: cannot configure\n", filename);
+        exit(1);
+    }
+    check_change_conf(uf->conf, change);
+    g_strlcpy(uf->conf->outputFilename, output, max_path);
+    return uf;
+}
+
+static char *check_save(ufraw_data *uf, gsize *size)
+{
+    char *data;
+    int status = ufraw_write_image(uf);
+    if ((status != UFRAW_SUCCESS && status != UFRAW_WARNING) ||
+            !g_file_get_contents(uf->conf->outputFilename, &data, size, NULL)) {
+        g_printerr("%s: cannot save\n", uf->conf->outputFilename);
+        exit(1);
+    }
+    g_unlink(uf->conf->outputFilename);
+    return data;
+}
+
+int main(int argc, char **argv)
+{
+    char *filename = check_raw_file(argc, argv);
+    const char *names[] = { "same", "curve", "threshold" };
+    const UFRawPhase expected[] = {
+        ufraw_develop_phase, ufraw_develop_phase, ufraw_raw_phase
+    };
+    check_change change;
+    conf_data rc;
+    int errors = 0;
+
+    check_conf(&rc);
+    rc.type = ppm_type;
+    ufraw_data *last = check_open(filename, &rc, same_conf, "check-reuse.ppm");
+    if (ufraw_load_raw(last) != UFRAW_SUCCESS) {
+        g_printerr("%s: cannot load\n", filename);
+        return 1;
+    }
+    gsize size;
+    g_free(check_save(last, &size));
+
+    for (change = same_conf; change <= threshold_conf; change++) {
+        ufraw_data *uf = check_open(filename, &rc, change, "check-reuse.ppm");
+        if (ufraw_reuse_raw(uf, last) != UFRAW_SUCCESS) {
+            g_printerr("%s: cannot reuse\n", filename);
+            return 1;
+        }
+        if (uf->convertedPhase != expected[change]) {
+            g_printerr("%s settings: converting from phase %d instead of %d\n",
+                       names[change], uf->convertedPhase, expected[change]);
+            errors++;
+        }
+        gsize reusedSize, freshSize;
+        char *reused = check_save(uf, &reusedSize);
+
+        ufraw_data *fresh = check_open(filename, &rc, change,
+                                       "check-reuse-fresh.ppm");
+        if (ufraw_load_raw(fresh) != UFRAW_SUCCESS) {
+            g_printerr("%s: cannot load\n", filename);
+            return 1;
+        }
+        char *data = check_save(fresh, &freshSize);
+        check_close(fresh);
+        if (reusedSize != freshSize || memcmp(reused, data, freshSize) != 0) {
+            g_printerr("%s settings: the reused image differs\n",
+                       names[change]);
+            errors++;
+        }
+        g_free(reused);
+        g_free(data);
+        last = uf;
+    }
+    check_close(last);
+    if (errors == 0)
+        g_print("Reused images are converted only as far as needed\n");
+    return errors > 0;
+}
@@ -0,0 +1,125 @@
+/*
+ * UFRaw - Unidentified Flying Raw converter for digital camera images
+ *
+ * check-threads.c - Check concurrent conversions in one process
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Converts the raw files given as arguments, or $UFRAW_TEST_RAW, one
+ * after the other. Then converts them again on several threads at once,
+ * each thread loading, decoding and saving its own image. Preferably the
+ * files are of different cameras. Every concurrent conversion must save
+ * the same file as the serial one.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <glib/gstdio.h>
+#include "check.h"
+
+typedef struct {
+    char *filename;
+    char output[max_path];
+    gchar *data;
+    gsize size;
+} check_conversion;
+
+static conf_data rc;
+
+/* Convert c->filename like ufraw-batch, keep the saved file in c->data */
+static gpointer check_convert(gpointer data)
+{
+    check_conversion *c = data;
+    ufraw_data *uf = check_load(c->filename, &rc);
+    c->data = NULL;
+    if (uf == NULL)
+        return NULL;
+    g_strlcpy(uf->conf->outputFilename, c->output, max_path);
+    int status = ufraw_write_image(uf);
+    if (status == UFRAW_SUCCESS || status == UFRAW_WARNING)
+        g_file_get_contents(c->output, &c->data, &c->size, NULL);
+    else
+        g_printerr("%s: %s\n", c->output, ufraw_get_message(uf));
+    g_unlink(c->output);
+    check_close(uf);
+    /* Leave nothing of this image in the thread's buffers */
+    ufraw_message(UFRAW_CLEAN, NULL);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    char *single[1];
+    char **files = argv + 1;
+    int fileCount = argc - 1;
+    int i, t, errors = 0;
+
+#if !GLIB_CHECK_VERSION(2,31,0)
+    g_thread_init(NULL);
+#endif
+    if (fileCount == 0) {
+        single[0] = check_raw_file(argc, argv);
+        files = single;
+        fileCount = 1;
+    }
+    int threads = MAX(4, 2 * fileCount);
+    check_conversion *serial = g_new0(check_conversion, fileCount);
+    check_conversion *concurrent = g_new0(check_conversion, threads);
+    GThread **workers = g_new(GThread *, threads);
+
+    check_conf(&rc);
+    rc.type = ppm_type;
+    GTimer *timer = g_timer_new();
+    for (i = 0; i < fileCount; i++) {
+        serial[i].filename = files[i];
+        g_snprintf(serial[i].output, max_path, "check-threads-serial-%d.ppm",
+                   i);
+        check_convert(&serial[i]);
+        if (serial[i].data == NULL)
+            return 1;
+    }
+    double serialSeconds = g_timer_elapsed(timer, NULL);
+
+    g_timer_start(timer);
+    for (t = 0; t < threads; t++) {
+        concurrent[t].filename = files[t % fileCount];
+        g_snprintf(concurrent[t].output, max_path, "check-threads-%d.ppm", t);
+#if GLIB_CHECK_VERSION(2,32,0)
+        workers[t] = g_thread_new("check-threads", check_convert,
+                                  &concurrent[t]);
+#else
+        workers[t] = g_thread_create(check_convert, &concurrent[t], TRUE, NULL);
+#endif
+    }
+    for (t = 0; t < threads; t++)
+        g_thread_join(workers[t]);
+    double concurrentSeconds = g_timer_elapsed(timer, NULL);
+    g_timer_destroy(timer);
+
+    for (t = 0; t < threads; t++) {
+        check_conversion *ref = &serial[t % fileCount];
+        if (concurrent[t].data == NULL || concurrent[t].size != ref->size ||
+                memcmp(concurrent[t].data, ref->data, ref->size) != 0) {
+            g_printerr("%s: conversion %d differs from the serial one\n",
+                       concurrent[t].filename, t);
+            errors++;
+        }
+        g_free(concurrent[t].data);
+    }
+    for (i = 0; i < fileCount; i++)
+        g_free(serial[i].data);
+    if (errors == 0)
+        g_print("%d files: serial %.3f s, %d concurrent conversions "
+                "%.3f s, identical\n", fileCount, serialSeconds, threads,
+                concurrentSeconds);
+    g_free(serial);
+    g_free(concurrent);
+    g_free(workers);
+    return errors > 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * UFRaw - Unidentified Flying Raw converter for digital camera images
+ *
+ * check-tiff-exif.c - Check ufraw_exif_write_tiff()
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Writes the EXIF data of $UFRAW_TEST_RAW into a small TIFF file with
+ * libtiff. The check fails if some of the data would have to be written by
+ * exiv2 instead, or if the EXIF directory cannot be read back.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <glib/gstdio.h>
+#include "check.h"
+#ifdef HAVE_LIBTIFF
+#include <tiffio.h>
+#endif
+
+#if defined(HAVE_EXIV2) && defined(HAVE_LIBTIFF) && TIFFLIB_VERSION >= 20111221
+
+/* A one pixel image, like the ones ufraw_write_image() writes */
+static TIFF *check_tiff_open(const char *output)
+{
+    guint8 pixel[3] = { 0, 0, 0 };
+    TIFF *tiff = TIFFOpen(output, "w");
+    if (tiff == NULL)
+        return NULL;
+    TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, 1);
+    TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, 1);
+    TIFFSetField(tiff, TIFFTAG_BITSPERSAMPLE, 8);
+    TIFFSetField(tiff, TIFFTAG_SAMPLESPERPIXEL, 3);
+    TIFFSetField(tiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+    TIFFSetField(tiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    if (TIFFWriteScanline(tiff, pixel, 0, 0) < 0) {
+        TIFFClose(tiff);
+        return NULL;
+    }
+    return tiff;
+}
+
+int main(int argc, char **argv)
+{
+    char *filename = check_raw_file(argc, argv);
+    const char *output = "check-tiff-exif.tif";
+    conf_data rc;
+
+    check_conf(&rc);
+    rc.type = tiff_type;
+    rc.embedExif = TRUE;
+    ufraw_data *uf = check_load(filename, &rc);
+    if (uf == NULL)
+        return 1;
+    TIFF *tiff = check_tiff_open(output);
+    if (tiff == NULL) {
+        g_printerr("%s: cannot create\n", output);
+        return 1;
+    }
+    int status = ufraw_exif_write_tiff(uf, tiff);
+    TIFFClose(tiff);
+    if (status == UFRAW_CANCEL) {
+        char *log = ufraw_message(UFRAW_GET_LOG, NULL);
+        g_printerr("%s: fell back to exiv2\n%s", filename, log ? log : "");
+        g_unlink(output);
+        return 1;
+    }
+    if (status != UFRAW_SUCCESS) {
+        g_printerr("%s: cannot write the EXIF data\n", filename);
+        g_unlink(output);
+        return 1;
+    }
+    check_close(uf);
+
+    int errors = 0;
+    toff_t offset = 0;
+    tiff = TIFFOpen(output, "r");
+    if (tiff == NULL || !TIFFGetField(tiff, TIFFTAG_EXIFIFD, &offset) ||
+            !TIFFReadEXIFDirectory(tiff, offset)) {
+        g_printerr("%s: no EXIF directory\n", output);
+        errors++;
+    }
+    if (tiff != NULL)
+        TIFFClose(tiff);
+    g_unlink(output);
+    if (errors == 0)
+        g_print("The EXIF data was written by libtiff\n");
+    return errors > 0;
+}
+
+#else
+
+int main(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+    g_printerr("The EXIF data is written by libtiff only with exiv2 "
+               "and libtiff 4\n");
+    return CHECK_SKIP;
+}
+
+#endif
@@ -0,0 +1,71 @@
+/*
+ * UFRaw - Unidentified Flying Raw converter for digital camera images
+ *
+ * check.c - Common code for the checks of 'make check'
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include "check.h"
+
+/* libufraw.a expects these from the program */
+char *ufraw_binary = "check";
+
+void ufraw_messenger(char *message, void *parentWindow)
+{
+    (void)parentWindow;
+    g_printerr("%s\n", message);
+}
+
+char *check_raw_file(int argc, char **argv)
+{
+    char *filename = argc > 1 ? argv[1] : getenv("UFRAW_TEST_RAW");
+    if (filename == NULL || !g_file_test(filename, G_FILE_TEST_IS_REGULAR)) {
+        g_printerr("Set UFRAW_TEST_RAW to a raw file to run this check\n");
+        exit(CHECK_SKIP);
+    }
+    return filename;
+}
+
+void check_conf(conf_data *rc)
+{
+    conf_init(rc);
+    rc->ufobject = ufraw_resources_new();
+    /* Like in ufraw-batch */
+    if (rc->interpolation == half_interpolation)
+        rc->interpolation = ahd_interpolation;
+    rc->createID = no_id;
+    rc->overwrite = TRUE;
+}
+
+ufraw_data *check_load(char *filename, conf_data *rc)
+{
+    ufraw_data *uf = ufraw_open(filename);
+    if (uf == NULL) {
+        ufraw_message(UFRAW_REPORT, NULL);
+        return NULL;
+    }
+    if (ufraw_config(uf, rc, NULL, NULL) == UFRAW_ERROR ||
+            ufraw_load_raw(uf) != UFRAW_SUCCESS) {
+        char *message = ufraw_get_message(uf);
+        g_printerr("%s: %s\n", filename, message ? message : "failed");
+        check_close(uf);
+        return NULL;
+    }
+    return uf;
+}
+
+void check_close(ufraw_data *uf)
+{
+    ufraw_close_darkframe(uf->conf);
+    ufraw_close(uf);
+    g_free(uf);
+}
@@ -0,0 +1,41 @@
+/*
+ * UFRaw - Unidentified Flying Raw converter for digital camera images
+ *
+ * check.h - Common code for the checks of 'make check'
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _CHECK_H
+#define _CHECK_H
+
+#include "ufraw.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The exit status that makes automake count a check as skipped */
+#define CHECK_SKIP 77
+
+/* Return the sample raw file given in argv[1] or $UFRAW_TEST_RAW.
+ * Exit with CHECK_SKIP if there is none. */
+char *check_raw_file(int argc, char **argv);
+
+/* Set rc to the default settings, without an ID file and overwriting
+ * the output */
+void check_conf(conf_data *rc);
+
+/* Open, configure and load filename. Return NULL on failure. */
+ufraw_data *check_load(char *filename, conf_data *rc);
+
+void check_close(ufraw_data *uf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_CHECK_H*/
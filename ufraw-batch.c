@@ -15,11 +15,26 @@
 #include <errno.h>     /* for errno */
 #include <string.h>
 #include <glib/gi18n.h>
+#ifdef HAVE_SYS_UN_H
+#include <signal.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <glib/gstdio.h>
+#endif
 
 static gboolean silentMessenger;
 char *ufraw_binary;
 
 int ufraw_batch_saver(ufraw_data *uf);
+static int ufraw_batch_prepare_output(ufraw_data *uf);
+static int ufraw_batch_write(ufraw_data *uf);
+static int ufraw_batch_jobs(int argc, char **argv, int optInd,
+                            conf_data *rc, conf_data *cmd, conf_data *conf);
+static int ufraw_batch_serve(int optInd, char **argv,
+                             conf_data *rc, conf_data *cmd);
 
 int main(int argc, char **argv)
 {
@@ -56,13 +71,34 @@ int main(int argc, char **argv)
     if (optInd == 0) exit(0);
     silentMessenger = cmd.silent;
 
+    if (strlen(cmd.serveSocket) > 0) {
+        if (optInd < argc)
+            ufraw_message(UFRAW_WARNING,
+                          _("Input files are ignored with --serve."));
+        exitCode = ufraw_batch_serve(optInd, argv, &rc, &cmd);
+        ufobject_delete(cmd.ufobject);
+        ufobject_delete(rc.ufobject);
+        exit(exitCode);
+    }
     conf_file_load(&conf, cmd.inputFilename);
 
     if (optInd == argc) {
         ufraw_message(UFRAW_WARNING, _("No input file, nothing to do."));
     }
+    /* The embedded image path reports through the shared message buffer,
+     * so it is always run sequentially. */
+    if (cmd.jobs > 1 && !cmd.embeddedImage) {
+        exitCode = ufraw_batch_jobs(argc, argv, optInd, &rc, &cmd, &conf);
+        ufobject_delete(cmd.ufobject);
+        ufobject_delete(rc.ufobject);
+        exit(exitCode);
+    }
     int fileCount = argc - optInd;
     int fileIndex = 1;
+    /* The last image is kept until the next file is configured. If both
+     * come from the same raw file, e.g. two ID files of one raw image,
+     * only the phases that their settings change are converted again. */
+    ufraw_data *last = NULL;
     for (; optInd < argc; optInd++, fileIndex++) {
         argFile = uf_win32_locale_to_utf8(argv[optInd]);
         uf = ufraw_open(argFile);
@@ -82,7 +118,12 @@ int main(int argc, char **argv)
             g_free(uf);
             exit(1);
         }
-        if (ufraw_load_raw(uf) != UFRAW_SUCCESS) {
+        if (last != NULL)
+            status = ufraw_reuse_raw(uf, last);
+        else
+            status = ufraw_load_raw(uf);
+        last = NULL;
+        if (status != UFRAW_SUCCESS) {
             exitCode = 1;
             ufraw_close_darkframe(uf->conf);
             ufraw_close(uf);
@@ -103,17 +144,746 @@ int main(int argc, char **argv)
         } else {
             exitCode = 1;
         }
+        if (optInd + 1 < argc && !uf->conf->embeddedImage) {
+            last = uf;
+            continue;
+        }
         ufraw_close_darkframe(uf->conf);
         ufraw_close(uf);
         g_free(uf);
     }
+    if (last != NULL) {
+        ufraw_close_darkframe(last->conf);
+        ufraw_close(last);
+        g_free(last);
+    }
 //    ufraw_close(cmd.darkframe);
     ufobject_delete(cmd.ufobject);
     ufobject_delete(rc.ufobject);
     exit(exitCode);
 }
 
+/*
+ * Pipelined conversion for --jobs=N.
+ * The main thread opens, configures and decodes the files one after the
+ * other, while up to N worker threads develop and save the decoded images.
+ * Every decoded image holds one of N slots until its worker is done with
+ * it, which bounds the number of images kept in memory. Workers do not
+ * print anything; they capture the messages of their image, and the main
+ * thread reports them with the results in input order.
+ */
+typedef struct {
+    int index;
+    ufraw_data *uf;
+    int status;
+    gboolean loaded, onlyID;
+    char *filename, *outputFilename;
+    char *message;
+    char *shown; /* Messages the worker would have displayed */
+    void *messages; /* The log of loading uf, see ufraw_message_detach() */
+} ufraw_batch_job;
+
+static GAsyncQueue *ufraw_batch_todo;
+static GAsyncQueue *ufraw_batch_done;
+
+static gpointer ufraw_batch_worker(gpointer data)
+{
+    (void)data;
+    for (;;) {
+        ufraw_batch_job *job = g_async_queue_pop(ufraw_batch_todo);
+        ufraw_data *uf = job->uf;
+        if (uf == NULL) {
+            /* An empty job ends the worker */
+            g_free(job);
+            return NULL;
+        }
+        ufraw_message_attach(job->messages);
+        job->messages = NULL;
+        ufraw_message_capture();
+        job->status = ufraw_batch_write(uf);
+        job->onlyID = uf->conf->createID == only_id;
+        job->outputFilename = g_strdup(uf->conf->outputFilename);
+        if (job->status != UFRAW_SUCCESS)
+            job->message = g_strdup(ufraw_get_message(uf));
+        ufraw_close_darkframe(uf->conf);
+        ufraw_close(uf);
+        g_free(uf);
+        job->uf = NULL;
+        job->shown = ufraw_message_captured();
+        /* Leave nothing of this image in the worker's buffers */
+        ufraw_message(UFRAW_CLEAN, NULL);
+        g_async_queue_push(ufraw_batch_done, job);
+    }
+}
+
+/* Print the results of all finished jobs that are next in input order */
+static void ufraw_batch_report(GPtrArray *finished, int *nextReport,
+                               int fileCount, int *exitCode)
+{
+    ufraw_batch_job *job;
+    while (*nextReport < (int)finished->len &&
+            (job = g_ptr_array_index(finished, *nextReport)) != NULL) {
+        char stat[max_name];
+        if (fileCount > 1)
+            g_snprintf(stat, max_name, "[%d/%d]", job->index, fileCount);
+        else
+            stat[0] = '\0';
+        if (job->loaded)
+            ufraw_message(UFRAW_MESSAGE, _("Loaded %s %s"), job->filename, stat);
+        if (job->shown != NULL)
+            ufraw_message(UFRAW_MESSAGE, "%s", job->shown);
+        if (job->message != NULL)
+            ufraw_message(job->status, job->message);
+        if (job->status == UFRAW_SUCCESS || job->status == UFRAW_WARNING) {
+            if (!job->onlyID)
+                ufraw_message(UFRAW_MESSAGE, _("Saved %s %s"),
+                              job->outputFilename, stat);
+        } else {
+            *exitCode = 1;
+        }
+        g_free(job->filename);
+        g_free(job->outputFilename);
+        g_free(job->message);
+        g_free(job->shown);
+        g_free(job);
+        g_ptr_array_index(finished, *nextReport) = NULL;
+        (*nextReport)++;
+    }
+}
+
+static void ufraw_batch_wait(GPtrArray *finished, int *inFlight,
+                             int *nextReport, int fileCount, int *exitCode)
+{
+    ufraw_batch_job *job = g_async_queue_pop(ufraw_batch_done);
+    g_ptr_array_index(finished, job->index - 1) = job;
+    (*inFlight)--;
+    ufraw_batch_report(finished, nextReport, fileCount, exitCode);
+}
+
+static int ufraw_batch_jobs(int argc, char **argv, int optInd,
+                            conf_data *rc, conf_data *cmd, conf_data *conf)
+{
+    int jobs = cmd->jobs;
+    int fileCount = argc - optInd;
+    int fileIndex, i;
+    int inFlight = 0, nextReport = 0;
+    int exitCode = 0;
+    gboolean stop = FALSE;
+    GThread **workers = g_new(GThread *, jobs);
+    GPtrArray *finished = g_ptr_array_new();
+
+    ufraw_batch_todo = g_async_queue_new();
+    ufraw_batch_done = g_async_queue_new();
+    for (i = 0; i < jobs; i++)
+#if GLIB_CHECK_VERSION(2,32,0)
+        workers[i] = g_thread_new("ufraw-batch", ufraw_batch_worker, NULL);
+#else
+        workers[i] = g_thread_create(ufraw_batch_worker, NULL, TRUE, NULL);
+#endif
+    for (fileIndex = 1; optInd < argc && !stop; optInd++, fileIndex++) {
+        ufraw_batch_job *job = g_new0(ufraw_batch_job, 1);
+        job->index = fileIndex;
+        g_ptr_array_add(finished, NULL);
+        /* Wait for a free slot before decoding the next file */
+        while (inFlight >= jobs)
+            ufraw_batch_wait(finished, &inFlight, &nextReport, fileCount,
+                             &exitCode);
+        char *argFile = uf_win32_locale_to_utf8(argv[optInd]);
+        ufraw_data *uf = ufraw_open(argFile);
+        uf_win32_locale_free(argFile);
+        if (uf == NULL) {
+            job->status = UFRAW_ERROR;
+            ufraw_message(UFRAW_REPORT, NULL);
+            g_ptr_array_index(finished, fileIndex - 1) = job;
+            ufraw_batch_report(finished, &nextReport, fileCount, &exitCode);
+            continue;
+        }
+        int status = ufraw_config(uf, rc, conf, cmd);
+        if (uf->conf && uf->conf->createID == only_id && cmd->createID == -1)
+            uf->conf->createID = no_id;
+        if (status == UFRAW_ERROR || ufraw_load_raw(uf) != UFRAW_SUCCESS) {
+            /* A configuration error stops the batch, like in the
+             * sequential mode, after the running jobs are done. */
+            stop = status == UFRAW_ERROR;
+            job->status = UFRAW_ERROR;
+            ufraw_close_darkframe(uf->conf);
+            ufraw_close(uf);
+            g_free(uf);
+            g_ptr_array_index(finished, fileIndex - 1) = job;
+            ufraw_batch_report(finished, &nextReport, fileCount, &exitCode);
+            continue;
+        }
+        job->loaded = TRUE;
+        job->filename = g_strdup(uf->filename);
+        /* The overwrite question must be asked from the main thread */
+        status = ufraw_batch_prepare_output(uf);
+        if (status != UFRAW_SUCCESS) {
+            job->status = status;
+            ufraw_close_darkframe(uf->conf);
+            ufraw_close(uf);
+            g_free(uf);
+            g_ptr_array_index(finished, fileIndex - 1) = job;
+            ufraw_batch_report(finished, &nextReport, fileCount, &exitCode);
+            continue;
+        }
+        job->uf = uf;
+        job->messages = ufraw_message_detach();
+        inFlight++;
+        g_async_queue_push(ufraw_batch_todo, job);
+    }
+    while (inFlight > 0)
+        ufraw_batch_wait(finished, &inFlight, &nextReport, fileCount,
+                         &exitCode);
+    for (i = 0; i < jobs; i++)
+        g_async_queue_push(ufraw_batch_todo, g_new0(ufraw_batch_job, 1));
+    for (i = 0; i < jobs; i++)
+        g_thread_join(workers[i]);
+    g_free(workers);
+    g_ptr_array_free(finished, TRUE);
+    g_async_queue_unref(ufraw_batch_todo);
+    g_async_queue_unref(ufraw_batch_done);
+    return stop ? 1 : exitCode;
+}
+
+/*
+ * Server mode for --serve=SOCKET.
+ * Clients connect to a UNIX socket and send one job per line. A job is a
+ * ufraw-batch command line without the program name, with exactly one
+ * input file, e.g.:
+ *   --conf=/shots/look.ufraw --out-type=png --output=/out/a.png /shots/a.cr2
+ * The options given to the server itself are applied before the options
+ * of each job. Relative paths are relative to the server's working
+ * directory. For every job the server replies with a line of tab
+ * separated fields:
+ *   N  OK|WARNING|ERROR  LOAD  SAVE  TOTAL  OUTPUT  MESSAGE
+ * N counts the jobs of the connection from 1. LOAD and SAVE are the
+ * seconds spent on loading the raw file and on converting and saving the
+ * image, TOTAL the seconds since the server started on the job. Jobs
+ * that wait for an earlier one to free a worker are not timed while
+ * waiting. Replies are sent when the jobs finish, which is not
+ * necessarily in the order they were sent. Only the user running the
+ * server can connect to its socket.
+ *
+ * Like with --jobs, the main thread opens, configures and decodes the
+ * files, and --jobs=N worker threads develop and save them. The messages
+ * of a job are captured by the thread working on it and sent in its
+ * reply. The lensfun
+ * database, the resource file and everything else that is set up once
+ * per process stay loaded between jobs. The last images are kept after
+ * they are saved, so that another job on the same raw file only converts
+ * the phases that its settings change, see ufraw_reuse_raw().
+ */
+#ifdef HAVE_SYS_UN_H
+
+/* Number of saved images kept for reuse */
+#define UFRAW_SERVE_KEEP 2
+
+typedef struct {
+    int fd;
+    int refCount; /* The reader thread and the unfinished jobs */
+    GString *pending; /* Replies that are not sent yet */
+    gboolean sending; /* A thread is sending the pending replies */
+} ufraw_serve_client;
+
+typedef struct {
+    ufraw_serve_client *client;
+    int index;
+    char *line;
+    GTimer *timer;
+    double loadTime, saveTime;
+    ufraw_data *uf;
+    void *messages; /* The messages of loading uf, see ufraw_message_detach() */
+    int status;
+    char *outputFilename;
+    char *message;
+    gboolean finished; /* Set by the worker when the job is sent back */
+} ufraw_serve_job;
+
+typedef struct {
+    ufraw_data *uf;
+    gint64 size, mtime;
+} ufraw_serve_kept;
+
+/* The main thread gets both the new and the finished jobs from
+ * ufraw_serve_todo, so that it closes or keeps the images of the
+ * finished ones right away. */
+static GAsyncQueue *ufraw_serve_todo;
+static GAsyncQueue *ufraw_serve_write;
+
+/* The socket, to be removed when the server exits */
+static char ufraw_serve_path[max_path];
+G_LOCK_DEFINE_STATIC(ufraw_serve_client);
+
+static void ufraw_serve_client_unref(ufraw_serve_client *client)
+{
+    G_LOCK(ufraw_serve_client);
+    gboolean last = --client->refCount == 0;
+    G_UNLOCK(ufraw_serve_client);
+    if (last) {
+        close(client->fd);
+        g_string_free(client->pending, TRUE);
+        g_free(client);
+    }
+}
+
+/* Send a reply to the client. The replies of a client are sent by one
+ * thread at a time, without holding the lock while writing. A thread
+ * that finds another one sending leaves its reply to that thread. */
+static void ufraw_serve_send(ufraw_serve_client *client, const char *reply)
+{
+    G_LOCK(ufraw_serve_client);
+    g_string_append(client->pending, reply);
+    if (client->sending) {
+        G_UNLOCK(ufraw_serve_client);
+        return;
+    }
+    client->sending = TRUE;
+    while (client->pending->len > 0) {
+        gssize left = client->pending->len;
+        char *text = g_string_free(client->pending, FALSE);
+        client->pending = g_string_new(NULL);
+        G_UNLOCK(ufraw_serve_client);
+        const char *p = text;
+        while (left > 0) {
+            gssize n = write(client->fd, p, left);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break; // The client is gone
+            p += n;
+            left -= n;
+        }
+        g_free(text);
+        G_LOCK(ufraw_serve_client);
+    }
+    client->sending = FALSE;
+    G_UNLOCK(ufraw_serve_client);
+}
+
+static void ufraw_serve_reply(ufraw_serve_job *job)
+{
+    const char *status = job->status == UFRAW_SUCCESS ? "OK" :
+                         job->status == UFRAW_WARNING ? "WARNING" : "ERROR";
+    char load[G_ASCII_DTOSTR_BUF_SIZE], save[G_ASCII_DTOSTR_BUF_SIZE],
+         total[G_ASCII_DTOSTR_BUF_SIZE];
+    g_ascii_formatd(load, sizeof load, "%.3f", job->loadTime);
+    g_ascii_formatd(save, sizeof save, "%.3f", job->saveTime);
+    g_ascii_formatd(total, sizeof total, "%.3f",
+                    g_timer_elapsed(job->timer, NULL));
+    char *output = g_strdup(job->outputFilename ? job->outputFilename : "");
+    char *message = g_strstrip(g_strdup(job->message ? job->message : ""));
+    g_strdelimit(output, "\t\r\n", ' ');
+    g_strdelimit(message, "\t\r\n", ' ');
+    char *reply = g_strdup_printf("%d\t%s\t%s\t%s\t%s\t%s\t%s\n", job->index,
+                                  status, load, save, total, output, message);
+    ufraw_serve_send(job->client, reply);
+    g_free(reply);
+    g_free(message);
+    g_free(output);
+}
+
+static void ufraw_serve_job_free(ufraw_serve_job *job)
+{
+    ufraw_serve_client_unref(job->client);
+    g_timer_destroy(job->timer);
+    g_free(job->line);
+    g_free(job->outputFilename);
+    g_free(job->message);
+    g_free(job);
+}
+
+static void ufraw_serve_close(ufraw_data *uf)
+{
+    ufraw_close_darkframe(uf->conf);
+    ufraw_close(uf);
+    g_free(uf);
+}
+
+/* Queue a line received from a client as a job */
+static void ufraw_serve_add_job(ufraw_serve_client *client, int *index,
+                                char *line)
+{
+    g_strstrip(line);
+    if (line[0] == '\0')
+        return;
+    ufraw_serve_job *job = g_new0(ufraw_serve_job, 1);
+    job->timer = g_timer_new();
+    job->index = ++*index;
+    job->line = g_strdup(line);
+    G_LOCK(ufraw_serve_client);
+    client->refCount++;
+    G_UNLOCK(ufraw_serve_client);
+    job->client = client;
+    g_async_queue_push(ufraw_serve_todo, job);
+}
+
+static gpointer ufraw_serve_reader(gpointer data)
+{
+    ufraw_serve_client *client = data;
+    int fd = dup(client->fd);
+    FILE *in = fd < 0 ? NULL : fdopen(fd, "r");
+    GString *line = g_string_new(NULL);
+    char buf[max_path];
+    int index = 0;
+    while (in != NULL && fgets(buf, sizeof buf, in) != NULL) {
+        g_string_append(line, buf);
+        if (line->str[line->len - 1] != '\n')
+            continue;
+        ufraw_serve_add_job(client, &index, line->str);
+        g_string_truncate(line, 0);
+    }
+    // A last line without a newline
+    ufraw_serve_add_job(client, &index, line->str);
+    g_string_free(line, TRUE);
+    if (in != NULL)
+        fclose(in);
+    else if (fd >= 0)
+        close(fd);
+    ufraw_serve_client_unref(client);
+    return NULL;
+}
+
+static gpointer ufraw_serve_acceptor(gpointer data)
+{
+    int fd = GPOINTER_TO_INT(data);
+    for (;;) {
+        int clientFd = accept(fd, NULL, NULL);
+        if (clientFd < 0) {
+            if (errno != EINTR) {
+                ufraw_message(UFRAW_ERROR, "accept: %s", g_strerror(errno));
+                // Do not spin if we are out of file descriptors
+                g_usleep(G_USEC_PER_SEC / 10);
+            }
+            continue;
+        }
+        ufraw_serve_client *client = g_new0(ufraw_serve_client, 1);
+        client->fd = clientFd;
+        client->refCount = 1;
+        client->pending = g_string_new(NULL);
+#if GLIB_CHECK_VERSION(2,32,0)
+        g_thread_unref(g_thread_new("ufraw-serve", ufraw_serve_reader, client));
+#else
+        g_thread_create(ufraw_serve_reader, client, FALSE, NULL);
+#endif
+    }
+    return NULL;
+}
+
+static gpointer ufraw_serve_worker(gpointer data)
+{
+    (void)data;
+    for (;;) {
+        ufraw_serve_job *job = g_async_queue_pop(ufraw_serve_write);
+        ufraw_data *uf = job->uf;
+        double start = g_timer_elapsed(job->timer, NULL);
+        /* The messages of loading uf are still being captured */
+        ufraw_message_attach(job->messages);
+        job->messages = NULL;
+        job->status = ufraw_batch_write(uf);
+        job->saveTime = g_timer_elapsed(job->timer, NULL) - start;
+        job->message = ufraw_message_captured();
+        char *error = job->status != UFRAW_SUCCESS ?
+                      ufraw_get_message(uf) : NULL;
+        if (error != NULL) {
+            char *message = g_strconcat(job->message ? job->message : "",
+                                        error, NULL);
+            g_free(job->message);
+            job->message = message;
+        }
+        ufraw_serve_reply(job);
+        job->finished = TRUE;
+        g_async_queue_push(ufraw_serve_todo, job);
+    }
+    return NULL;
+}
+
+/* Take the kept image of filename, if the file was not modified since */
+static ufraw_data *ufraw_serve_take_kept(GList **kept, const char *filename)
+{
+    GList *l;
+    for (l = *kept; l != NULL; l = l->next) {
+        ufraw_serve_kept *k = l->data;
+        if (strcmp(k->uf->conf->inputFilename, filename) == 0)
+            break;
+    }
+    if (l == NULL)
+        return NULL;
+    ufraw_serve_kept *k = l->data;
+    ufraw_data *uf = k->uf;
+    *kept = g_list_delete_link(*kept, l);
+    struct stat s;
+    gboolean same = g_stat(filename, &s) == 0 &&
+                    (gint64)s.st_size == k->size &&
+                    (gint64)s.st_mtime == k->mtime;
+    g_free(k);
+    if (same)
+        return uf;
+    ufraw_serve_close(uf);
+    return NULL;
+}
+
+/* Keep the image of a finished job for reuse, or close it */
+static void ufraw_serve_finish(ufraw_serve_job *job, GList **kept)
+{
+    ufraw_data *uf = job->uf;
+    struct stat s;
+    if (job->status == UFRAW_ERROR ||
+            uf->convertedPhase == ufraw_raw_phase ||
+            g_stat(uf->conf->inputFilename, &s) != 0) {
+        ufraw_serve_close(uf);
+    } else {
+        ufraw_serve_kept *k = g_new(ufraw_serve_kept, 1);
+        k->uf = uf;
+        k->size = s.st_size;
+        k->mtime = s.st_mtime;
+        *kept = g_list_prepend(*kept, k);
+        while (g_list_length(*kept) > UFRAW_SERVE_KEEP) {
+            GList *l = g_list_last(*kept);
+            k = l->data;
+            ufraw_serve_close(k->uf);
+            g_free(k);
+            *kept = g_list_delete_link(*kept, l);
+        }
+    }
+    job->uf = NULL;
+    ufraw_serve_job_free(job);
+}
+
+/* Parse the job's command line and load its raw file.
+ * Return FALSE if the job failed. */
+static gboolean ufraw_serve_load(ufraw_serve_job *job, int optInd,
+                                 char **options, conf_data *rc, GList **kept)
+{
+    int jobArgc, argc, status;
+    char **jobArgv;
+    GError *err = NULL;
+
+    if (!g_shell_parse_argv(job->line, &jobArgc, &jobArgv, &err)) {
+        job->status = UFRAW_ERROR;
+        job->message = g_strdup(err->message);
+        g_error_free(err);
+        return FALSE;
+    }
+    argc = optInd + jobArgc;
+    char **argv = g_new(char *, argc + 1);
+    memcpy(argv, options, optInd * sizeof(char *));
+    memcpy(argv + optInd, jobArgv, jobArgc * sizeof(char *));
+    argv[argc] = NULL;
+
+    /* The displayed messages go into the reply */
+    ufraw_message_capture();
+
+    conf_data cmd, conf;
+    ufraw_data *uf = NULL;
+    cmd.ufobject = NULL;
+    conf.ufobject = NULL;
+    status = UFRAW_ERROR;
+    /* Start a new getopt_long() scan */
+    optind = 0;
+    int argInd = ufraw_process_args(&argc, &argv, &cmd, rc);
+    if (argInd == 0 || argc - argInd != 1) {
+        if (argInd >= 0)
+            ufraw_message(UFRAW_ERROR,
+                          _("A job needs exactly one input file."));
+    } else {
+        conf_file_load(&conf, cmd.inputFilename);
+        char *argFile = uf_win32_locale_to_utf8(argv[argInd]);
+        uf = ufraw_open(argFile);
+        uf_win32_locale_free(argFile);
+        if (uf == NULL)
+            ufraw_message(UFRAW_REPORT, NULL);
+        else
+            status = ufraw_config(uf, rc, &conf, &cmd);
+    }
+    if (uf != NULL && status != UFRAW_ERROR) {
+        if (uf->conf->createID == only_id && cmd.createID == -1)
+            uf->conf->createID = no_id;
+        status = UFRAW_ERROR;
+        /* There is nobody to answer the overwrite question */
+        if (strcmp(uf->conf->outputFilename, "-") == 0)
+            ufraw_message(UFRAW_ERROR,
+                          _("A job cannot write to the standard output."));
+        else if (!uf->conf->overwrite && uf->conf->createID != only_id &&
+                 g_file_test(uf->conf->outputFilename, G_FILE_TEST_EXISTS))
+            ufraw_message(UFRAW_ERROR, _("File '%s' already exists."),
+                          uf->conf->outputFilename);
+        else
+            status = UFRAW_SUCCESS;
+    }
+    if (status == UFRAW_SUCCESS) {
+        ufraw_data *old = ufraw_serve_take_kept(kept,
+                                                uf->conf->inputFilename);
+        if (old != NULL)
+            status = ufraw_reuse_raw(uf, old);
+        else
+            status = ufraw_load_raw(uf);
+    }
+    if (status == UFRAW_SUCCESS)
+        status = ufraw_batch_prepare_output(uf);
+    if (conf.ufobject != NULL)
+        ufobject_delete(conf.ufobject);
+    if (cmd.ufobject != NULL)
+        ufobject_delete(cmd.ufobject);
+    g_free(argv);
+    g_strfreev(jobArgv);
+
+    job->loadTime = g_timer_elapsed(job->timer, NULL);
+    job->status = status;
+    if (status != UFRAW_SUCCESS) {
+        job->message = ufraw_message_captured();
+        if (uf != NULL)
+            ufraw_serve_close(uf);
+        ufraw_message(UFRAW_CLEAN, NULL);
+        return FALSE;
+    }
+    job->uf = uf;
+    /* The capture goes along to the worker */
+    job->messages = ufraw_message_detach();
+    job->outputFilename = g_strdup(uf->conf->outputFilename);
+    return TRUE;
+}
+
+/* Create the socket that the server listens on */
+static int ufraw_serve_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof addr.sun_path) {
+        ufraw_message(UFRAW_ERROR, _("'%s' is not a valid socket name."),
+                      path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    g_strlcpy(addr.sun_path, path, sizeof addr.sun_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        ufraw_message(UFRAW_ERROR, "socket: %s", g_strerror(errno));
+        return -1;
+    }
+    /* Remove the socket of a server that did not exit cleanly, but not
+     * the one of a server that is still running. */
+    struct stat s;
+    if (g_lstat(path, &s) == 0 && S_ISSOCK(s.st_mode)) {
+        if (connect(fd, (struct sockaddr *)&addr, sizeof addr) == 0) {
+            ufraw_message(UFRAW_ERROR,
+                          _("Another server is listening on '%s'."), path);
+            close(fd);
+            return -1;
+        }
+        g_unlink(path);
+    }
+    /* Only the user may connect. No other thread runs yet, so changing
+     * the umask affects no other files. */
+    mode_t mask = umask(077);
+    int bound = bind(fd, (struct sockaddr *)&addr, sizeof addr);
+    umask(mask);
+    if (bound != 0 || listen(fd, SOMAXCONN) != 0) {
+        ufraw_message(UFRAW_ERROR, _("Cannot listen on '%s': %s"),
+                      path, g_strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void ufraw_serve_unlink(void)
+{
+    unlink(ufraw_serve_path);
+}
+
+/* Remove the socket and die of the signal */
+static void ufraw_serve_signal(int sig)
+{
+    unlink(ufraw_serve_path);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static int ufraw_batch_serve(int optInd, char **argv,
+                             conf_data *rc, conf_data *cmd)
+{
+    int jobs = MAX(cmd->jobs, 1);
+    int inFlight = 0;
+    int i;
+    GList *kept = NULL;
+    GQueue *waiting = g_queue_new();
+
+    int fd = ufraw_serve_listen(cmd->serveSocket);
+    if (fd < 0)
+        return 1;
+    g_strlcpy(ufraw_serve_path, cmd->serveSocket, max_path);
+    atexit(ufraw_serve_unlink);
+    signal(SIGINT, ufraw_serve_signal);
+    signal(SIGTERM, ufraw_serve_signal);
+    signal(SIGHUP, ufraw_serve_signal);
+    // A client that disconnects early must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    ufraw_serve_todo = g_async_queue_new();
+    ufraw_serve_write = g_async_queue_new();
+    for (i = 0; i < jobs; i++)
+#if GLIB_CHECK_VERSION(2,32,0)
+        g_thread_unref(g_thread_new("ufraw-batch", ufraw_serve_worker, NULL));
+    g_thread_unref(g_thread_new("ufraw-accept", ufraw_serve_acceptor,
+                                GINT_TO_POINTER(fd)));
+#else
+        g_thread_create(ufraw_serve_worker, NULL, FALSE, NULL);
+    g_thread_create(ufraw_serve_acceptor, GINT_TO_POINTER(fd), FALSE, NULL);
+#endif
+    ufraw_message(UFRAW_MESSAGE, _("Listening on %s"), cmd->serveSocket);
+
+    for (;;) {
+        ufraw_serve_job *job = g_async_queue_pop(ufraw_serve_todo);
+        if (job->finished) {
+            ufraw_serve_finish(job, &kept);
+            inFlight--;
+        } else {
+            g_queue_push_tail(waiting, job);
+        }
+        /* Decode the next files while there are free slots */
+        while (inFlight < jobs && !g_queue_is_empty(waiting)) {
+            job = g_queue_pop_head(waiting);
+            g_timer_start(job->timer);
+            if (ufraw_serve_load(job, optInd, argv, rc, &kept)) {
+                inFlight++;
+                g_async_queue_push(ufraw_serve_write, job);
+            } else {
+                ufraw_serve_reply(job);
+                ufraw_serve_job_free(job);
+            }
+        }
+    }
+    return 0;
+}
+
+#else
+
+static int ufraw_batch_serve(int optInd, char **argv,
+                             conf_data *rc, conf_data *cmd)
+{
+    (void)optInd;
+    (void)argv;
+    (void)rc;
+    (void)cmd;
+    ufraw_message(UFRAW_ERROR,
+                  _("ufraw was built without UNIX socket support."));
+    return 1;
+}
+
+#endif /* HAVE_SYS_UN_H */
+
 int ufraw_batch_saver(ufraw_data *uf)
+{
+    int status = ufraw_batch_prepare_output(uf);
+    if (status != UFRAW_SUCCESS) return status;
+    status = ufraw_batch_write(uf);
+    if (status != UFRAW_SUCCESS && !uf->conf->embeddedImage)
+        ufraw_message(status, ufraw_get_message(uf));
+    return status;
+}
+
+/* Ask before overwriting an existing file and make its name absolute */
+static int ufraw_batch_prepare_output(ufraw_data *uf)
 {
     if (!uf->conf->overwrite && uf->conf->createID != only_id
             && strcmp(uf->conf->outputFilename, "-")
@@ -145,17 +915,18 @@ int ufraw_batch_saver(ufraw_data *uf)
         g_strlcpy(uf->conf->outputFilename, absname, max_path);
         g_free(absname);
     }
+    return UFRAW_SUCCESS;
+}
+
+static int ufraw_batch_write(ufraw_data *uf)
+{
     if (uf->conf->embeddedImage) {
         int status = ufraw_convert_embedded(uf);
         if (status != UFRAW_SUCCESS) return status;
         status = ufraw_write_embedded(uf);
         return status;
     } else {
-
-        int status = ufraw_write_image(uf);
-        if (status != UFRAW_SUCCESS)
-            ufraw_message(status, ufraw_get_message(uf));
-        return status;
+        return ufraw_write_image(uf);
     }
 }
 
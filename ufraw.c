@@ -78,6 +78,21 @@ int main(int argc, char **argv)
                       _("The --embedded-image option is only valid with 'ufraw-batch'"));
         optInd = -1;
     }
+    if (cmd.jobs != -1) {
+        ufraw_message(UFRAW_ERROR,
+                      _("The --jobs option is only valid with 'ufraw-batch'"));
+        optInd = -1;
+    }
+    if (strlen(cmd.rawCachePath) > 0 || cmd.rawCacheSize != -1) {
+        ufraw_message(UFRAW_ERROR,
+                      _("The --raw-cache options are only valid with 'ufraw-batch'"));
+        optInd = -1;
+    }
+    if (strlen(cmd.serveSocket) > 0) {
+        ufraw_message(UFRAW_ERROR,
+                      _("The --serve option is only valid with 'ufraw-batch'"));
+        optInd = -1;
+    }
     if (optInd < 0) {
 #ifndef _WIN32
         gdk_threads_leave();
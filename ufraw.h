@@ -118,6 +118,9 @@ enum { ahd_interpolation, vng_interpolation, four_color_interpolation,
        none_interpolation, half_interpolation, obsolete_eahd_interpolation,
        num_interpolations
      };
+/* The following enum should match the dcraw resize filter enum
+ * in dcraw_api.h. */
+enum { box_resize, lanczos3_resize, mitchell_resize, num_resize_filters };
 enum { no_id, also_id, only_id, send_id };
 enum { manual_curve, linear_curve, custom_curve, camera_curve };
 enum { in_profile, out_profile, display_profile, profile_types};
@@ -177,6 +180,7 @@ typedef struct {
     void *colorTransform;
     void *working2displayTransform;
     void *rgbtolabTransform;
+    void *colorLut;
     double saturation;
 #ifdef UFRAW_CONTRAST
     double contrast;
@@ -187,6 +191,10 @@ typedef struct {
     void *TransferFunction[3];
     void *saturationProfile;
     void *adjustmentProfile;
+    /* Keys of the profiles above in the shared transform cache */
+    char profileKey[profile_types][max_name];
+    char luminosityKey[max_name], adjustmentKey[max_name];
+    char saturationKey[max_name];
     GrayscaleMode grayscaleMode;
     double grayscaleMixer[3];
     lightness_adjustment lightnessAdjustment[max_adjustments];
@@ -283,7 +291,7 @@ typedef struct {
          outputPath[max_path];
     char inputURI[max_path], inputModTime[max_name];
     int type, compression, createID, embedExif, progressiveJPEG;
-    int shrink, size;
+    int shrink, size, resizeFilter;
     gboolean overwrite, losslessCompress, embeddedImage, noExit;
     gboolean rotate;
 
@@ -301,6 +309,12 @@ typedef struct {
     char curvePath[max_path];
     char profilePath[max_path];
     gboolean silent;
+    int jobs;
+    gboolean colorLut;
+    gboolean pipelineWrite;
+    char rawCachePath[max_path];
+    int rawCacheSize; /* in MB */
+    char serveSocket[max_path];
     char remoteGimpCommand[max_path];
 
     /* EXIF data */
@@ -316,15 +330,21 @@ typedef struct {
     char real_make[max_name], real_model[max_name];
 } conf_data;
 
+/* Edge length in pixels of the subareas that images are computed in */
+#ifndef UFRAW_TILE_SIZE
+#define UFRAW_TILE_SIZE 128
+#endif
+
 typedef struct {
     guint8 *buffer;
     int height, width, depth, rowstride;
-    /* This bit field marks valid pieces of the image with 1's.
-       The variable contains a fixed 4x8 matrix of bits, every bit containing
-       the validity of the respective subarea of the whole image. The subarea
-       sizes are determined by dividing the width by 4 and height by 8.
-       This field must always contain at least 32 bits. */
-    guint32 valid;
+    /* The image is divided into subareas of tileSize x tileSize pixels,
+       tilesX in each row and tilesY in each column. The subareas at the
+       right and bottom edges may be smaller. valid[] holds one byte per
+       subarea, which is non-zero if the subarea is up to date. The grid
+       follows changes of the image size and is reset when it does. */
+    int tileSize, tilesX, tilesY;
+    guint8 *valid;
     gboolean rgbg;
     gboolean invalidate_event;
 } ufraw_image_data;
@@ -346,6 +366,12 @@ typedef struct ufraw_struct {
     gboolean IsXTrans;
     void *unzippedBuf;
     gsize unzippedBufLen;
+    void *inputMap; /* Memory map of the raw file, shared by dcraw and exiv2 */
+    void *rawCache; /* Memory map of the cached raw image, if used */
+    void *rawWindow; /* Cropped part of the raw image being converted */
+    /* The phases before convertedPhase hold the output of the last
+     * ufraw_convert_image() and can be reused by it */
+    UFRawPhase convertedPhase;
     developer_data *developer;
     developer_data *AutoDeveloper;
     guint8 *displayProfile;
@@ -353,6 +379,7 @@ typedef struct ufraw_struct {
     conf_data *conf;
     guchar *inputExifBuf;
     guint inputExifBufLen;
+    gboolean exifPending; /* exiv2 was not needed when the file was opened */
     guchar *outputExifBuf;
     guint outputExifBufLen;
     int gimpImage;
@@ -363,6 +390,7 @@ typedef struct ufraw_struct {
     int modFlags; /* postprocessing operations (LF_MODIFY_XXX) */
     struct lfModifier *TCAmodifier;
     struct lfModifier *modifier;
+    char modifierKey[max_name]; /* Identifies the mapping of modifier */
 #endif /* HAVE_LENSFUN */
     int hotpixels;
     gboolean mark_hotpixels;
@@ -373,6 +401,8 @@ typedef struct ufraw_struct {
 extern const conf_data conf_default;
 extern const wb_data wb_preset[];
 extern const int wb_preset_count;
+const wb_data *wb_preset_find(const char *make, const char *model,
+                              const char *name, int *count);
 extern const char raw_ext[];
 extern const char *file_type[];
 
@@ -388,6 +418,7 @@ extern "C" {
 ufraw_data *ufraw_open(char *filename);
 int ufraw_config(ufraw_data *uf, conf_data *rc, conf_data *conf, conf_data *cmd);
 int ufraw_load_raw(ufraw_data *uf);
+int ufraw_reuse_raw(ufraw_data *uf, ufraw_data *old);
 int ufraw_load_darkframe(ufraw_data *uf);
 void ufraw_developer_prepare(ufraw_data *uf, DeveloperMode mode);
 int ufraw_convert_image(ufraw_data *uf);
@@ -400,6 +431,8 @@ void ufraw_close(ufraw_data *uf);
 void ufraw_flip_orientation(ufraw_data *uf, int flip);
 void ufraw_flip_image(ufraw_data *uf, int flip);
 void ufraw_invalidate_layer(ufraw_data *uf, UFRawPhase phase);
+void ufraw_invalidate_area(ufraw_data *uf, UFRawPhase phase,
+                           UFRectangle area);
 void ufraw_invalidate_tca_layer(ufraw_data *uf);
 void ufraw_invalidate_hotpixel_layer(ufraw_data *uf);
 void ufraw_invalidate_denoise_layer(ufraw_data *uf);
@@ -420,6 +453,9 @@ void ufraw_get_scaled_crop(ufraw_data *uf, UFRectangle *crop);
 UFRectangle ufraw_image_get_subarea_rectangle(ufraw_image_data *img,
         unsigned saidx);
 unsigned ufraw_img_get_subarea_idx(ufraw_image_data *img, int x, int y);
+int ufraw_image_get_subarea_count(ufraw_image_data *img);
+gboolean ufraw_image_is_valid(ufraw_image_data *img);
+void ufraw_image_invalidate(ufraw_image_data *img);
 
 /* prototypes for functions in ufraw_message.c */
 char *ufraw_get_message(ufraw_data *uf);
@@ -433,6 +469,10 @@ int ufraw_get_status(ufraw_data *uf);
 int ufraw_is_error(ufraw_data *uf);
 // Old error handling, should be removed after being fully implemented.
 char *ufraw_message(int code, const char *format, ...);
+void *ufraw_message_detach(void);
+void ufraw_message_attach(void *messages);
+void ufraw_message_capture(void);
+char *ufraw_message_captured(void);
 void ufraw_batch_messenger(char *message);
 
 /* prototypes for functions in ufraw_preview.c */
@@ -502,7 +542,7 @@ long ufraw_send_to_gimp(ufraw_data *uf);
 
 /* prototype for functions in ufraw_writer.c */
 int ufraw_write_image(ufraw_data *uf);
-void ufraw_write_image_data(
+int ufraw_write_image_data(
     ufraw_data *uf, void * volatile out,
     const UFRectangle *Crop, int bitDepth, int grayscaleMode,
     int (*row_writer)(ufraw_data *, void * volatile, void *, int, int, int, int, int));
@@ -515,6 +555,11 @@ int ufraw_read_embedded(ufraw_data *uf);
 int ufraw_convert_embedded(ufraw_data *uf);
 int ufraw_write_embedded(ufraw_data *uf);
 
+/* prototype for functions in ufraw_cache.c */
+gboolean ufraw_cache_load(ufraw_data *uf);
+void ufraw_cache_save(ufraw_data *uf);
+void ufraw_cache_release(ufraw_data *uf);
+
 /* prototype for functions in ufraw_chooser.c */
 void ufraw_chooser(conf_data *conf, conf_data *rc, conf_data *cmd,
                    const char *defPath);
@@ -526,6 +571,7 @@ void ufraw_icons_init();
 int ufraw_exif_read_input(ufraw_data *uf);
 int ufraw_exif_prepare_output(ufraw_data *uf);
 int ufraw_exif_write(ufraw_data *uf);
+int ufraw_exif_write_tiff(ufraw_data *uf, void *out);
 
 #ifdef __cplusplus
 } // extern "C"
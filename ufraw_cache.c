@@ -0,0 +1,273 @@
+/*
+ * UFRaw - Unidentified Flying Raw converter for digital camera images
+ *
+ * ufraw_cache.c - on-disk cache of decoded raw images.
+ * Copyright 2004-2016 by Udi Fuchs
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "ufraw.h"
+#include "dcraw_api.h"
+#include <string.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+/* A cache file holds the state of a raw image after dcraw_load_raw() and
+ * ufraw_scale_raw(): a header with the dcraw_data fields that loading the
+ * raw image sets, followed by raw->raw.image. The image is memory mapped
+ * when it is read back, so it starts at a page aligned offset.
+ *
+ * Cache files are named by a hash of the raw file's absolute path, size,
+ * modification time and the UFRaw version. The modification time of a
+ * cache file is updated whenever it is used, and the least recently used
+ * files are removed first when the cache grows beyond its size limit.
+ */
+
+#define UFRAW_CACHE_MAGIC "UFRawRC1"
+#define UFRAW_CACHE_SUFFIX ".rawcache"
+#define UFRAW_CACHE_DATA_OFFSET 4096
+
+typedef struct {
+    char magic[8];
+    guint32 byteOrder;
+    char make[80], model[80];
+    int width, height, colors, fourColorFilters, shrink;
+    unsigned filters;
+    int rawWidth, rawHeight, rawColors;
+    float pre_mul[4], cam_mul[4], rgb_cam[3][4];
+    double cam_rgb[4][3];
+    int rgbMax, black;
+    short fuji_dr;
+    unsigned rawMultiplier;
+} ufraw_cache_header;
+
+static char *ufraw_cache_filename(ufraw_data *uf)
+{
+    struct stat s;
+    if (g_stat(uf->filename, &s) != 0)
+        return NULL;
+    char *absname = uf_file_set_absolute(uf->filename);
+    char *key = g_strdup_printf("%s\n%" G_GINT64_FORMAT "\n%" G_GINT64_FORMAT
+                                "\n%s", absname, (gint64)s.st_size,
+                                (gint64)s.st_mtime, VERSION);
+    char *hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, key, -1);
+    char *basename = g_strconcat(hash, UFRAW_CACHE_SUFFIX, NULL);
+    char *filename = g_build_filename(uf->conf->rawCachePath, basename, NULL);
+    g_free(basename);
+    g_free(hash);
+    g_free(key);
+    g_free(absname);
+    return filename;
+}
+
+static gsize ufraw_cache_image_size(const dcraw_data *raw)
+{
+    return (gsize)raw->raw.width * raw->raw.height * sizeof(dcraw_image_type);
+}
+
+/* Set raw->raw.image from the cache, if the raw file is there.
+ * This replaces dcraw_load_raw() and ufraw_scale_raw().
+ */
+gboolean ufraw_cache_load(ufraw_data *uf)
+{
+    dcraw_data *raw = uf->raw;
+    if (strlen(uf->conf->rawCachePath) == 0)
+        return FALSE;
+    char *filename = ufraw_cache_filename(uf);
+    if (filename == NULL)
+        return FALSE;
+    /* A writable map is private to this process. Nothing should modify
+     * the raw image, but if something does the cache file is safe. */
+    GMappedFile *map = g_mapped_file_new(filename, TRUE, NULL);
+    if (map == NULL) {
+        g_free(filename);
+        return FALSE;
+    }
+    char *contents = g_mapped_file_get_contents(map);
+    gsize length = g_mapped_file_get_length(map);
+    const ufraw_cache_header *head = (const ufraw_cache_header *)contents;
+    if (length < UFRAW_CACHE_DATA_OFFSET ||
+            memcmp(head->magic, UFRAW_CACHE_MAGIC, sizeof head->magic) != 0 ||
+            head->byteOrder != G_BYTE_ORDER ||
+            strcmp(head->make, raw->make) != 0 ||
+            strcmp(head->model, raw->model) != 0 ||
+            length != UFRAW_CACHE_DATA_OFFSET + (gsize)head->rawWidth *
+            head->rawHeight * sizeof(dcraw_image_type)) {
+        ufraw_message(UFRAW_SET_LOG, "Ignoring invalid cache file %s\n",
+                      filename);
+#if GLIB_CHECK_VERSION(2,22,0)
+        g_mapped_file_unref(map);
+#else
+        g_mapped_file_free(map);
+#endif
+        g_free(filename);
+        return FALSE;
+    }
+    dcraw_release_input(raw);
+    raw->width = head->width;
+    raw->height = head->height;
+    raw->colors = head->colors;
+    raw->fourColorFilters = head->fourColorFilters;
+    raw->shrink = head->shrink;
+    raw->filters = head->filters;
+    raw->raw.width = head->rawWidth;
+    raw->raw.height = head->rawHeight;
+    raw->raw.colors = head->rawColors;
+    raw->raw.image = (dcraw_image_type *)(contents + UFRAW_CACHE_DATA_OFFSET);
+    memcpy(raw->pre_mul, head->pre_mul, sizeof raw->pre_mul);
+    memcpy(raw->cam_mul, head->cam_mul, sizeof raw->cam_mul);
+    memcpy(raw->rgb_cam, head->rgb_cam, sizeof raw->rgb_cam);
+    memcpy(raw->cam_rgb, head->cam_rgb, sizeof raw->cam_rgb);
+    raw->rgbMax = head->rgbMax;
+    raw->black = head->black;
+    raw->fuji_dr = head->fuji_dr;
+    uf->raw_multiplier = head->rawMultiplier;
+    uf->rawCache = map;
+    // Mark the cache file as recently used
+    g_utime(filename, NULL);
+    ufraw_message(UFRAW_SET_LOG, "Raw image loaded from cache file %s\n",
+                  filename);
+    g_free(filename);
+    return TRUE;
+}
+
+typedef struct {
+    char *filename;
+    gint64 size;
+    time_t mtime;
+} ufraw_cache_entry;
+
+static gint ufraw_cache_entry_compare(gconstpointer a, gconstpointer b)
+{
+    const ufraw_cache_entry *e1 = a, *e2 = b;
+    return e1->mtime < e2->mtime ? -1 : e1->mtime > e2->mtime ? 1 : 0;
+}
+
+/* Remove the least recently used files until the cache fits its limit */
+static void ufraw_cache_trim(const char *path, gint64 maxSize)
+{
+    GDir *dir = g_dir_open(path, 0, NULL);
+    if (dir == NULL)
+        return;
+    GArray *entries = g_array_new(FALSE, FALSE, sizeof(ufraw_cache_entry));
+    gint64 total = 0;
+    const char *name;
+    while ((name = g_dir_read_name(dir)) != NULL) {
+        if (!g_str_has_suffix(name, UFRAW_CACHE_SUFFIX))
+            continue;
+        ufraw_cache_entry e;
+        struct stat s;
+        e.filename = g_build_filename(path, name, NULL);
+        if (g_stat(e.filename, &s) != 0) {
+            g_free(e.filename);
+            continue;
+        }
+        e.size = s.st_size;
+        e.mtime = s.st_mtime;
+        total += e.size;
+        g_array_append_val(entries, e);
+    }
+    g_dir_close(dir);
+    g_array_sort(entries, ufraw_cache_entry_compare);
+    guint i;
+    for (i = 0; i < entries->len; i++) {
+        ufraw_cache_entry *e = &g_array_index(entries, ufraw_cache_entry, i);
+        if (total > maxSize && g_unlink(e->filename) == 0)
+            total -= e->size;
+        g_free(e->filename);
+    }
+    g_array_free(entries, TRUE);
+}
+
+/* Store the raw image that was just loaded in the cache */
+void ufraw_cache_save(ufraw_data *uf)
+{
+    dcraw_data *raw = uf->raw;
+    const char *path = uf->conf->rawCachePath;
+    if (strlen(path) == 0 || uf->rawCache != NULL)
+        return;
+    if (g_mkdir_with_parents(path, 0700) != 0) {
+        ufraw_message(UFRAW_SET_LOG, "Cannot create cache directory %s\n",
+                      path);
+        return;
+    }
+    char *filename = ufraw_cache_filename(uf);
+    if (filename == NULL)
+        return;
+
+    ufraw_cache_header head;
+    memset(&head, 0, sizeof head);
+    memcpy(head.magic, UFRAW_CACHE_MAGIC, sizeof head.magic);
+    head.byteOrder = G_BYTE_ORDER;
+    g_strlcpy(head.make, raw->make, sizeof head.make);
+    g_strlcpy(head.model, raw->model, sizeof head.model);
+    head.width = raw->width;
+    head.height = raw->height;
+    head.colors = raw->colors;
+    head.fourColorFilters = raw->fourColorFilters;
+    head.shrink = raw->shrink;
+    head.filters = raw->filters;
+    head.rawWidth = raw->raw.width;
+    head.rawHeight = raw->raw.height;
+    head.rawColors = raw->raw.colors;
+    memcpy(head.pre_mul, raw->pre_mul, sizeof head.pre_mul);
+    memcpy(head.cam_mul, raw->cam_mul, sizeof head.cam_mul);
+    memcpy(head.rgb_cam, raw->rgb_cam, sizeof head.rgb_cam);
+    memcpy(head.cam_rgb, raw->cam_rgb, sizeof head.cam_rgb);
+    head.rgbMax = raw->rgbMax;
+    head.black = raw->black;
+    head.fuji_dr = raw->fuji_dr;
+    head.rawMultiplier = uf->raw_multiplier;
+
+    /* Write to a temporary file first, so that other processes never
+     * see a partial cache file. */
+    gsize size = ufraw_cache_image_size(raw);
+    char *tmpname = g_strconcat(filename, ".XXXXXX", NULL);
+    int fd = g_mkstemp(tmpname);
+    FILE *out = fd < 0 ? NULL : fdopen(fd, "wb");
+    gboolean ok = out != NULL &&
+                  fwrite(&head, sizeof head, 1, out) == 1 &&
+                  fseek(out, UFRAW_CACHE_DATA_OFFSET, SEEK_SET) == 0 &&
+                  fwrite(raw->raw.image, 1, size, out) == size;
+    if (out != NULL) {
+        if (fclose(out) != 0)
+            ok = FALSE;
+    } else if (fd >= 0) {
+        close(fd);
+    }
+    if (ok && g_rename(tmpname, filename) == 0) {
+        ufraw_message(UFRAW_SET_LOG, "Raw image saved to cache file %s\n",
+                      filename);
+        ufraw_cache_trim(path, (gint64)uf->conf->rawCacheSize << 20);
+    } else {
+        ufraw_message(UFRAW_SET_LOG, "Cannot write cache file %s\n",
+                      filename);
+        if (fd >= 0)
+            g_unlink(tmpname);
+    }
+    g_free(tmpname);
+    g_free(filename);
+}
+
+/* Release the memory map of the raw image. Must be called before
+ * dcraw_close(), which would otherwise try to free the image. */
+void ufraw_cache_release(ufraw_data *uf)
+{
+    GMappedFile *map = uf->rawCache;
+    if (map == NULL)
+        return;
+    ((dcraw_data *)uf->raw)->raw.image = NULL;
+    uf->rawCache = NULL;
+#if GLIB_CHECK_VERSION(2,22,0)
+    g_mapped_file_unref(map);
+#else
+    g_mapped_file_free(map);
+#endif
+}
@@ -111,7 +111,7 @@ const conf_data conf_default = {
     ppm_type, 85, no_id, /* type, compression, createID */
     TRUE, /* embedExif */
     FALSE, /* progressiveJPEG */
-    1, 0, /* shrink, size */
+    1, 0, box_resize, /* shrink, size, resizeFilter */
     FALSE, /* overwrite existing files without asking */
     FALSE, /* losslessCompress */
     FALSE, /* load embedded preview image */
@@ -133,6 +133,11 @@ const conf_data conf_default = {
     0, /* number of helper lines to draw */
     "", "", /* curvePath, profilePath */
     FALSE, /* silent */
+    1, /* jobs */
+    FALSE, /* colorLut */
+    TRUE, /* pipelineWrite */
+    "", 2048, /* rawCachePath, rawCacheSize */
+    "", /* serveSocket */
 #ifdef _WIN32
     "gimp-win-remote gimp-2.8.exe", /* remoteGimpCommand */
 #elif HAVE_GIMP_2_4
@@ -162,6 +167,8 @@ static const char *clipHighlightsNames[] =
 { "digital", "film", NULL };
 static const char *intentNames[] =
 { "perceptual", "relative", "saturation", "absolute", "disable", NULL };
+static const char *resizeFilterNames[] =
+{ "box", "lanczos3", "mitchell", NULL };
 static const char *grayscaleModeNames[] =
 { "none", "lightness", "luminance", "value", "mixer", NULL };
 
@@ -755,6 +762,9 @@ static void conf_parse_text(GMarkupParseContext *context, const gchar *text,
     if (!strcmp("Rotation", element)) sscanf(temp, "%lf", &c->rotationAngle);
     if (!strcmp("Shrink", element)) sscanf(temp, "%d", &c->shrink);
     if (!strcmp("Size", element)) sscanf(temp, "%d", &c->size);
+    if (!strcmp("ResizeFilter", element))
+        c->resizeFilter = conf_find_name(temp, resizeFilterNames,
+                                         conf_default.resizeFilter);
     if (!strcmp("OutputType", element)) sscanf(temp, "%d", &c->type);
     if (!strcmp("CreateID", element)) sscanf(temp, "%d", &c->createID);
     if (!strcmp("EmbedExif", element)) sscanf(temp, "%d", &c->embedExif);
@@ -1097,6 +1107,9 @@ int conf_save(conf_data *c, char *IDFilename, char **confBuffer)
     }
     if (c->size != conf_default.size)
         buf = uf_markup_buf(buf, "<Size>%d</Size>\n", c->size);
+    if (c->resizeFilter != conf_default.resizeFilter)
+        buf = uf_markup_buf(buf, "<ResizeFilter>%s</ResizeFilter>\n",
+                            conf_get_name(resizeFilterNames, c->resizeFilter));
     if (c->shrink != conf_default.shrink)
         buf = uf_markup_buf(buf, "<Shrink>%d</Shrink>\n", c->shrink);
     if (c->type != conf_default.type)
@@ -1476,6 +1489,7 @@ void conf_copy_save(conf_data *dst, const conf_data *src)
     dst->embedExif = src->embedExif;
     dst->shrink = src->shrink;
     dst->size = src->size;
+    dst->resizeFilter = src->resizeFilter;
     dst->overwrite = src->overwrite;
     dst->RememberOutputPath = src->RememberOutputPath;
     dst->progressiveJPEG = src->progressiveJPEG;
@@ -1516,6 +1530,12 @@ int conf_set_cmd(conf_data *conf, const conf_data *cmd)
     if (cmd->CropY2 != -1) conf->CropY2 = cmd->CropY2;
     if (cmd->aspectRatio != 0.0) conf->aspectRatio = cmd->aspectRatio;
     if (cmd->silent != -1) conf->silent = cmd->silent;
+    if (cmd->jobs != -1) conf->jobs = cmd->jobs;
+    if (cmd->colorLut != -1) conf->colorLut = cmd->colorLut;
+    if (cmd->pipelineWrite != -1) conf->pipelineWrite = cmd->pipelineWrite;
+    if (strlen(cmd->rawCachePath) > 0)
+        g_strlcpy(conf->rawCachePath, cmd->rawCachePath, max_path);
+    if (cmd->rawCacheSize != -1) conf->rawCacheSize = cmd->rawCacheSize;
     if (cmd->compression != NULLF) conf->compression = cmd->compression;
     if (cmd->autoExposure) {
         conf->autoExposure = cmd->autoExposure;
@@ -1578,6 +1598,7 @@ int conf_set_cmd(conf_data *conf, const conf_data *cmd)
         if (conf->interpolation == half_interpolation)
             conf->interpolation = ahd_interpolation;
     }
+    if (cmd->resizeFilter >= 0) conf->resizeFilter = cmd->resizeFilter;
     if (cmd->type >= 0) conf->type = cmd->type;
     if (cmd->createID >= 0) conf->createID = cmd->createID;
     if (strlen(cmd->darkframeFile) > 0)
@@ -1673,6 +1694,8 @@ char *helpText[] = {
     "\n",
     N_("--shrink=FACTOR       Shrink the image by FACTOR (default 1).\n"),
     N_("--size=SIZE           Downsize max(height,width) to SIZE.\n"),
+    N_("--resize-filter=box|lanczos3|mitchell\n"
+    "                      Filter used by --size (default box).\n"),
     N_("--out-type=ppm|tiff|tif|png|jpeg|jpg|fits\n"
     "                      Output file format (default ppm).\n"),
     N_("--out-depth=8|16      Output bit depth per channel (default 8).\n"),
@@ -1703,6 +1726,25 @@ char *helpText[] = {
     N_("--maximize-window     Force window to be maximized.\n"),
     N_("--silent              Do not display any messages during conversion. This\n"
     "                      option is only valid with 'ufraw-batch'.\n"),
+    N_("--jobs=N              Convert up to N files concurrently, decoding the next\n"
+    "                      file while the previous ones are developed and saved.\n"
+    "                      At most N images are kept in memory (default 1). This\n"
+    "                      option is only valid with 'ufraw-batch'.\n"),
+    N_("--color-lut           Develop saved images through a precomputed 3D color\n"
+    "                      table. This is faster, but the colors may differ\n"
+    "                      slightly from the exact result (default no).\n"),
+    N_("--[no]pipeline        Develop the next rows of the output image while the\n"
+    "                      previous ones are compressed and written (default\n"
+    "                      pipeline).\n"),
+    N_("--raw-cache=PATH      Keep decoded raw images in PATH and reuse them when\n"
+    "                      the same raw file is loaded again. This option is\n"
+    "                      only valid with 'ufraw-batch'.\n"),
+    N_("--raw-cache-size=MB   Size limit of the raw image cache. The least recently\n"
+    "                      used images are removed first (default 2048). This\n"
+    "                      option is only valid with 'ufraw-batch'.\n"),
+    N_("--serve=SOCKET        Run as a server that reads conversion jobs from the\n"
+    "                      UNIX socket SOCKET, one command line per job. This\n"
+    "                      option is only valid with 'ufraw-batch'.\n"),
     "\n",
     N_("UFRaw first reads the setting from the resource file $HOME/.ufrawrc.\n"
     "Then, if an ID file is specified, its setting are read. Next, the setting from\n"
@@ -1796,7 +1838,8 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
     char *baseCurveName = NULL, *baseCurveFile = NULL,
           *curveName = NULL, *curveFile = NULL, *outTypeName = NULL, *rotateName = NULL,
            *createIDName = NULL, *outPath = NULL, *output = NULL, *conf = NULL,
-            *interpolationName = NULL, *darkframeFile = NULL,
+            *interpolationName = NULL, *darkframeFile = NULL, *rawCachePath = NULL,
+             *resizeFilterName = NULL, *serveSocket = NULL,
              *restoreName = NULL, *clipName = NULL, *grayscaleName = NULL,
               *grayscaleMixer = NULL;
     static const struct option options[] = {
@@ -1825,6 +1868,7 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
         { "grayscale-mixer", 1, 0, 'a'},
         { "shrink", 1, 0, 'x'},
         { "size", 1, 0, 'X'},
+        { "resize-filter", 1, 0, 'U'},
         { "compression", 1, 0, 'j'},
         { "out-type", 1, 0, 'T'},
         { "out-depth", 1, 0, 'd'},
@@ -1841,6 +1885,10 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
         { "crop-right", 1, 0, '3'},
         { "crop-bottom", 1, 0, '4'},
         { "aspect-ratio", 1, 0, 'P'},
+        { "jobs", 1, 0, 'J'},
+        { "raw-cache", 1, 0, 'N'},
+        { "raw-cache-size", 1, 0, 'Q'},
+        { "serve", 1, 0, '5'},
         /* Binary flags that don't have a value are here at the end */
         { "zip", 0, 0, 'z'},
         { "nozip", 0, 0, 'Z'},
@@ -1851,6 +1899,9 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
         { "noexif", 0, 0, 'F'},
         { "embedded-image", 0, 0, 'm'},
         { "silent", 0, 0, 'q'},
+        { "color-lut", 0, 0, 'K'},
+        { "pipeline", 0, 0, 'l'},
+        { "nopipeline", 0, 0, 'V'},
         { "help", 0, 0, 'h'},
         { "version", 0, 0, 'v'},
         { "batch", 0, 0, 'b'},
@@ -1875,12 +1926,13 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
         &cmd->threshold,
         &cmd->exposure, &cmd->black, &interpolationName, &grayscaleName,
         &grayscaleMixer,
-        &cmd->shrink, &cmd->size, &cmd->compression,
+        &cmd->shrink, &cmd->size, &resizeFilterName, &cmd->compression,
         &outTypeName, &cmd->profile[1][0].BitDepth, &rotateName,
         &createIDName, &outPath, &output, &darkframeFile,
         &restoreName, &clipName, &conf,
         &cmd->CropX1, &cmd->CropY1, &cmd->CropX2, &cmd->CropY2,
-        &cmd->aspectRatio
+        &cmd->aspectRatio, &cmd->jobs, &rawCachePath, &cmd->rawCacheSize,
+        &serveSocket
     };
     cmd->autoExposure = disabled_state;
     cmd->autoBlack = disabled_state;
@@ -1892,6 +1944,12 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
     cmd->profile[1][0].BitDepth = -1;
     cmd->embeddedImage = FALSE;
     cmd->silent = FALSE;
+    cmd->jobs = -1;
+    cmd->colorLut = -1;
+    cmd->pipelineWrite = -1;
+    cmd->rawCacheSize = -1;
+    cmd->rawCachePath[0] = '\0';
+    cmd->serveSocket[0] = '\0';
     cmd->profile[0][0].gamma = NULLF;
     cmd->profile[0][0].linear = NULLF;
     cmd->hotpixel = NULLF;
@@ -1982,6 +2040,23 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
                 }
                 uf_reset_locale(locale);
                 break;
+            case 'J':
+                if (sscanf(optarg, "%d", &cmd->jobs) == 0 || cmd->jobs < 1) {
+                    ufraw_message(UFRAW_ERROR,
+                                  _("'%s' is not a valid value for the --%s option."),
+                                  optarg, options[index].name);
+                    return -1;
+                }
+                break;
+            case 'Q':
+                if (sscanf(optarg, "%d", &cmd->rawCacheSize) == 0 ||
+                        cmd->rawCacheSize < 0) {
+                    ufraw_message(UFRAW_ERROR,
+                                  _("'%s' is not a valid value for the --%s option."),
+                                  optarg, options[index].name);
+                    return -1;
+                }
+                break;
             case 'B':
             case 'S':
             case 'c':
@@ -1998,6 +2073,9 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
             case 'u':
             case 'Y':
             case 'a':
+            case 'N':
+            case 'U':
+            case '5':
                 *(char **)optPointer[index] = optarg;
                 break;
             case 'O':
@@ -2015,6 +2093,15 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
             case 'q':
                 cmd->silent = TRUE;
                 break;
+            case 'K':
+                cmd->colorLut = TRUE;
+                break;
+            case 'l':
+                cmd->pipelineWrite = TRUE;
+                break;
+            case 'V':
+                cmd->pipelineWrite = FALSE;
+                break;
             case 'z':
 #ifdef HAVE_LIBZ
                 cmd->losslessCompress = TRUE;
@@ -2218,6 +2305,17 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
             return -1;
         }
     }
+    cmd->resizeFilter = -1;
+    if (resizeFilterName != NULL) {
+        cmd->resizeFilter = conf_find_name(resizeFilterName,
+                                           resizeFilterNames, -1);
+        if (cmd->resizeFilter < 0) {
+            ufraw_message(UFRAW_ERROR,
+                          _("'%s' is not a valid resize filter option."),
+                          resizeFilterName);
+            return -1;
+        }
+    }
     cmd->clipHighlights = -1;
     if (clipName != NULL) {
         cmd->clipHighlights = conf_find_name(clipName,
@@ -2449,6 +2547,20 @@ int ufraw_process_args(int *argc, char ***argv, conf_data *cmd, conf_data *rc)
         g_strlcpy(cmd->darkframeFile, df, max_path);
         g_free(df);
     }
+    g_strlcpy(cmd->rawCachePath, "", max_path);
+    if (rawCachePath != NULL) {
+        rawCachePath = uf_win32_locale_to_utf8(rawCachePath);
+        char *path = uf_file_set_absolute(rawCachePath);
+        uf_win32_locale_free(rawCachePath);
+        g_strlcpy(cmd->rawCachePath, path, max_path);
+        g_free(path);
+    }
+    g_strlcpy(cmd->serveSocket, "", max_path);
+    if (serveSocket != NULL) {
+        serveSocket = uf_win32_locale_to_utf8(serveSocket);
+        g_strlcpy(cmd->serveSocket, serveSocket, max_path);
+        uf_win32_locale_free(serveSocket);
+    }
     /* cmd->inputFilename is used to store the conf file */
     g_strlcpy(cmd->inputFilename, "", max_path);
     if (conf != NULL)
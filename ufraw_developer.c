@@ -16,6 +16,9 @@
 #endif
 #include <math.h>
 #include <string.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
 #include <lcms2.h>
 #include <lcms2_plugin.h>
 #include "ufraw_colorspaces.h"
@@ -30,6 +33,125 @@ static void lcms_message(cmsContext ContextID,
     ufraw_message(UFRAW_ERROR, "%s", ErrorText);
 }
 
+/*
+ * Cache of lcms transforms and of the abstract profiles that are sampled
+ * for the luminosity curve, the lightness adjustments and the saturation.
+ * Building them is expensive, and in batch every file builds the same
+ * ones again. The cache is shared by all developers. Entries are keyed by
+ * a hash of everything they are built from and are reference counted.
+ * Up to DEVELOPER_CACHE_SIZE entries that are no longer in use are kept,
+ * the least recently used are freed first.
+ */
+#define DEVELOPER_CACHE_SIZE 32
+
+typedef struct {
+    char *key;
+    void *handle;
+    gboolean transform;
+    int refCount;
+} developer_cache_entry;
+
+/* Most recently used first */
+static GList *developer_cache = NULL;
+G_LOCK_DEFINE_STATIC(developer_cache);
+
+static char *developer_cache_key(const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    char *text = g_strdup_vprintf(format, ap);
+    va_end(ap);
+    char *key = g_compute_checksum_for_string(G_CHECKSUM_SHA1, text, -1);
+    g_free(text);
+    return key;
+}
+
+static char *developer_data_key(const char *kind, const void *data, gsize size)
+{
+    char *hash = g_compute_checksum_for_data(G_CHECKSUM_SHA1, data, size);
+    char *key = developer_cache_key("%s\n%s", kind, hash);
+    g_free(hash);
+    return key;
+}
+
+/* Free the unused entries beyond the cache size.
+ * Must be called with the cache locked. */
+static void developer_cache_trim(void)
+{
+    int unused = 0;
+    GList *l = developer_cache;
+    while (l != NULL) {
+        GList *next = l->next;
+        developer_cache_entry *e = l->data;
+        if (e->refCount == 0 && ++unused > DEVELOPER_CACHE_SIZE) {
+            if (e->transform)
+                cmsDeleteTransform(e->handle);
+            else
+                cmsCloseProfile(e->handle);
+            g_free(e->key);
+            g_free(e);
+            developer_cache = g_list_delete_link(developer_cache, l);
+        }
+        l = next;
+    }
+}
+
+/* Return a new reference to the handle cached for key, or NULL */
+static void *developer_cache_get(const char *key)
+{
+    void *handle = NULL;
+    GList *l;
+    G_LOCK(developer_cache);
+    for (l = developer_cache; l != NULL; l = l->next) {
+        developer_cache_entry *e = l->data;
+        if (strcmp(e->key, key) == 0) {
+            e->refCount++;
+            handle = e->handle;
+            developer_cache = g_list_remove_link(developer_cache, l);
+            developer_cache = g_list_concat(l, developer_cache);
+            break;
+        }
+    }
+    G_UNLOCK(developer_cache);
+    return handle;
+}
+
+/* Add a handle that was just built to the cache and return it.
+ * The caller holds the only reference to it. */
+static void *developer_cache_add(const char *key, void *handle,
+                                 gboolean transform)
+{
+    if (handle == NULL)
+        return NULL;
+    developer_cache_entry *e = g_new(developer_cache_entry, 1);
+    e->key = g_strdup(key);
+    e->handle = handle;
+    e->transform = transform;
+    e->refCount = 1;
+    G_LOCK(developer_cache);
+    developer_cache = g_list_prepend(developer_cache, e);
+    developer_cache_trim();
+    G_UNLOCK(developer_cache);
+    return handle;
+}
+
+static void developer_cache_release(void *handle)
+{
+    GList *l;
+    if (handle == NULL)
+        return;
+    G_LOCK(developer_cache);
+    for (l = developer_cache; l != NULL; l = l->next) {
+        developer_cache_entry *e = l->data;
+        if (e->handle == handle) {
+            e->refCount--;
+            break;
+        }
+    }
+    developer_cache_trim();
+    G_UNLOCK(developer_cache);
+}
+
 developer_data *developer_init()
 {
     int i;
@@ -44,6 +166,7 @@ developer_data *developer_init()
     for (i = 0; i < profile_types; i++) {
         d->profile[i] = NULL;
         strcpy(d->profileFile[i], "no such file");
+        strcpy(d->profileKey[i], "");
     }
     memset(&d->baseCurveData, 0, sizeof(d->baseCurveData));
     d->baseCurveData.m_gamma = -1.0;
@@ -55,12 +178,16 @@ developer_data *developer_init()
     TransferFunction[1] = TransferFunction[2] = cmsBuildGamma(NULL, 1.0);
     d->saturationProfile = NULL;
     d->adjustmentProfile = NULL;
+    strcpy(d->luminosityKey, "");
+    strcpy(d->adjustmentKey, "");
+    strcpy(d->saturationKey, "");
     d->intent[out_profile] = -1;
     d->intent[display_profile] = -1;
     d->updateTransform = TRUE;
     d->colorTransform = NULL;
     d->working2displayTransform = NULL;
     d->rgbtolabTransform = NULL;
+    d->colorLut = NULL;
     d->grayscaleMode = -1;
     d->grayscaleMixer[0] = d->grayscaleMixer[1] = d->grayscaleMixer[2] = -1;
     for (i = 0; i < max_adjustments; i++) { /* Suppress valgrind error. */
@@ -78,17 +205,15 @@ void developer_destroy(developer_data *d)
     if (d == NULL) return;
     for (i = 0; i < profile_types; i++)
         if (d->profile[i] != NULL) cmsCloseProfile(d->profile[i]);
-    cmsCloseProfile(d->luminosityProfile);
+    developer_cache_release(d->luminosityProfile);
     cmsFreeToneCurve(d->TransferFunction[0]);
     cmsFreeToneCurve(d->TransferFunction[1]);
-    cmsCloseProfile(d->saturationProfile);
-    cmsCloseProfile(d->adjustmentProfile);
-    if (d->colorTransform != NULL)
-        cmsDeleteTransform(d->colorTransform);
-    if (d->working2displayTransform != NULL)
-        cmsDeleteTransform(d->working2displayTransform);
-    if (d->rgbtolabTransform != NULL)
-        cmsDeleteTransform(d->rgbtolabTransform);
+    developer_cache_release(d->saturationProfile);
+    developer_cache_release(d->adjustmentProfile);
+    developer_cache_release(d->colorTransform);
+    developer_cache_release(d->working2displayTransform);
+    developer_cache_release(d->rgbtolabTransform);
+    g_free(d->colorLut);
     g_free(d);
 }
 
@@ -136,12 +261,28 @@ void developer_profile(developer_data *d, int type, profile_data *p)
     if (strcmp(p->file, d->profileFile[type])) {
         g_strlcpy(d->profileFile[type], p->file, max_path);
         if (d->profile[type] != NULL) cmsCloseProfile(d->profile[type]);
-        if (!strcmp(d->profileFile[type], ""))
+        if (!strcmp(d->profileFile[type], "")) {
             d->profile[type] = uf_colorspaces_create_srgb_profile();
-        else {
+            strcpy(d->profileKey[type], "sRGB");
+        } else {
             char *filename =
                 uf_win32_locale_filename_from_utf8(d->profileFile[type]);
             d->profile[type] = cmsOpenProfileFromFile(filename, "r");
+            /* The key is the path, and the size and modification time
+             * if known, so that a changed profile file does not match
+             * the transforms built from the old one. */
+            struct stat s;
+            char *key;
+            if (g_stat(filename, &s) == 0)
+                key = developer_cache_key("file\n%s\n%" G_GINT64_FORMAT
+                                          "\n%" G_GINT64_FORMAT,
+                                          d->profileFile[type],
+                                          (gint64)s.st_size,
+                                          (gint64)s.st_mtime);
+            else
+                key = developer_cache_key("file\n%s", d->profileFile[type]);
+            g_strlcpy(d->profileKey[type], key, max_name);
+            g_free(key);
             uf_win32_locale_filename_free(filename);
             if (d->profile[type] == NULL)
                 d->profile[type] = uf_colorspaces_create_srgb_profile();
@@ -165,8 +306,16 @@ void developer_display_profile(developer_data *d,
         if (d->profile[type] != NULL) cmsCloseProfile(d->profile[type]);
         d->profile[type] = cmsOpenProfileFromMem(profile, size);
         // If embedded profile is invalid fall-back to sRGB
-        if (d->profile[type] == NULL)
+        if (d->profile[type] == NULL) {
             d->profile[type] = uf_colorspaces_create_srgb_profile();
+            strcpy(d->profileKey[type], "sRGB");
+        } else {
+            char *key = developer_data_key("embedded", profile, size);
+            if (strcmp(key, d->profileKey[type]) != 0)
+                d->updateTransform = TRUE;
+            g_strlcpy(d->profileKey[type], key, max_name);
+            g_free(key);
+        }
         if (strcmp(d->profileFile[type], embedded_display_profile) != 0) {
             // start using embedded profile
             g_strlcpy(d->profileFile[type], embedded_display_profile, max_path);
@@ -178,6 +327,7 @@ void developer_display_profile(developer_data *d,
             if (d->profile[type] != NULL) cmsCloseProfile(d->profile[type]);
             d->profile[type] = uf_colorspaces_create_srgb_profile();
             strcpy(d->profileFile[type], "");
+            strcpy(d->profileKey[type], "sRGB");
             d->updateTransform = TRUE;
         }
     }
@@ -394,11 +544,259 @@ static double findExpCoeff(double b)
     return a;
 }
 
+/*
+ * Optional 3D color table for saving images. It combines everything that
+ * follows the white balance in develop(): the color matrix, exposure, the
+ * gamma and base curves, grayscale conversion and the color transform with
+ * the luminosity, adjustment, saturation and output profiles.
+ * The table is indexed by the white balanced camera RGB values. The nodes
+ * are spaced quadratically on each axis, since the gamma curve needs more
+ * resolution in the shadows. Values between the nodes are interpolated
+ * tetrahedrally.
+ */
+#define COLOR_LUT_SIZE 65
+#define COLOR_LUT_FRAC_BITS 12
+/* The table is only used if at most COLOR_LUT_OUTLIERS of the checked
+ * colors deviate from the exact path by more than COLOR_LUT_TOLERANCE
+ * (in 16 bit levels), and no color deviates by more than
+ * COLOR_LUT_MAX_DEVIATION. The outliers are expected only for saturated
+ * colors that are clipped by the color matrix or the output profile. */
+#define COLOR_LUT_TOLERANCE 4
+#define COLOR_LUT_OUTLIERS 0.02
+#define COLOR_LUT_MAX_DEVIATION 0x40
+/* Check every COLOR_LUT_CHECK_STEP cell on each axis */
+#define COLOR_LUT_CHECK_STEP 2
+
+typedef struct {
+    /* The developer settings the table was built for */
+    unsigned max, exposure;
+    int restoreDetails, clipHighlights;
+    int colorMatrix[3][4];
+    unsigned useMatrix;
+    GrayscaleMode grayscaleMode;
+    double grayscaleMixer[3];
+    gboolean built, accurate;
+    unsigned node[COLOR_LUT_SIZE];
+    /* Grid position in COLOR_LUT_FRAC_BITS fixed point */
+    gint32 shaper[0x10001];
+    guint16 table[COLOR_LUT_SIZE * COLOR_LUT_SIZE * COLOR_LUT_SIZE][3];
+} color_lut;
+
+static void develop_balanced(gint64 tmppix[4], guint16 out[3],
+                             const developer_data *d);
+
+static gboolean color_lut_matches(const color_lut *lut,
+                                  const developer_data *d)
+{
+    return lut->max == d->max && lut->exposure == d->exposure &&
+           lut->restoreDetails == d->restoreDetails &&
+           lut->clipHighlights == d->clipHighlights &&
+           lut->useMatrix == d->useMatrix &&
+           (!d->useMatrix || memcmp(lut->colorMatrix, d->colorMatrix,
+                                    sizeof lut->colorMatrix) == 0) &&
+           lut->grayscaleMode == d->grayscaleMode &&
+           (d->grayscaleMode != grayscale_mixer ||
+            memcmp(lut->grayscaleMixer, d->grayscaleMixer,
+                   sizeof lut->grayscaleMixer) == 0);
+}
+
+static void color_lut_lookup(const color_lut *lut, const unsigned p[3],
+                             guint16 out[3])
+{
+    static const int stride[3] = {
+        COLOR_LUT_SIZE * COLOR_LUT_SIZE, COLOR_LUT_SIZE, 1
+    };
+    int c, n, tmp, f[3], step[3], idx = 0;
+    for (c = 0; c < 3; c++) {
+        int x = lut->shaper[p[c]];
+        n = MIN(x >> COLOR_LUT_FRAC_BITS, COLOR_LUT_SIZE - 2);
+        f[c] = x - (n << COLOR_LUT_FRAC_BITS);
+        step[c] = stride[c];
+        idx += n * stride[c];
+    }
+    /* Sort the axes by decreasing fraction to select the tetrahedron */
+#define COLOR_LUT_SWAP(a, b) \
+    if (f[a] < f[b]) { \
+        tmp = f[a]; f[a] = f[b]; f[b] = tmp; \
+        tmp = step[a]; step[a] = step[b]; step[b] = tmp; \
+    }
+    COLOR_LUT_SWAP(0, 1);
+    COLOR_LUT_SWAP(1, 2);
+    COLOR_LUT_SWAP(0, 1);
+#undef COLOR_LUT_SWAP
+    const guint16 *v0 = lut->table[idx];
+    const guint16 *v1 = lut->table[idx + step[0]];
+    const guint16 *v2 = lut->table[idx + step[0] + step[1]];
+    const guint16 *v3 = lut->table[idx + step[0] + step[1] + step[2]];
+    for (c = 0; c < 3; c++)
+        out[c] = ((v0[c] << COLOR_LUT_FRAC_BITS) +
+                  (v1[c] - v0[c]) * f[0] + (v2[c] - v1[c]) * f[1] +
+                  (v3[c] - v2[c]) * f[2] +
+                  (1 << (COLOR_LUT_FRAC_BITS - 1))) >> COLOR_LUT_FRAC_BITS;
+}
+
+/* Develop white balanced pixels through the exact path */
+static void color_lut_develop(const developer_data *d, const unsigned (*in)[3],
+                              guint16 (*out)[3], int count)
+{
+    gint64 tmppix[4];
+    int i, c;
+    for (i = 0; i < count; i++) {
+        for (c = 0; c < 3; c++)
+            tmppix[c] = in[i][c];
+        develop_balanced(tmppix, out[i], d);
+        for (c = 0; c < 3; c++)
+            out[i][c] = d->gammaCurve[out[i][c]];
+    }
+    if (d->colorTransform != NULL)
+        cmsDoTransform(d->colorTransform, out, out, count);
+}
+
+/* Build the table and return the fraction of checked colors that deviate
+ * from the exact path by more than COLOR_LUT_TOLERANCE. The largest
+ * deviation is returned in 'deviation'. */
+static double color_lut_build(color_lut *lut, const developer_data *d,
+                              int *deviation)
+{
+    const int n = COLOR_LUT_SIZE, m = (n - 1) / COLOR_LUT_CHECK_STEP;
+    const int checks = m * m * m;
+    int i, j, k, c, outliers = 0;
+    unsigned x, (*in)[3];
+    guint16 (*exact)[3], out[3];
+
+    lut->max = d->max;
+    lut->exposure = d->exposure;
+    lut->restoreDetails = d->restoreDetails;
+    lut->clipHighlights = d->clipHighlights;
+    lut->useMatrix = d->useMatrix;
+    memcpy(lut->colorMatrix, d->colorMatrix, sizeof lut->colorMatrix);
+    lut->grayscaleMode = d->grayscaleMode;
+    memcpy(lut->grayscaleMixer, d->grayscaleMixer, sizeof lut->grayscaleMixer);
+
+    for (k = 0; k < n; k++)
+        lut->node[k] = (double)d->max * k * k / ((n - 1) * (n - 1)) + 0.5;
+    for (k = 0; k < n - 1; k++)
+        for (x = lut->node[k]; x < lut->node[k + 1]; x++)
+            lut->shaper[x] = (k << COLOR_LUT_FRAC_BITS) +
+                             ((x - lut->node[k]) << COLOR_LUT_FRAC_BITS) /
+                             (lut->node[k + 1] - lut->node[k]);
+    lut->shaper[lut->node[n - 1]] = (n - 1) << COLOR_LUT_FRAC_BITS;
+
+    in = g_malloc(n * n * n * sizeof *in);
+    for (i = 0; i < n; i++)
+        for (j = 0; j < n; j++)
+            for (k = 0; k < n; k++) {
+                unsigned *v = in[(i * n + j) * n + k];
+                v[0] = lut->node[i];
+                v[1] = lut->node[j];
+                v[2] = lut->node[k];
+            }
+    color_lut_develop(d, (const unsigned (*)[3])in, lut->table, n * n * n);
+
+    /* Compare with the exact path in the middle of the cells,
+     * where the interpolation error is largest. */
+    for (i = 0; i < m; i++)
+        for (j = 0; j < m; j++)
+            for (k = 0; k < m; k++) {
+                unsigned *v = in[(i * m + j) * m + k];
+                const unsigned *node = lut->node;
+                const int s = COLOR_LUT_CHECK_STEP;
+                v[0] = (node[i * s] + node[i * s + 1]) / 2;
+                v[1] = (node[j * s] + node[j * s + 1]) / 2;
+                v[2] = (node[k * s] + node[k * s + 1]) / 2;
+            }
+    exact = g_malloc(checks * sizeof *exact);
+    color_lut_develop(d, (const unsigned (*)[3])in, exact, checks);
+    *deviation = 0;
+    for (i = 0; i < checks; i++) {
+        int dev = 0;
+        color_lut_lookup(lut, in[i], out);
+        for (c = 0; c < 3; c++)
+            dev = MAX(dev, abs(out[c] - exact[i][c]));
+        if (dev > COLOR_LUT_TOLERANCE)
+            outliers++;
+        *deviation = MAX(*deviation, dev);
+    }
+    g_free(exact);
+    g_free(in);
+    return (double)outliers / checks;
+}
+
+/* Force a rebuild after a change in the gamma curve or the profiles */
+static void color_lut_invalidate(developer_data *d)
+{
+    color_lut *lut = d->colorLut;
+    if (lut != NULL)
+        lut->built = FALSE;
+}
+
+/* Create, update or drop the color table of a file developer */
+static void developer_color_lut(developer_data *d, const conf_data *conf,
+                                DeveloperMode mode)
+{
+    color_lut *lut = d->colorLut;
+    unsigned c;
+    gboolean use = mode == file_developer && conf->colorLut &&
+                   d->colors == 3 && d->max >= COLOR_LUT_SIZE * COLOR_LUT_SIZE;
+    for (c = 0; c < d->colors; c++)
+        if (d->rgbWB[c] < 0)
+            use = FALSE;
+    if (!use) {
+        g_free(d->colorLut);
+        d->colorLut = NULL;
+        return;
+    }
+    if (lut == NULL)
+        d->colorLut = lut = g_new0(color_lut, 1);
+    else if (lut->built && color_lut_matches(lut, d))
+        return;
+    int deviation;
+    double outliers = color_lut_build(lut, d, &deviation);
+    lut->built = TRUE;
+    lut->accurate = outliers <= COLOR_LUT_OUTLIERS &&
+                    deviation <= COLOR_LUT_MAX_DEVIATION;
+    ufraw_message(UFRAW_SET_LOG, "Color table: %.2f%% of the colors deviate, "
+                  "at most by %d, %s\n", outliers * 100, deviation,
+                  lut->accurate ? "using it" : "using exact colors");
+}
+
+/* Develop pixels through the color table. Pixels that need highlight
+ * restoration take the exact path. */
+static void develop_color_lut(guint16 *pix, guint16 *buf, developer_data *d,
+                              int count)
+{
+    const color_lut *lut = d->colorLut;
+    unsigned c, p[3];
+    int i;
+    for (i = 0; i < count; i++) {
+        guint16 *in = pix + i * 4, *out = buf + i * 3;
+        gboolean clipped = FALSE;
+        for (c = 0; c < 3; c++) {
+            p[c] = (guint64)in[c] * d->rgbWB[c] / 0x10000;
+            if (p[c] > d->max) {
+                if (d->restoreDetails != clip_details)
+                    clipped = TRUE;
+                p[c] = d->max;
+            }
+        }
+        if (clipped) {
+            develop_linear(in, out, d);
+            for (c = 0; c < 3; c++)
+                out[c] = d->gammaCurve[out[c]];
+            if (d->colorTransform != NULL)
+                cmsDoTransform(d->colorTransform, out, out, 1);
+        } else {
+            color_lut_lookup(lut, p, out);
+        }
+    }
+}
+
 static void developer_create_transform(developer_data *d, DeveloperMode mode)
 {
     if (!d->updateTransform)
         return;
     d->updateTransform = FALSE;
+    color_lut_invalidate(d);
     /* Create transformations according to mode:
      * auto_developer|output_developer:
      *	    colorTransformation from in to out
@@ -418,8 +816,7 @@ static void developer_create_transform(developer_data *d, DeveloperMode mode)
     } else {
         targetProfile = out_profile;
     }
-    if (d->colorTransform != NULL)
-        cmsDeleteTransform(d->colorTransform);
+    developer_cache_release(d->colorTransform);
     if (strcmp(d->profileFile[in_profile], "") == 0 &&
             strcmp(d->profileFile[targetProfile], "") == 0 &&
             d->luminosityProfile == NULL &&
@@ -428,42 +825,72 @@ static void developer_create_transform(developer_data *d, DeveloperMode mode)
         /* No transformation at all. */
         d->colorTransform = NULL;
     } else {
-        cmsHPROFILE prof[5];
-        int i = 0;
-        prof[i++] = d->profile[in_profile];
-        if (d->luminosityProfile != NULL)
-            prof[i++] = d->luminosityProfile;
-        if (d->adjustmentProfile != NULL)
-            prof[i++] = d->adjustmentProfile;
-        if (d->saturationProfile != NULL)
-            prof[i++] = d->saturationProfile;
-        prof[i++] = d->profile[targetProfile];
-        d->colorTransform = cmsCreateMultiprofileTransform(prof, i,
-                            TYPE_RGB_16, TYPE_RGB_16, d->intent[out_profile], 0);
+        char *key = developer_cache_key("color\n%s\n%s\n%s\n%s\n%s\n%d",
+                                        d->profileKey[in_profile],
+                                        d->luminosityProfile != NULL ?
+                                        d->luminosityKey : "",
+                                        d->adjustmentProfile != NULL ?
+                                        d->adjustmentKey : "",
+                                        d->saturationProfile != NULL ?
+                                        d->saturationKey : "",
+                                        d->profileKey[targetProfile],
+                                        d->intent[out_profile]);
+        d->colorTransform = developer_cache_get(key);
+        if (d->colorTransform == NULL) {
+            cmsHPROFILE prof[5];
+            int i = 0;
+            prof[i++] = d->profile[in_profile];
+            if (d->luminosityProfile != NULL)
+                prof[i++] = d->luminosityProfile;
+            if (d->adjustmentProfile != NULL)
+                prof[i++] = d->adjustmentProfile;
+            if (d->saturationProfile != NULL)
+                prof[i++] = d->saturationProfile;
+            prof[i++] = d->profile[targetProfile];
+            cmsHTRANSFORM transform = cmsCreateMultiprofileTransform(prof, i,
+                                      TYPE_RGB_16, TYPE_RGB_16, d->intent[out_profile], 0);
+            d->colorTransform = developer_cache_add(key, transform, TRUE);
+        }
+        g_free(key);
     }
 
-    if (d->working2displayTransform != NULL)
-        cmsDeleteTransform(d->working2displayTransform);
+    developer_cache_release(d->working2displayTransform);
     if (mode == display_developer
             && d->intent[display_profile] != disable_intent
             && strcmp(d->profileFile[out_profile],
                       d->profileFile[display_profile]) != 0) {
-        // TODO: We should use TYPE_RGB_'bit_depth' for working profile.
-        d->working2displayTransform = cmsCreateTransform(
+        char *key = developer_cache_key("display\n%s\n%s\n%d",
+                                        d->profileKey[out_profile],
+                                        d->profileKey[display_profile],
+                                        d->intent[display_profile]);
+        d->working2displayTransform = developer_cache_get(key);
+        if (d->working2displayTransform == NULL) {
+            // TODO: We should use TYPE_RGB_'bit_depth' for working profile.
+            cmsHTRANSFORM transform = cmsCreateTransform(
                                           d->profile[out_profile], TYPE_RGB_8,
                                           d->profile[display_profile], TYPE_RGB_8,
                                           d->intent[display_profile], 0);
+            d->working2displayTransform =
+                developer_cache_add(key, transform, TRUE);
+        }
+        g_free(key);
     } else {
         d->working2displayTransform = NULL;
     }
 
+    /* The input profile may have changed */
+    developer_cache_release(d->rgbtolabTransform);
+    char *key = developer_cache_key("lab\n%s", d->profileKey[in_profile]);
+    d->rgbtolabTransform = developer_cache_get(key);
     if (d->rgbtolabTransform == NULL) {
         cmsHPROFILE labProfile = cmsCreateLab2Profile(cmsD50_xyY());
-        d->rgbtolabTransform = cmsCreateTransform(d->profile[in_profile],
-                               TYPE_RGB_16, labProfile,
-                               TYPE_Lab_16, INTENT_ABSOLUTE_COLORIMETRIC, 0);
+        cmsHTRANSFORM transform = cmsCreateTransform(d->profile[in_profile],
+                                  TYPE_RGB_16, labProfile,
+                                  TYPE_Lab_16, INTENT_ABSOLUTE_COLORIMETRIC, 0);
         cmsCloseProfile(labProfile);
+        d->rgbtolabTransform = developer_cache_add(key, transform, TRUE);
     }
+    g_free(key);
 }
 
 static gboolean test_adjustments(const lightness_adjustment values[max_adjustments],
@@ -560,6 +987,7 @@ void developer_prepare(developer_data *d, conf_data *conf,
             exposure != d->exposure || clipHighlights != d->clipHighlights ||
             memcmp(baseCurve, &d->baseCurveData, sizeof(CurveData)) != 0) {
         d->baseCurveData = *baseCurve;
+        color_lut_invalidate(d);
         guint16 BaseCurve[0x10000];
         CurveSample *cs = CurveSampleInit(0x10000, 0x10000);
         ufraw_message(UFRAW_RESET, NULL);
@@ -627,11 +1055,17 @@ void developer_prepare(developer_data *d, conf_data *conf,
     /* Check if curve data has changed. */
     if (memcmp(curve, &d->luminosityCurveData, sizeof(CurveData))) {
         d->luminosityCurveData = *curve;
+        developer_cache_release(d->luminosityProfile);
+        d->luminosityProfile = NULL;
         /* Trivial curve does not require a profile */
-        if (CurveDataIsTrivial(curve)) {
-            d->luminosityProfile = NULL;
-        } else {
-            cmsCloseProfile(d->luminosityProfile);
+        if (!CurveDataIsTrivial(curve)) {
+            char *key = developer_data_key("luminosity", curve,
+                                           sizeof(CurveData));
+            g_strlcpy(d->luminosityKey, key, max_name);
+            g_free(key);
+            d->luminosityProfile = developer_cache_get(d->luminosityKey);
+        }
+        if (!CurveDataIsTrivial(curve) && d->luminosityProfile == NULL) {
             CurveSample *cs = CurveSampleInit(0x100, 0x10000);
             ufraw_message(UFRAW_RESET, NULL);
             if (CurveDataSample(curve, cs) != UFRAW_SUCCESS) {
@@ -646,9 +1080,12 @@ void developer_prepare(developer_data *d, conf_data *conf,
                     values[i] = (cmsFloat32Number) cs->m_Samples[i] / 0x10000;
                 TransferFunction[0] =
                     cmsBuildTabulatedToneCurveFloat(NULL, 0x100, values);
-                d->luminosityProfile = cmsCreateLinearizationDeviceLink(
-                                           cmsSigLabData, TransferFunction);
-                cmsSetDeviceClass(d->luminosityProfile, cmsSigAbstractClass);
+                cmsHPROFILE profile = cmsCreateLinearizationDeviceLink(
+                                          cmsSigLabData, TransferFunction);
+                if (profile != NULL)
+                    cmsSetDeviceClass(profile, cmsSigAbstractClass);
+                d->luminosityProfile = developer_cache_add(d->luminosityKey,
+                                       profile, FALSE);
             }
             CurveSampleFree(cs);
         }
@@ -660,10 +1097,19 @@ void developer_prepare(developer_data *d, conf_data *conf,
         d->updateTransform = TRUE;
         memcpy(d->lightnessAdjustment, conf->lightnessAdjustment,
                sizeof d->lightnessAdjustment);
-        cmsCloseProfile(d->adjustmentProfile);
-        d->adjustmentProfile = test_adjustments(d->lightnessAdjustment, 1.0, 0.01)
-                               ? create_adjustment_profile(d)
-                               : NULL;
+        developer_cache_release(d->adjustmentProfile);
+        d->adjustmentProfile = NULL;
+        if (test_adjustments(d->lightnessAdjustment, 1.0, 0.01)) {
+            char *key = developer_data_key("adjustment",
+                                           d->lightnessAdjustment,
+                                           sizeof d->lightnessAdjustment);
+            g_strlcpy(d->adjustmentKey, key, max_name);
+            g_free(key);
+            d->adjustmentProfile = developer_cache_get(d->adjustmentKey);
+            if (d->adjustmentProfile == NULL)
+                d->adjustmentProfile = developer_cache_add(d->adjustmentKey,
+                                       create_adjustment_profile(d), FALSE);
+        }
     }
 
     if (conf->saturation != d->saturation
@@ -676,24 +1122,28 @@ void developer_prepare(developer_data *d, conf_data *conf,
 #endif
         d->saturation = (conf->grayscaleMode == grayscale_luminance)
                         ? 0 : conf->saturation;
-        cmsCloseProfile(d->saturationProfile);
-        if (d->saturation == 1.0
 #ifdef UFRAW_CONTRAST
-                && d->contrast == 1.0
-#endif
-           )
-            d->saturationProfile = NULL;
-        else
-            d->saturationProfile = create_contrast_saturation_profile(
-#ifdef UFRAW_CONTRAST
-                                       d->contrast,
+        double contrast = d->contrast;
 #else
-                                       1.0,
+        double contrast = 1.0;
 #endif
-                                       d->saturation);
+        developer_cache_release(d->saturationProfile);
+        d->saturationProfile = NULL;
+        if (d->saturation != 1.0 || contrast != 1.0) {
+            char *key = developer_cache_key("saturation\n%.17g\n%.17g",
+                                            contrast, d->saturation);
+            g_strlcpy(d->saturationKey, key, max_name);
+            g_free(key);
+            d->saturationProfile = developer_cache_get(d->saturationKey);
+            if (d->saturationProfile == NULL)
+                d->saturationProfile = developer_cache_add(d->saturationKey,
+                                       create_contrast_saturation_profile(
+                                           contrast, d->saturation), FALSE);
+        }
         d->updateTransform = TRUE;
     }
     developer_create_transform(d, mode);
+    developer_color_lut(d, conf, mode);
 }
 
 static void apply_matrix(const developer_data *d,
@@ -851,9 +1301,223 @@ static void MaxMidMin(const gint64 p[3], int *maxc, int *midc, int *minc)
     *minc = min;
 }
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define UFRAW_DEVELOP_SIMD
+#include <immintrin.h>
+
+/* Vectorized develop_linear() for pixels that need neither highlight
+ * restoration nor luminance compression. All values are integers below
+ * 2^53, so the double arithmetic gives the same results as the gint64
+ * code. Divisions are replaced by a multiplication and a correction of
+ * the rounded quotient. Pixels that the scalar code has to handle are
+ * flagged in slow[]. */
+#define DEVELOP_SIMD_BLOCK 64
+
+typedef struct {
+    double wb[4], matrix[3][4], num, max, inv, clip;
+} develop_simd_data;
+
+typedef void (*develop_simd_func)(const guint16 *in, guint16 *out,
+                                  guint8 *slow, const develop_simd_data *s, int count);
+
+__attribute__((target("avx2")))
+static void develop_linear_avx2(const guint16 *in, guint16 *out,
+                                guint8 *slow, const develop_simd_data *s, int count)
+{
+    const __m256d zero = _mm256_setzero_pd(), one = _mm256_set1_pd(1);
+    const __m256d top = _mm256_set1_pd(0xFFFF), norm = _mm256_set1_pd(1.0 / 0x10000);
+    const __m256d num = _mm256_set1_pd(s->num), max = _mm256_set1_pd(s->max);
+    const __m256d inv = _mm256_set1_pd(s->inv), clip = _mm256_set1_pd(s->clip);
+    int i, k, c, cc, mask;
+
+    for (i = 0; i + 4 <= count; i += 4) {
+        __m256d v[4], t[3], a, b, e, f, flag = zero;
+        gint32 o[3][4];
+        for (k = 0; k < 4; k++)
+            v[k] = _mm256_cvtepi32_pd(_mm_cvtepu16_epi32(
+                                          _mm_loadl_epi64((const __m128i *)(in + (i + k) * 4))));
+        /* Transpose from pixels to channels */
+        a = _mm256_unpacklo_pd(v[0], v[1]);
+        b = _mm256_unpackhi_pd(v[0], v[1]);
+        e = _mm256_unpacklo_pd(v[2], v[3]);
+        f = _mm256_unpackhi_pd(v[2], v[3]);
+        v[0] = _mm256_permute2f128_pd(a, e, 0x20);
+        v[1] = _mm256_permute2f128_pd(b, f, 0x20);
+        v[2] = _mm256_permute2f128_pd(a, e, 0x31);
+        v[3] = _mm256_permute2f128_pd(b, f, 0x31);
+        for (c = 0; c < 4; c++) {
+            __m256d p = _mm256_floor_pd(_mm256_mul_pd(v[c], _mm256_set1_pd(s->wb[c])));
+            __m256d n, q, r;
+            flag = _mm256_or_pd(flag, _mm256_cmp_pd(p, clip, _CMP_GT_OQ));
+            n = _mm256_mul_pd(_mm256_min_pd(p, max), num);
+            q = _mm256_floor_pd(_mm256_mul_pd(n, inv));
+            r = _mm256_sub_pd(n, _mm256_mul_pd(q, max));
+            q = _mm256_sub_pd(q, _mm256_and_pd(_mm256_cmp_pd(r, zero, _CMP_LT_OQ), one));
+            v[c] = _mm256_add_pd(q, _mm256_and_pd(_mm256_cmp_pd(r, max, _CMP_GE_OQ), one));
+        }
+        for (cc = 0; cc < 3; cc++) {
+            a = _mm256_mul_pd(v[0], _mm256_set1_pd(s->matrix[cc][0]));
+            for (c = 1; c < 4; c++)
+                a = _mm256_add_pd(a, _mm256_mul_pd(v[c], _mm256_set1_pd(s->matrix[cc][c])));
+            t[cc] = _mm256_max_pd(_mm256_floor_pd(_mm256_mul_pd(a, norm)), zero);
+            flag = _mm256_or_pd(flag, _mm256_cmp_pd(t[cc], top, _CMP_GT_OQ));
+            _mm_storeu_si128((__m128i *)o[cc],
+                             _mm256_cvttpd_epi32(_mm256_min_pd(t[cc], top)));
+        }
+        mask = _mm256_movemask_pd(flag);
+        for (k = 0; k < 4; k++) {
+            for (cc = 0; cc < 3; cc++)
+                out[(i + k) * 3 + cc] = o[cc][k];
+            slow[i + k] = (mask >> k) & 1;
+        }
+    }
+    for (; i < count; i++)
+        slow[i] = 1;
+}
+
+__attribute__((target("sse4.1")))
+static void develop_linear_sse4(const guint16 *in, guint16 *out,
+                                guint8 *slow, const develop_simd_data *s, int count)
+{
+    const __m128d zero = _mm_setzero_pd(), one = _mm_set1_pd(1);
+    const __m128d top = _mm_set1_pd(0xFFFF), norm = _mm_set1_pd(1.0 / 0x10000);
+    const __m128d num = _mm_set1_pd(s->num), max = _mm_set1_pd(s->max);
+    const __m128d inv = _mm_set1_pd(s->inv), clip = _mm_set1_pd(s->clip);
+    int i, k, c, cc, mask;
+
+    for (i = 0; i + 2 <= count; i += 2) {
+        __m128d v[4], t[3], a, b, e, f, flag = zero;
+        gint32 o[3][4];
+        __m128i x = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)(in + i * 4)));
+        __m128i y = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)(in + i * 4 + 4)));
+        /* Transpose from pixels to channels */
+        a = _mm_cvtepi32_pd(x);
+        b = _mm_cvtepi32_pd(_mm_unpackhi_epi64(x, x));
+        e = _mm_cvtepi32_pd(y);
+        f = _mm_cvtepi32_pd(_mm_unpackhi_epi64(y, y));
+        v[0] = _mm_unpacklo_pd(a, e);
+        v[1] = _mm_unpackhi_pd(a, e);
+        v[2] = _mm_unpacklo_pd(b, f);
+        v[3] = _mm_unpackhi_pd(b, f);
+        for (c = 0; c < 4; c++) {
+            __m128d p = _mm_floor_pd(_mm_mul_pd(v[c], _mm_set1_pd(s->wb[c])));
+            __m128d n, q, r;
+            flag = _mm_or_pd(flag, _mm_cmpgt_pd(p, clip));
+            n = _mm_mul_pd(_mm_min_pd(p, max), num);
+            q = _mm_floor_pd(_mm_mul_pd(n, inv));
+            r = _mm_sub_pd(n, _mm_mul_pd(q, max));
+            q = _mm_sub_pd(q, _mm_and_pd(_mm_cmplt_pd(r, zero), one));
+            v[c] = _mm_add_pd(q, _mm_and_pd(_mm_cmpge_pd(r, max), one));
+        }
+        for (cc = 0; cc < 3; cc++) {
+            a = _mm_mul_pd(v[0], _mm_set1_pd(s->matrix[cc][0]));
+            for (c = 1; c < 4; c++)
+                a = _mm_add_pd(a, _mm_mul_pd(v[c], _mm_set1_pd(s->matrix[cc][c])));
+            t[cc] = _mm_max_pd(_mm_floor_pd(_mm_mul_pd(a, norm)), zero);
+            flag = _mm_or_pd(flag, _mm_cmpgt_pd(t[cc], top));
+            _mm_storeu_si128((__m128i *)o[cc], _mm_cvttpd_epi32(_mm_min_pd(t[cc], top)));
+        }
+        mask = _mm_movemask_pd(flag);
+        for (k = 0; k < 2; k++) {
+            for (cc = 0; cc < 3; cc++)
+                out[(i + k) * 3 + cc] = o[cc][k];
+            slow[i + k] = (mask >> k) & 1;
+        }
+    }
+    for (; i < count; i++)
+        slow[i] = 1;
+}
+
+/* Return the kernel for this CPU, or NULL if the pixels must go through
+ * develop_linear() one by one. */
+static develop_simd_func develop_simd_prepare(const developer_data *d,
+                                              develop_simd_data *s)
+{
+    develop_simd_func func;
+    unsigned c, cc;
+
+    if (__builtin_cpu_supports("avx2"))
+        func = develop_linear_avx2;
+    else if (__builtin_cpu_supports("sse4.1"))
+        func = develop_linear_sse4;
+    else
+        return NULL;
+    if (d->colors < 3 || d->max == 0)
+        return NULL;
+    for (c = 0; c < 4; c++) {
+        if (c < d->colors && d->rgbWB[c] < 0)
+            return NULL;
+        s->wb[c] = c < d->colors ? d->rgbWB[c] / 65536.0 : 0;
+        for (cc = 0; cc < 3; cc++) {
+            if (d->useMatrix)
+                s->matrix[cc][c] = c < d->colors ? d->colorMatrix[cc][c] : 0;
+            else
+                s->matrix[cc][c] = cc == c ? 0x10000 : 0;
+        }
+    }
+    s->num = d->clipHighlights == film_highlights ? 0x10000 : d->exposure;
+    s->max = d->max;
+    s->inv = 1.0 / d->max;
+    /* Pixels above max need highlight restoration */
+    s->clip = d->restoreDetails != clip_details ? d->max : HUGE_VAL;
+    return func;
+}
+#endif /* UFRAW_DEVELOP_SIMD */
+
+static void develop_grayscale(guint16 *pixel, const developer_data *d);
+
+/* Develop count pixels to gamma corrected 16-bit RGB in buf. */
+static void develop_gamma(guint16 *pix, guint16 *buf, developer_data *d,
+                          int count)
+{
+    guint16 c, tmppix[3];
+    int i;
+#ifdef UFRAW_DEVELOP_SIMD
+    develop_simd_data s;
+    develop_simd_func simd = develop_simd_prepare(d, &s);
+    if (simd != NULL) {
+        guint8 slow[DEVELOP_SIMD_BLOCK];
+        int j, n;
+        for (i = 0; i < count; i += n) {
+            n = MIN(count - i, DEVELOP_SIMD_BLOCK);
+            (*simd)(pix + i * 4, buf + i * 3, slow, &s, n);
+            for (j = 0; j < n; j++) {
+                guint16 *out = buf + (i + j) * 3;
+                if (slow[j])
+                    develop_linear(pix + (i + j) * 4, out, d);
+                else
+                    develop_grayscale(out, d);
+                for (c = 0; c < 3; c++)
+                    out[c] = d->gammaCurve[out[c]];
+            }
+        }
+        return;
+    }
+#endif
+    for (i = 0; i < count; i++) {
+        develop_linear(pix + i * 4, tmppix, d);
+        for (c = 0; c < 3; c++)
+            buf[i * 3 + c] = d->gammaCurve[tmppix[c]];
+    }
+}
+
+/* Develop count pixels to 16-bit RGB in the target color space */
+static void develop_rgb(guint16 *pix, guint16 *buf, developer_data *d,
+                        int count)
+{
+    const color_lut *lut = d->colorLut;
+    if (lut != NULL && lut->accurate) {
+        develop_color_lut(pix, buf, d, count);
+        return;
+    }
+    develop_gamma(pix, buf, d, count);
+    if (d->colorTransform != NULL)
+        cmsDoTransform(d->colorTransform, buf, buf, count);
+}
+
 void develop(void *po, guint16 pix[4], developer_data *d, int mode, int count)
 {
-    guint16 c, tmppix[3], *buf;
+    guint16 *buf;
     int i;
     if (mode == 16) buf = po;
     else buf = g_alloca(count * 6);
@@ -862,29 +1526,16 @@ void develop(void *po, guint16 pix[4], developer_data *d, int mode, int count)
     #pragma omp parallel				\
     if (count > 16)				\
         default(none)				\
-        shared(d, buf, count, pix)			\
-        private(i, tmppix, c)
+        shared(d, buf, count, pix)
     {
         int chunk = count / omp_get_num_threads() + 1;
         int offset = chunk * omp_get_thread_num();
         int width = (chunk > count - offset) ? count - offset : chunk;
-        for (i = offset; i < offset + width; i++) {
-            develop_linear(pix + i * 4, tmppix, d);
-            for (c = 0; c < 3; c++)
-                buf[i * 3 + c] = d->gammaCurve[tmppix[c]];
-        }
-        if (d->colorTransform != NULL)
-            cmsDoTransform(d->colorTransform,
-                           buf + offset * 3, buf + offset * 3, width);
+        if (width > 0)
+            develop_rgb(pix + offset * 4, buf + offset * 3, d, width);
     }
 #else
-    for (i = 0; i < count; i++) {
-        develop_linear(pix + i * 4, tmppix, d);
-        for (c = 0; c < 3; c++)
-            buf[i * 3 + c] = d->gammaCurve[tmppix[c]];
-    }
-    if (d->colorTransform != NULL)
-        cmsDoTransform(d->colorTransform, buf, buf, count);
+    develop_rgb(pix, buf, d, count);
 #endif
 
     if (mode != 16) {
@@ -943,12 +1594,22 @@ void develop_linear(guint16 in[4], guint16 out[3], developer_data *d)
 {
     unsigned c;
     gint64 tmppix[4];
-    gboolean clipped = FALSE;
     for (c = 0; c < d->colors; c++) {
         /* Set WB, normalizing tmppix[c]<0x10000 */
         tmppix[c] = in[c];
         tmppix[c] *= d->rgbWB[c];
         tmppix[c] /= 0x10000;
+    }
+    develop_balanced(tmppix, out, d);
+}
+
+/* The part of develop_linear() that follows the white balance */
+static void develop_balanced(gint64 tmppix[4], guint16 out[3],
+                             const developer_data *d)
+{
+    unsigned c;
+    gboolean clipped = FALSE;
+    for (c = 0; c < d->colors; c++) {
         if (d->restoreDetails != clip_details &&
                 tmppix[c] > d->max) {
             clipped = TRUE;
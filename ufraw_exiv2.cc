@@ -20,6 +20,10 @@
 #include <exiv2/exif.hpp>
 #include <sstream>
 #include <cassert>
+#include <vector>
+#ifdef HAVE_LIBTIFF
+#include <tiffio.h>
+#endif
 
 /*
  * Helper function to copy a string to a buffer, converting it from
@@ -50,11 +54,18 @@ extern "C" int ufraw_exif_read_input(ufraw_data *uf)
     try {
         uf->inputExifBuf = NULL;
         uf->inputExifBufLen = 0;
+        uf->exifPending = FALSE;
 
+        /* Parse the memory that dcraw reads from, if it is still there */
         Exiv2::Image::AutoPtr image;
         if (uf->unzippedBuf != NULL) {
             image = Exiv2::ImageFactory::open(
                         (const Exiv2::byte*)uf->unzippedBuf, uf->unzippedBufLen);
+        } else if (uf->inputMap != NULL) {
+            GMappedFile *map = (GMappedFile *)uf->inputMap;
+            image = Exiv2::ImageFactory::open(
+                        (const Exiv2::byte*)g_mapped_file_get_contents(map),
+                        g_mapped_file_get_length(map));
         } else {
             char *filename = uf_win32_locale_filename_from_utf8(uf->filename);
             image = Exiv2::ImageFactory::open(filename);
@@ -145,6 +156,9 @@ static Exiv2::ExifData ufraw_prepare_exifdata(ufraw_data *uf)
 {
     Exiv2::ExifData exifData = Exiv2::ExifData();
 
+    /* The EXIF data is saved after all */
+    if (uf->exifPending)
+        ufraw_exif_read_input(uf);
     /* Start from the input EXIF data */
     Exiv2::ExifParser::decode(exifData, uf->inputExifBuf, uf->inputExifBufLen);
     Exiv2::ExifData::iterator pos;
@@ -372,6 +386,426 @@ extern "C" int ufraw_exif_write(ufraw_data *uf)
     }
 }
 
+#if defined(HAVE_LIBTIFF) && TIFFLIB_VERSION >= 20111221
+
+/* Where ufraw_exif_write_tiff() puts an EXIF datum */
+typedef enum {
+    ufraw_tiff_skip, ufraw_tiff_image, ufraw_tiff_exif, ufraw_tiff_gps,
+    ufraw_tiff_iop, ufraw_tiff_unsupported
+} ufraw_tiff_ifd;
+
+/* Find the field of the datum's tag in the current directory. Tags that
+ * libtiff does not know are added as custom fields of the datum's type,
+ * the way libtiff adds the unknown tags that it reads. They are added
+ * again whenever libtiff resets the fields of a new directory. */
+static const TIFFField *ufraw_tiff_field(TIFF *tiff,
+        const Exiv2::Exifdatum &datum)
+{
+    const TIFFField *field = TIFFFindField(tiff, datum.tag(), TIFF_ANY);
+    if (field != NULL)
+        return field;
+    // The EXIF and TIFF type numbers are the same
+    int type = datum.typeId();
+    if (type < TIFF_BYTE || type > TIFF_SRATIONAL)
+        return NULL;
+    // libtiff frees custom fields whose name starts with "Tag "
+    static char name[] = "UFRawExifTag";
+    TIFFFieldInfo info = {
+        datum.tag(), TIFF_VARIABLE2, TIFF_VARIABLE2, (TIFFDataType)type,
+        FIELD_CUSTOM, 1, 1, name
+    };
+    if (type == TIFF_ASCII) {
+        info.field_readcount = info.field_writecount = TIFF_VARIABLE;
+        info.field_passcount = 0;
+    }
+    if (TIFFMergeFieldInfo(tiff, &info, 1) != 0)
+        return NULL;
+    return TIFFFindField(tiff, datum.tag(), TIFF_ANY);
+}
+
+/* Whether ufraw_tiff_set_datum() can set the datum as the field */
+static bool ufraw_tiff_settable(const TIFFField *field,
+                                const Exiv2::Exifdatum &datum)
+{
+    if (field == NULL)
+        return false;
+    long count = datum.count();
+    int fixedCount = TIFFFieldWriteCount(field);
+    Exiv2::TypeId type = datum.typeId();
+    if (count <= 0)
+        return false;
+    if (TIFFFieldDataType(field) == TIFF_ASCII)
+        return type == Exiv2::asciiString;
+    if (!TIFFFieldPassCount(field) &&
+            count != (fixedCount > 0 ? fixedCount : 1))
+        return false;
+    switch (TIFFFieldDataType(field)) {
+    case TIFF_BYTE:
+    case TIFF_SBYTE:
+    case TIFF_UNDEFINED:
+        return type == Exiv2::unsignedByte || type == Exiv2::signedByte ||
+               type == Exiv2::undefined;
+    case TIFF_SHORT:
+    case TIFF_SSHORT:
+    case TIFF_LONG:
+    case TIFF_SLONG:
+        return type == Exiv2::unsignedShort || type == Exiv2::signedShort ||
+               type == Exiv2::unsignedLong || type == Exiv2::signedLong;
+    case TIFF_RATIONAL:
+    case TIFF_SRATIONAL:
+        return type == Exiv2::unsignedRational ||
+               type == Exiv2::signedRational;
+    default:
+        return false;
+    }
+}
+
+/* Pass an array to TIFFSetField() the way the field expects it */
+static void ufraw_tiff_set_array(TIFF *tiff, const TIFFField *field,
+                                 uint32_t count, const void *data)
+{
+    uint32_t tag = TIFFFieldTag(field);
+    if (!TIFFFieldPassCount(field))
+        TIFFSetField(tiff, tag, data);
+    else if (TIFFFieldWriteCount(field) == TIFF_VARIABLE2)
+        TIFFSetField(tiff, tag, count, data);
+    else
+        TIFFSetField(tiff, tag, (int)count, data);
+}
+
+/* Set a tag of the current TIFF directory from an EXIF datum,
+ * which ufraw_tiff_settable() accepted. */
+static void ufraw_tiff_set_datum(TIFF *tiff, const Exiv2::Exifdatum &datum)
+{
+    const TIFFField *field = ufraw_tiff_field(tiff, datum);
+    if (field == NULL)
+        return;
+    uint32_t tag = datum.tag();
+    long count = datum.count();
+    long i;
+    switch (TIFFFieldDataType(field)) {
+    case TIFF_ASCII:
+        TIFFSetField(tiff, tag, datum.toString().c_str());
+        break;
+    case TIFF_BYTE:
+    case TIFF_SBYTE:
+    case TIFF_UNDEFINED: {
+        std::vector<unsigned char> buf(datum.size());
+        datum.copy(&buf[0], Exiv2::bigEndian);
+        ufraw_tiff_set_array(tiff, field, buf.size(), &buf[0]);
+        break;
+    }
+    case TIFF_SHORT:
+    case TIFF_SSHORT:
+        if (count == 1 && !TIFFFieldPassCount(field)) {
+            TIFFSetField(tiff, tag, (int)datum.toLong());
+        } else {
+            std::vector<uint16_t> buf(count);
+            for (i = 0; i < count; i++)
+                buf[i] = datum.toLong(i);
+            ufraw_tiff_set_array(tiff, field, count, &buf[0]);
+        }
+        break;
+    case TIFF_LONG:
+    case TIFF_SLONG:
+        if (count == 1 && !TIFFFieldPassCount(field)) {
+            TIFFSetField(tiff, tag, (uint32_t)datum.toLong());
+        } else {
+            std::vector<uint32_t> buf(count);
+            for (i = 0; i < count; i++)
+                buf[i] = datum.toLong(i);
+            ufraw_tiff_set_array(tiff, field, count, &buf[0]);
+        }
+        break;
+    case TIFF_RATIONAL:
+    case TIFF_SRATIONAL:
+        if (count == 1 && !TIFFFieldPassCount(field)) {
+            TIFFSetField(tiff, tag, (double)datum.toFloat());
+            break;
+        }
+#if TIFFLIB_VERSION >= 20201219
+        // Since libtiff 4.2 some rational arrays are passed as doubles
+        if (TIFFFieldSetGetSize(field) == 8) {
+            std::vector<double> buf(count);
+            for (i = 0; i < count; i++)
+                buf[i] = datum.toFloat(i);
+            ufraw_tiff_set_array(tiff, field, count, &buf[0]);
+            break;
+        }
+#endif
+        {
+            std::vector<float> buf(count);
+            for (i = 0; i < count; i++)
+                buf[i] = datum.toFloat(i);
+            ufraw_tiff_set_array(tiff, field, count, &buf[0]);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* libtiff only knows the tags of a custom directory while it is the
+ * current directory of a file. The EXIF, GPS and interoperability tags
+ * are therefore looked up in scratch files that are never written. */
+static tmsize_t ufraw_tiff_null_rw(thandle_t, void *, tmsize_t size)
+{
+    return size;
+}
+
+static toff_t ufraw_tiff_null_seek(thandle_t, toff_t, int)
+{
+    return 0;
+}
+
+static int ufraw_tiff_null_close(thandle_t)
+{
+    return 0;
+}
+
+static toff_t ufraw_tiff_null_size(thandle_t)
+{
+    return 0;
+}
+
+static int ufraw_tiff_null_map(thandle_t, void **, toff_t *)
+{
+    return 0;
+}
+
+static void ufraw_tiff_null_unmap(thandle_t, void *, toff_t)
+{
+}
+
+/* Pointers to the directories written below, and tags that describe the
+ * raw file's image data. Like exiv2, keep the ones of the output file. */
+static bool ufraw_tiff_image_tag(uint16_t tag)
+{
+    static const uint16_t imageTags[] = {
+        TIFFTAG_EXIFIFD, TIFFTAG_GPSIFD, TIFFTAG_SUBIFD,
+        TIFFTAG_SUBFILETYPE, TIFFTAG_OSUBFILETYPE, TIFFTAG_PREDICTOR,
+        TIFFTAG_TILEWIDTH, TIFFTAG_TILELENGTH, TIFFTAG_TILEOFFSETS,
+        TIFFTAG_TILEBYTECOUNTS, TIFFTAG_EXTRASAMPLES, TIFFTAG_SAMPLEFORMAT,
+        TIFFTAG_JPEGIFOFFSET, TIFFTAG_JPEGIFBYTECOUNT, TIFFTAG_ICCPROFILE
+    };
+    for (unsigned i = 0; i < sizeof(imageTags) / sizeof(imageTags[0]); i++)
+        if (tag == imageTags[i])
+            return true;
+    return false;
+}
+
+static TIFF *ufraw_tiff_scratch_open(const char *name)
+{
+    return TIFFClientOpen(name, "w", NULL,
+                          ufraw_tiff_null_rw, ufraw_tiff_null_rw,
+                          ufraw_tiff_null_seek, ufraw_tiff_null_close,
+                          ufraw_tiff_null_size, ufraw_tiff_null_map,
+                          ufraw_tiff_null_unmap);
+}
+
+/* The groups of the raw file's other images: its thumbnail, previews and
+ * the raw data itself. They do not describe the converted image. */
+static bool ufraw_tiff_raw_image_group(const std::string &group)
+{
+    return group == "Thumbnail" ||
+           group.compare(0, 8, "SubImage") == 0 ||
+           group.compare(0, 8, "SubThumb") == 0 ||
+           (group.size() > 5 && group.compare(0, 5, "Image") == 0 &&
+            g_ascii_isdigit(group[5]));
+}
+
+/* Decide where each datum goes. The maker note is dropped, as for JPEG
+ * files that it does not fit in, since its offsets point into the raw
+ * file and only exiv2 can move it. Returns FALSE if some of the data can
+ * only be written by exiv2. */
+static bool ufraw_tiff_classify(TIFF *tiff, const Exiv2::ExifData &exifData,
+                                std::vector<ufraw_tiff_ifd> &ifd)
+{
+    TIFF *exif = ufraw_tiff_scratch_open("EXIF");
+    TIFF *iop = ufraw_tiff_scratch_open("Iop");
+    if (exif == NULL || iop == NULL) {
+        if (exif != NULL)
+            TIFFCleanup(exif);
+        if (iop != NULL)
+            TIFFCleanup(iop);
+        return false;
+    }
+    // The interoperability tags do not clash with the EXIF tags
+    TIFFCreateEXIFDirectory(exif);
+    TIFFCreateEXIFDirectory(iop);
+#if TIFFLIB_VERSION >= 20191103
+    TIFF *gps = ufraw_tiff_scratch_open("GPS");
+    if (gps != NULL)
+        TIFFCreateGPSDirectory(gps);
+#endif
+    bool supported = true;
+    bool makerNote = false;
+    std::string dropped;
+    Exiv2::ExifData::const_iterator pos;
+    for (pos = exifData.begin(); pos != exifData.end(); pos++) {
+        ufraw_tiff_ifd where = ufraw_tiff_unsupported;
+        std::string group = pos->groupName();
+        uint16_t tag = pos->tag();
+        if (pos->key() == "Exif.Photo.MakerNote" ||
+                !strcmp(pos->ifdName(), "Makernote")) {
+            if (!makerNote)
+                ufraw_message(UFRAW_SET_LOG, "Erasing Exif.Photo.MakerNote "
+                              "and related decoded metadata from TIFF\n");
+            makerNote = true;
+            where = ufraw_tiff_skip;
+        } else if (ufraw_tiff_raw_image_group(group)) {
+            if (group != dropped)
+                ufraw_message(UFRAW_SET_LOG,
+                              "Erasing Exif.%s from TIFF\n", group.c_str());
+            dropped = group;
+            where = ufraw_tiff_skip;
+        } else if (group == "Image") {
+            if (ufraw_tiff_image_tag(tag))
+                where = ufraw_tiff_skip;
+            else if (ufraw_tiff_settable(ufraw_tiff_field(tiff, *pos), *pos))
+                where = ufraw_tiff_image;
+        } else if (group == "Photo") {
+            // The pointer to the interoperability directory is set below
+            if (pos->key() == "Exif.Photo.InteroperabilityTag")
+                where = ufraw_tiff_skip;
+            else if (ufraw_tiff_settable(ufraw_tiff_field(exif, *pos), *pos))
+                where = ufraw_tiff_exif;
+        } else if (group == "Iop") {
+            if (ufraw_tiff_settable(ufraw_tiff_field(iop, *pos), *pos))
+                where = ufraw_tiff_iop;
+#if TIFFLIB_VERSION >= 20191103
+        } else if (group == "GPSInfo") {
+            if (gps != NULL &&
+                    ufraw_tiff_settable(ufraw_tiff_field(gps, *pos), *pos))
+                where = ufraw_tiff_gps;
+#endif
+        }
+        if (where == ufraw_tiff_unsupported) {
+            ufraw_message(UFRAW_SET_LOG, "%s cannot be written by libtiff\n",
+                          pos->key().c_str());
+            supported = false;
+            break;
+        }
+        ifd.push_back(where);
+    }
+    TIFFCleanup(exif);
+    TIFFCleanup(iop);
+#if TIFFLIB_VERSION >= 20191103
+    if (gps != NULL)
+        TIFFCleanup(gps);
+#endif
+    return supported;
+}
+
+/* Write a custom directory with the data that goes there */
+static bool ufraw_tiff_write_ifd(TIFF *tiff, const Exiv2::ExifData &exifData,
+                                 const std::vector<ufraw_tiff_ifd> &ifd,
+                                 ufraw_tiff_ifd where, uint64_t *offset)
+{
+    Exiv2::ExifData::const_iterator pos;
+    std::vector<ufraw_tiff_ifd>::const_iterator i;
+    for (pos = exifData.begin(), i = ifd.begin(); pos != exifData.end();
+            pos++, i++)
+        if (*i == where)
+            ufraw_tiff_set_datum(tiff, *pos);
+    return TIFFWriteCustomDirectory(tiff, offset);
+}
+
+/*
+ * Write the EXIF data into a TIFF file whose image data was just written,
+ * so that the file does not have to be rewritten by exiv2 afterwards.
+ * The image tags of the raw file go into the image directory, and the
+ * Exif.Photo, Exif.Iop and Exif.GPSInfo tags into their own directories.
+ * GPS directories need libtiff 4.1. If any of the data cannot be written
+ * this way, nothing is written and UFRAW_CANCEL is returned.
+ * ufraw_exif_write() should then be called after the file is closed.
+ * libtiff errors are reported through the libtiff error handler.
+ */
+extern "C" int ufraw_exif_write_tiff(ufraw_data *uf, void *out)
+{
+    TIFF *tiff = (TIFF *)out;
+    Exiv2::ExifData exifData;
+    /* Redirect exiv2 errors to a string buffer */
+    std::ostringstream stderror;
+    std::streambuf *savecerr = std::cerr.rdbuf();
+    std::cerr.rdbuf(stderror.rdbuf());
+    try {
+        exifData = ufraw_prepare_exifdata(uf);
+        std::cerr.rdbuf(savecerr);
+        ufraw_message(UFRAW_SET_LOG, "%s\n", stderror.str().c_str());
+    } catch (Exiv2::AnyError& e) {
+        std::cerr.rdbuf(savecerr);
+        std::string s(e.what());
+        ufraw_message(UFRAW_SET_WARNING, "%s\n", s.c_str());
+        return UFRAW_ERROR;
+    }
+    std::vector<ufraw_tiff_ifd> ifd;
+    if (!ufraw_tiff_classify(tiff, exifData, ifd))
+        return UFRAW_CANCEL;
+    bool hasIop = false;
+#if TIFFLIB_VERSION >= 20191103
+    bool hasGps = false;
+#endif
+    Exiv2::ExifData::const_iterator pos;
+    std::vector<ufraw_tiff_ifd>::const_iterator i;
+    for (pos = exifData.begin(), i = ifd.begin(); pos != exifData.end();
+            pos++, i++) {
+        if (*i == ufraw_tiff_image)
+            ufraw_tiff_set_datum(tiff, *pos);
+        else if (*i == ufraw_tiff_iop)
+            hasIop = true;
+#if TIFFLIB_VERSION >= 20191103
+        else if (*i == ufraw_tiff_gps)
+            hasGps = true;
+#endif
+    }
+    /* Reserve the pointers to the EXIF and GPS directories, so that the
+     * image directory keeps its size when it is rewritten below. */
+    TIFFSetField(tiff, TIFFTAG_EXIFIFD, (uint64_t)0);
+#if TIFFLIB_VERSION >= 20191103
+    if (hasGps)
+        TIFFSetField(tiff, TIFFTAG_GPSIFD, (uint64_t)0);
+#endif
+    if (!TIFFWriteDirectory(tiff))
+        return UFRAW_ERROR;
+
+    /* The interoperability directory is written first, so that the EXIF
+     * directory can point to it. */
+    uint64_t iopOffset = 0, exifOffset;
+    if (hasIop && (TIFFCreateEXIFDirectory(tiff) != 0 ||
+                   !ufraw_tiff_write_ifd(tiff, exifData, ifd, ufraw_tiff_iop,
+                                         &iopOffset)))
+        return UFRAW_ERROR;
+    if (TIFFCreateEXIFDirectory(tiff) != 0)
+        return UFRAW_ERROR;
+    if (hasIop)
+        TIFFSetField(tiff, EXIFTAG_INTEROPERABILITYIFD, iopOffset);
+    if (!ufraw_tiff_write_ifd(tiff, exifData, ifd, ufraw_tiff_exif,
+                              &exifOffset))
+        return UFRAW_ERROR;
+#if TIFFLIB_VERSION >= 20191103
+    uint64_t gpsOffset = 0;
+    if (hasGps && (TIFFCreateGPSDirectory(tiff) != 0 ||
+                   !ufraw_tiff_write_ifd(tiff, exifData, ifd, ufraw_tiff_gps,
+                                         &gpsOffset)))
+        return UFRAW_ERROR;
+#endif
+
+    /* Only the image directory is written again, not the image data */
+    if (!TIFFSetDirectory(tiff, 0))
+        return UFRAW_ERROR;
+    TIFFSetField(tiff, TIFFTAG_EXIFIFD, exifOffset);
+#if TIFFLIB_VERSION >= 20191103
+    if (hasGps)
+        TIFFSetField(tiff, TIFFTAG_GPSIFD, gpsOffset);
+#endif
+    if (!TIFFRewriteDirectory(tiff))
+        return UFRAW_ERROR;
+    return UFRAW_SUCCESS;
+}
+
+#endif /* HAVE_LIBTIFF */
+
 #else
 extern "C" int ufraw_exif_read_input(ufraw_data *uf)
 {
@@ -391,4 +825,11 @@ extern "C" int ufraw_exif_write(ufraw_data *uf)
     (void)uf;
     return UFRAW_ERROR;
 }
+
+extern "C" int ufraw_exif_write_tiff(ufraw_data *uf, void *out)
+{
+    (void)uf;
+    (void)out;
+    return UFRAW_CANCEL;
+}
 #endif /* HAVE_EXIV2 */
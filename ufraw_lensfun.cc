@@ -826,6 +826,7 @@ extern "C" {
         UFRaw::Lensfun &Lensfun =  static_cast<UFRaw::Lensfun &>(Image[ufLensfun]);
         if (uf->modifier != NULL)
             uf->modifier->Destroy();
+        uf->modifierKey[0] = '\0';
         uf->modifier = lfModifier::Create(&Lensfun.Transformation,
                                           Lensfun.Camera.CropFactor, width, height);
         /* Make sure the Camera is valid;
@@ -851,19 +852,33 @@ extern "C" {
         if ((uf->modFlags & (UF_LF_TRANSFORM | LF_MODIFY_VIGNETTING)) == 0) {
             uf->modifier->Destroy();
             uf->modifier = NULL;
+            return;
         }
-    }
-
-    void ufraw_prepare_tca(ufraw_data *uf)
+        // The lensfun settings and the size define how pixels are mapped
+        std::string xml = Lensfun.XML("");
+        char *text = g_strdup_printf("%s\n%g %g %g %g %d\n%d %d %d %g %d",
+                                     xml.c_str(), Lensfun.Camera.CropFactor,
+                                     Lensfun.FocalLengthValue,
+                                     Lensfun.ApertureValue,
+                                     Lensfun.DistanceValue,
+                                     targetLensGeometry.Index(), width, height,
+                                     reverse, scale, uf->modFlags);
+        char *hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, text, -1);
+        g_strlcpy(uf->modifierKey, hash, max_name);
+        g_free(hash);
+        g_free(text);
+    }
+
+    /* Prepare the TCA correction of a raw image of width x height */
+    void ufraw_prepare_tca(ufraw_data *uf, int width, int height)
     {
         UFGroup &Image = *uf->conf->ufobject;
         UFRaw::Lensfun &Lensfun =  static_cast<UFRaw::Lensfun &>(Image[ufLensfun]);
-        ufraw_image_data *img = &uf->Images[ufraw_raw_phase];
 
         if (uf->TCAmodifier != NULL)
             uf->TCAmodifier->Destroy();
         uf->TCAmodifier = lfModifier::Create(&Lensfun.Transformation,
-                                             Lensfun.Camera.CropFactor, img->width, img->height);
+                                             Lensfun.Camera.CropFactor, width, height);
         /* Make sure the Camera is valid;
          * Operations can return nan (not-a-number) values if not
          * We should instead guarantee a valid camera,
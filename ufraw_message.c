@@ -128,19 +128,123 @@ void ufraw_batch_messenger(char *message)
     g_printerr("%s%c", message, message[strlen(message) - 1] != '\n' ? '\n' : 0);
 }
 
+/* The log and error buffers belong to the thread that works on an image,
+ * so that images converted at the same time do not mix their messages.
+ * ufraw_message_detach() and ufraw_message_attach() hand them over when
+ * an image moves to another thread. While a thread captures its messages
+ * they are collected in 'captured' instead of being displayed, so that a
+ * worker can hand them to whoever reports on its image. */
+typedef struct {
+    char *logBuffer;
+    char *errorBuffer;
+    gboolean errorFlag;
+    GString *captured;
+} ufraw_message_state;
+
+static void message_state_free(gpointer data)
+{
+    ufraw_message_state *state = data;
+    if (state == NULL) return;
+    g_free(state->logBuffer);
+    g_free(state->errorBuffer);
+    if (state->captured != NULL)
+        g_string_free(state->captured, TRUE);
+    g_free(state);
+}
+
+#if GLIB_CHECK_VERSION(2,32,0)
+static GPrivate messageState = G_PRIVATE_INIT(message_state_free);
+#else
+static GStaticPrivate messageState = G_STATIC_PRIVATE_INIT;
+#endif
+
+static void message_state_set(ufraw_message_state *state)
+{
+#if GLIB_CHECK_VERSION(2,32,0)
+    g_private_replace(&messageState, state);
+#else
+    g_static_private_set(&messageState, state, message_state_free);
+#endif
+}
+
+static ufraw_message_state *message_state(void)
+{
+#if GLIB_CHECK_VERSION(2,32,0)
+    ufraw_message_state *state = g_private_get(&messageState);
+#else
+    ufraw_message_state *state = g_static_private_get(&messageState);
+#endif
+    if (state == NULL) {
+        state = g_new0(ufraw_message_state, 1);
+        message_state_set(state);
+    }
+    return state;
+}
+
+/* Take the messages of this thread, leaving it with empty buffers */
+void *ufraw_message_detach(void)
+{
+    ufraw_message_state *state = message_state();
+    ufraw_message_state *detached = g_new(ufraw_message_state, 1);
+    *detached = *state;
+    state->logBuffer = NULL;
+    state->errorBuffer = NULL;
+    state->errorFlag = FALSE;
+    state->captured = NULL;
+    return detached;
+}
+
+/* Replace the messages of this thread with detached ones */
+void ufraw_message_attach(void *messages)
+{
+    if (messages == NULL) return;
+    message_state_set(messages);
+}
+
+/* Collect the messages this thread would display until
+ * ufraw_message_captured() is called */
+void ufraw_message_capture(void)
+{
+    ufraw_message_state *state = message_state();
+    if (state->captured == NULL)
+        state->captured = g_string_new("");
+}
+
+/* Stop capturing and return the collected messages, or NULL if there
+ * were none. The caller should g_free() the result. */
+char *ufraw_message_captured(void)
+{
+    ufraw_message_state *state = message_state();
+    GString *captured = state->captured;
+    state->captured = NULL;
+    if (captured == NULL) return NULL;
+    if (captured->len == 0) {
+        g_string_free(captured, TRUE);
+        return NULL;
+    }
+    return g_string_free(captured, FALSE);
+}
+
+/* Only the parent window is shared between threads. The lock is not held
+ * while calling ufraw_messenger(), since the GUI messenger runs a nested
+ * main loop. */
+G_LOCK_DEFINE_STATIC(ufraw_message);
+
 char *ufraw_message(int code, const char *format, ...)
 {
-    // TODO: The following static variables are not thread-safe
-    static char *logBuffer = NULL;
-    static char *errorBuffer = NULL;
-    static gboolean errorFlag = FALSE;
     static void *parentWindow = NULL;
+    ufraw_message_state *state = message_state();
     char *message = NULL;
+    char *ret = NULL;
     void *saveParentWindow;
+    void *window;
+    gboolean display = FALSE;
 
     if (code == UFRAW_SET_PARENT) {
+        G_LOCK(ufraw_message);
         saveParentWindow = parentWindow;
         parentWindow = (void *)format;
+        G_UNLOCK(ufraw_message);
         return saveParentWindow;
     }
     if (format != NULL) {
@@ -149,46 +253,58 @@ char *ufraw_message(int code, const char *format, ...)
         message = g_strdup_vprintf(format, ap);
         va_end(ap);
     }
+    G_LOCK(ufraw_message);
+    window = parentWindow;
+    G_UNLOCK(ufraw_message);
     switch (code) {
         case UFRAW_SET_ERROR:
-            errorFlag = TRUE;
+            state->errorFlag = TRUE;
         case UFRAW_SET_WARNING:
-            errorBuffer = ufraw_message_buffer(errorBuffer, message);
+            state->errorBuffer =
+                ufraw_message_buffer(state->errorBuffer, message);
         case UFRAW_SET_LOG:
         case UFRAW_DCRAW_SET_LOG:
-            logBuffer = ufraw_message_buffer(logBuffer, message);
-            g_free(message);
-            return NULL;
+            state->logBuffer = ufraw_message_buffer(state->logBuffer, message);
+            break;
         case UFRAW_GET_ERROR:
-            if (!errorFlag) return NULL;
+            if (!state->errorFlag) break;
         case UFRAW_GET_WARNING:
-            return errorBuffer;
+            ret = state->errorBuffer;
+            break;
         case UFRAW_GET_LOG:
-            return logBuffer;
+            ret = state->logBuffer;
+            break;
         case UFRAW_CLEAN:
-            g_free(logBuffer);
-            logBuffer = NULL;
+            g_free(state->logBuffer);
+            state->logBuffer = NULL;
         case UFRAW_RESET:
-            g_free(errorBuffer);
-            errorBuffer = NULL;
-            errorFlag = FALSE;
-            return NULL;
+            g_free(state->errorBuffer);
+            state->errorBuffer = NULL;
+            state->errorFlag = FALSE;
+            break;
         case UFRAW_BATCH_MESSAGE:
-            if (parentWindow == NULL)
-                ufraw_messenger(message, parentWindow);
-            g_free(message);
-            return NULL;
+            display = window == NULL;
+            break;
         case UFRAW_INTERACTIVE_MESSAGE:
-            if (parentWindow != NULL)
-                ufraw_messenger(message, parentWindow);
-            g_free(message);
-            return NULL;
+            display = window != NULL;
+            break;
         case UFRAW_REPORT:
-            ufraw_messenger(errorBuffer, parentWindow);
-            return NULL;
-        default:
-            ufraw_messenger(message, parentWindow);
             g_free(message);
-            return NULL;
+            message = g_strdup(state->errorBuffer);
+            display = TRUE;
+            break;
+        default:
+            display = TRUE;
+    }
+    if (display && state->captured != NULL) {
+        if (message != NULL) {
+            g_string_append(state->captured, message);
+            if (message[0] != '\0' && message[strlen(message) - 1] != '\n')
+                g_string_append_c(state->captured, '\n');
+        }
+    } else if (display) {
+        ufraw_messenger(message, window);
     }
+    g_free(message);
+    return ret;
 }
@@ -1016,7 +1016,9 @@ static gboolean render_preview_now(preview_data *data)
     ufraw_convert_image_area(data->UF, 0, ufraw_first_phase);
     data->FreezeDialog = FALSE;
 
-    preview_progress(PROGRESS_RENDER, -32);
+    ufraw_image_data *img = ufraw_get_image(data->UF,
+                                            ufraw_display_phase, FALSE);
+    preview_progress(PROGRESS_RENDER, -ufraw_image_get_subarea_count(img));
     // Since we are already inside an idle callback, we should not use
     // gdk_threads_add_idle_full().
     g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
@@ -1130,7 +1132,7 @@ static gboolean render_raw_histogram(preview_data *data)
     return FALSE;
 }
 
-static int choose_subarea(preview_data *data, int *chosen)
+static int choose_subarea(preview_data *data, guint8 *chosen)
 {
     int subarea = -1;
     int max_area = -1;
@@ -1145,13 +1147,13 @@ static int choose_subarea(preview_data *data, int *chosen)
     gtk_image_view_get_viewport(
         GTK_IMAGE_VIEW(data->PreviewWidget), &viewport);
 
-    int i;
-    for (i = 0; i < 32; i++) {
+    int i, count = ufraw_image_get_subarea_count(img);
+    for (i = 0; i < count; i++) {
         /* Skip valid subareas */
-        if (img->valid & (1 << i))
+        if (img->valid[i])
             continue;
         /* Skip areas chosen by other threads */
-        if (*chosen & (1 << i))
+        if (chosen[i])
             continue;
 
 
@@ -1188,7 +1190,7 @@ static int choose_subarea(preview_data *data, int *chosen)
         }
     }
     if (subarea >= 0)
-        *chosen |= 1 << subarea;
+        chosen[subarea] = TRUE;
     return subarea;
 }
 
@@ -1197,15 +1199,17 @@ static int choose_subarea(preview_data *data, int *chosen)
  *
  * OpenMP notes:
  *
- * Unfortunately ufraw_convert_image_area() still has some OpenMP awareness
- * which is related to OpenMP here. That should not be necessary.
+ * choose_subarea() is called in a critical section. The threads then
+ * convert different subareas, which ufraw_convert_image_area() supports.
  */
 static gboolean render_preview_image(preview_data *data)
 {
     gboolean again = FALSE;
-    int chosen = 0;
 
     if (data->FreezeDialog) return FALSE;
+    ufraw_image_data *img = ufraw_get_image(data->UF,
+                                            ufraw_display_phase, FALSE);
+    guint8 *chosen = g_new0(guint8, ufraw_image_get_subarea_count(img));
     int subarea[uf_omp_get_max_threads()];
     int i;
     for (i = 0; i < uf_omp_get_max_threads(); i++)
@@ -1215,7 +1219,7 @@ static gboolean render_preview_image(preview_data *data)
     {
         #pragma omp critical
 #endif
-        subarea[uf_omp_get_thread_num()] = choose_subarea(data, &chosen);
+        subarea[uf_omp_get_thread_num()] = choose_subarea(data, chosen);
         if (subarea[uf_omp_get_thread_num()] < 0) {
             data->RenderSubArea = -1;
         } else {
@@ -1227,8 +1231,8 @@ static gboolean render_preview_image(preview_data *data)
 #ifdef _OPENMP
     }
 #endif
-    ufraw_image_data *img = ufraw_get_image(data->UF,
-                                            ufraw_display_phase, FALSE);
+    g_free(chosen);
+    img = ufraw_get_image(data->UF, ufraw_display_phase, FALSE);
     for (i = 0; i < uf_omp_get_max_threads(); i++) {
         if (subarea[i] >= 0) {
             UFRectangle area = ufraw_image_get_subarea_rectangle(img,
@@ -5536,6 +5540,9 @@ int ufraw_preview(ufraw_data *uf, conf_data *rc, int plugin,
 
     data->UF = uf;
     data->SaveFunc = save_func;
+    /* The EXIF page shows the data that exiv2 reads */
+    if (uf->exifPending)
+        ufraw_exif_read_input(uf);
 
     data->rc = rc;
     data->SpotX1 = -1;
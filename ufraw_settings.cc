@@ -377,34 +377,37 @@ void Image::SetUFRawData(ufraw_data *data)
         g_strlcpy(model, uf->conf->model, max_name);
     }
     UFArray &wb = (*this)[ufWB];
-    for (int i = 0; i < wb_preset_count; i++) {
-        if (strcasecmp(wb_preset[i].make, "") == 0) {
-            /* Common presets */
-            if (strcmp(wb_preset[i].name, uf_camera_wb) == 0) {
-                // Get the camera's presets.
-                int status = dcraw_set_color_scale(raw, TRUE);
-                // Failure means that dcraw does not support this model.
-                if (status != DCRAW_SUCCESS) {
-                    if (wb.IsEqual(uf_camera_wb)) {
-                        ufraw_message(UFRAW_SET_LOG,
-                                      _("Cannot use camera white balance, "
-                                        "reverting to auto white balance.\n"));
-                        wb.Set(uf_auto_wb);
-                    }
-                    continue;
+    /* Common presets */
+    int count;
+    const wb_data *preset = wb_preset_find("", "", NULL, &count);
+    for (int i = 0; i < count; i++) {
+        if (strcmp(preset[i].name, uf_camera_wb) == 0) {
+            // Get the camera's presets.
+            int status = dcraw_set_color_scale(raw, TRUE);
+            // Failure means that dcraw does not support this model.
+            if (status != DCRAW_SUCCESS) {
+                if (wb.IsEqual(uf_camera_wb)) {
+                    ufraw_message(UFRAW_SET_LOG,
+                                  _("Cannot use camera white balance, "
+                                    "reverting to auto white balance.\n"));
+                    wb.Set(uf_auto_wb);
                 }
+                continue;
             }
-            wb << new UFString(ufPreset, wb_preset[i].name);
-        } else if (strcasecmp(wb_preset[i].make, uf->conf->make) == 0 &&
-                   strcasecmp(wb_preset[i].model, model) == 0) {
-            /* Camera specific presets */
-            uf->wb_presets_make_model_match = TRUE;
-            if (lastPreset == NULL ||
-                    strcmp(wb_preset[i].name, lastPreset->name) != 0) {
-                wb << new UFString(ufPreset, wb_preset[i].name);
-            }
-            lastPreset = &wb_preset[i];
         }
+        wb << new UFString(ufPreset, preset[i].name);
+    }
+    /* Camera specific presets */
+    preset = wb_preset_find(uf->conf->make, model, NULL, &count);
+    if (uf->conf->make[0] == '\0')
+        count = 0; // The common presets were already added
+    for (int i = 0; i < count; i++) {
+        uf->wb_presets_make_model_match = TRUE;
+        if (lastPreset == NULL ||
+                strcmp(preset[i].name, lastPreset->name) != 0) {
+            wb << new UFString(ufPreset, preset[i].name);
+        }
+        lastPreset = &preset[i];
     }
 }
 
@@ -40,7 +40,7 @@ static void ufraw_convert_image_vignetting(ufraw_data *uf,
 static void ufraw_convert_image_tca(ufraw_data *uf, ufraw_image_data *img,
                                     ufraw_image_data *outimg,
                                     UFRectangle *area);
-void ufraw_prepare_tca(ufraw_data *uf);
+void ufraw_prepare_tca(ufraw_data *uf, int width, int height);
 #endif
 static void ufraw_image_format(int *colors, int *bytes, ufraw_image_data *img,
                                const char *formats, const char *caller);
@@ -55,7 +55,14 @@ static void ufraw_convert_prepare_transform_buffer(ufraw_data *uf,
 static void ufraw_convert_reverse_wb(ufraw_data *uf, UFRawPhase phase);
 static void ufraw_convert_import_buffer(ufraw_data *uf, UFRawPhase phase,
                                         dcraw_image_data *dcimg);
-
+static gboolean ufraw_crop_source_area(ufraw_data *uf, ufraw_image_data *img,
+                                       ufraw_image_data *img2, UFRectangle *crop, UFRectangle *source);
+static void ufraw_raw_window_init(ufraw_data *uf, ufraw_image_data *img,
+                                  const UFRectangle *source);
+static void ufraw_raw_window_free(ufraw_data *uf);
+static int ufraw_prepare_loaded_raw(ufraw_data *uf);
+
+#ifndef HAVE_FMEMOPEN
 static int make_temporary(char *basefilename, char **tmpfilename)
 {
     int fd;
@@ -77,77 +84,183 @@ static ssize_t writeall(int fd, const char *buf, ssize_t size)
     return written;
 }
 
-static char *decompress_gz(char *origfilename)
+/* Without fmemopen() dcraw cannot read from memory. The decompressed data
+ * is then written to a temporary file. */
+static char *write_temporary(char *origfilename, const char *buf, gsize len)
 {
-#ifdef HAVE_LIBZ
     char *tempfilename;
     int tmpfd;
-    gzFile gzfile;
-    char buf[8192];
-    ssize_t size;
     if ((tmpfd = make_temporary(origfilename, &tempfilename)) == -1)
         return NULL;
-    char *filename = uf_win32_locale_filename_from_utf8(origfilename);
-    gzfile = gzopen(filename, "rb");
-    uf_win32_locale_filename_free(filename);
-    if (gzfile != NULL) {
-        while ((size = gzread(gzfile, buf, sizeof buf)) > 0) {
-            if (writeall(tmpfd, buf, size) != size)
-                break;
-        }
-        gzclose(gzfile);
-        if (size == 0)
-            if (close(tmpfd) == 0)
-                return tempfilename;
-    }
+    if (writeall(tmpfd, buf, len) == (ssize_t)len && close(tmpfd) == 0)
+        return tempfilename;
     close(tmpfd);
     g_unlink(tempfilename);
     g_free(tempfilename);
     return NULL;
+}
+#endif /* !HAVE_FMEMOPEN */
+
+static void unmap_file(GMappedFile *map)
+{
+    if (map == NULL)
+        return;
+#if GLIB_CHECK_VERSION(2,22,0)
+    g_mapped_file_unref(map);
+#else
+    g_mapped_file_free(map);
+#endif
+}
+
+/* Free the input buffers once dcraw is done with the raw file */
+static void ufraw_release_input(ufraw_data *uf)
+{
+    g_free(uf->unzippedBuf);
+    uf->unzippedBuf = NULL;
+    unmap_file(uf->inputMap);
+    uf->inputMap = NULL;
+}
+
+#if defined(HAVE_LIBZ) || defined(HAVE_LIBBZ2)
+/* Make room for at least one more byte in the decompression buffer */
+static void decompress_grow(gchar **buf, gsize *alloc, gsize used)
+{
+    if (used < *alloc)
+        return;
+    *alloc = MAX(*alloc * 2, 1 << 20);
+    *buf = g_realloc(*buf, *alloc);
+}
+#endif
+
+/* Decompress a whole .gz file into memory. */
+static gboolean decompress_gz(char *origfilename, gchar **buf, gsize *len)
+{
+#ifdef HAVE_LIBZ
+    /* The last four bytes of a gzip file hold the uncompressed size
+     * modulo 2^32. Use it to allocate the buffer in one go, unless it
+     * is implausible for a raw file. */
+    gsize alloc = 0;
+    FILE *compfile = g_fopen(origfilename, "rb");
+    if (compfile != NULL) {
+        guchar isize[4];
+        if (fseek(compfile, -4, SEEK_END) == 0 &&
+                fread(isize, 1, 4, compfile) == 4) {
+            alloc = isize[0] | isize[1] << 8 | isize[2] << 16 |
+                    (gsize)isize[3] << 24;
+            if (alloc > 16 * (gsize)ftell(compfile))
+                alloc = 0;
+        }
+        fclose(compfile);
+    }
+    char *filename = uf_win32_locale_filename_from_utf8(origfilename);
+    gzFile gzfile = gzopen(filename, "rb");
+    uf_win32_locale_filename_free(filename);
+    if (gzfile == NULL)
+        return FALSE;
+#if ZLIB_VERNUM >= 0x1240
+    gzbuffer(gzfile, 1 << 17);
+#endif
+    gchar *data = alloc > 0 ? g_malloc(alloc) : NULL;
+    gsize used = 0;
+    int size;
+    do {
+        decompress_grow(&data, &alloc, used);
+        size = gzread(gzfile, data + used, MIN(alloc - used, G_MAXINT));
+        if (size > 0)
+            used += size;
+    } while (size > 0);
+    gzclose(gzfile);
+    if (size < 0 || used == 0) {
+        g_free(data);
+        return FALSE;
+    }
+    *buf = g_realloc(data, used);
+    *len = used;
+    return TRUE;
 #else
     (void)origfilename;
+    (void)buf;
+    (void)len;
     ufraw_message(UFRAW_SET_ERROR,
                   "Cannot open gzip compressed images.\n");
-    return NULL;
+    return FALSE;
 #endif
 }
 
-static char *decompress_bz2(char *origfilename)
+/* Decompress a whole .bz2 file into memory. */
+static gboolean decompress_bz2(char *origfilename, gchar **buf, gsize *len)
 {
 #ifdef HAVE_LIBBZ2
-    char *tempfilename;
-    int tmpfd;
     FILE *compfile;
     BZFILE *bzfile;
     int bzerror;
-    char buf[8192];
-    ssize_t size;
+    int size;
 
-    if ((tmpfd = make_temporary(origfilename, &tempfilename)) == -1)
-        return NULL;
     compfile = g_fopen(origfilename, "rb");
-    if (compfile != NULL) {
-        if ((bzfile = BZ2_bzReadOpen(&bzerror, compfile, 0, 0, 0, 0)) != 0) {
-            while ((size = BZ2_bzRead(&bzerror, bzfile, buf, sizeof buf)) > 0)
-                if (writeall(tmpfd, buf, size) != size)
-                    break;
+    if (compfile == NULL)
+        return FALSE;
+    /* Start with twice the compressed size, which is about what raw
+     * files compress to. */
+    struct stat st;
+    gsize alloc = fstat(fileno(compfile), &st) == 0 ? 2 * st.st_size : 0;
+    gchar *data = alloc > 0 ? g_malloc(alloc) : NULL;
+    gsize used = 0;
+    int streams = 0;
+    bzfile = BZ2_bzReadOpen(&bzerror, compfile, 0, 0, NULL, 0);
+    while (bzerror == BZ_OK) {
+        decompress_grow(&data, &alloc, used);
+        size = BZ2_bzRead(&bzerror, bzfile, data + used,
+                          MIN(alloc - used, G_MAXINT));
+        if (bzerror == BZ_DATA_ERROR_MAGIC && streams > 0) {
+            /* Trailing bytes after the last stream are ignored,
+             * as bzip2 does. */
+            bzerror = BZ_STREAM_END;
+            break;
+        }
+        if (bzerror != BZ_OK && bzerror != BZ_STREAM_END)
+            break;
+        used += size;
+        if (bzerror == BZ_STREAM_END) {
+            streams++;
+            /* Files compressed by pbzip2 are a concatenation of
+             * bzip2 streams. Continue with the next one, if any. */
+            void *unused;
+            int nUnused;
+            BZ2_bzReadGetUnused(&bzerror, bzfile, &unused, &nUnused);
+            gchar *rest = g_memdup(unused, nUnused);
             BZ2_bzReadClose(&bzerror, bzfile);
-            fclose(compfile);
-            if (size == 0) {
-                close(tmpfd);
-                return tempfilename;
+            bzfile = NULL;
+            int c = getc(compfile);
+            if (nUnused == 0 && c == EOF) {
+                g_free(rest);
+                bzerror = BZ_STREAM_END;
+                break;
             }
+            if (c != EOF)
+                ungetc(c, compfile);
+            bzfile = BZ2_bzReadOpen(&bzerror, compfile, 0, 0, rest, nUnused);
+            g_free(rest);
         }
     }
-    close(tmpfd);
-    g_unlink(tempfilename);
-    g_free(tempfilename);
-    return NULL;
+    if (bzfile != NULL) {
+        int closeerror;
+        BZ2_bzReadClose(&closeerror, bzfile);
+    }
+    fclose(compfile);
+    if (bzerror != BZ_STREAM_END || used == 0) {
+        g_free(data);
+        return FALSE;
+    }
+    *buf = g_realloc(data, used);
+    *len = used;
+    return TRUE;
 #else
     (void)origfilename;
+    (void)buf;
+    (void)len;
     ufraw_message(UFRAW_SET_ERROR,
                   "Cannot open bzip2 compressed images.\n");
-    return NULL;
+    return FALSE;
 #endif
 }
 
@@ -159,7 +272,6 @@ ufraw_data *ufraw_open(char *filename)
     ufraw_message(UFRAW_CLEAN, NULL);
     conf_data *conf = NULL;
     char *fname, *hostname;
-    char *origfilename;
     gchar *unzippedBuf = NULL;
     gsize unzippedBufLen = 0;
 
@@ -209,23 +321,50 @@ ufraw_data *ufraw_open(char *filename)
 
         filename = conf->inputFilename;
     }
-    origfilename = filename;
+    gboolean unzipped = TRUE;
     if (!strcasecmp(filename + strlen(filename) - 3, ".gz"))
-        filename = decompress_gz(filename);
+        unzipped = decompress_gz(filename, &unzippedBuf, &unzippedBufLen);
     else if (!strcasecmp(filename + strlen(filename) - 4, ".bz2"))
-        filename = decompress_bz2(filename);
-    if (filename == 0) {
+        unzipped = decompress_bz2(filename, &unzippedBuf, &unzippedBufLen);
+    if (!unzipped) {
         ufraw_message(UFRAW_SET_ERROR,
-                      "Error creating temporary file for compressed data.");
+                      "Error decompressing %s.", filename);
         return NULL;
     }
     raw = g_new(dcraw_data, 1);
-    status = dcraw_open(raw, filename);
-    if (filename != origfilename) {
-        g_file_get_contents(filename, &unzippedBuf, &unzippedBufLen, NULL);
-        g_unlink(filename);
-        g_free(filename);
-        filename = origfilename;
+    GMappedFile *inputMap = NULL;
+    if (unzippedBuf == NULL) {
+#ifdef HAVE_FMEMOPEN
+        /* The file is read once into memory that dcraw and exiv2 share */
+        inputMap = g_mapped_file_new(filename, FALSE, NULL);
+        if (inputMap != NULL && g_mapped_file_get_length(inputMap) == 0) {
+            unmap_file(inputMap);
+            inputMap = NULL;
+        }
+        if (inputMap != NULL)
+            status = dcraw_open_buffer(raw, filename,
+                                       g_mapped_file_get_contents(inputMap),
+                                       g_mapped_file_get_length(inputMap));
+        else
+#endif
+            status = dcraw_open(raw, filename);
+    } else {
+#ifdef HAVE_FMEMOPEN
+        status = dcraw_open_buffer(raw, filename, unzippedBuf, unzippedBufLen);
+#else
+        char *tmpfilename = write_temporary(filename, unzippedBuf,
+                                            unzippedBufLen);
+        if (tmpfilename == NULL) {
+            ufraw_message(UFRAW_SET_ERROR,
+                          "Error creating temporary file for compressed data.");
+            g_free(raw);
+            g_free(unzippedBuf);
+            return NULL;
+        }
+        status = dcraw_open(raw, tmpfilename);
+        g_unlink(tmpfilename);
+        g_free(tmpfilename);
+#endif
     }
     if (status != DCRAW_SUCCESS) {
         /* Hold the message without displaying it */
@@ -233,6 +372,7 @@ ufraw_data *ufraw_open(char *filename)
         if (status != DCRAW_WARNING) {
             g_free(raw);
             g_free(unzippedBuf);
+            unmap_file(inputMap);
             return NULL;
         }
     }
@@ -241,6 +381,7 @@ ufraw_data *ufraw_open(char *filename)
     uf->rgbMax = 0; // This indicates that the raw file was not loaded yet.
     uf->unzippedBuf = unzippedBuf;
     uf->unzippedBufLen = unzippedBufLen;
+    uf->inputMap = inputMap;
     uf->conf = conf;
     g_strlcpy(uf->filename, filename, max_path);
     int i;
@@ -248,7 +389,10 @@ ufraw_data *ufraw_open(char *filename)
         uf->Images[i].buffer = NULL;
         uf->Images[i].width = 0;
         uf->Images[i].height = 0;
-        uf->Images[i].valid = 0;
+        uf->Images[i].tileSize = UFRAW_TILE_SIZE;
+        uf->Images[i].tilesX = 0;
+        uf->Images[i].tilesY = 0;
+        uf->Images[i].valid = NULL;
         uf->Images[i].invalidate_event = TRUE;
     }
     uf->thumb.buffer = NULL;
@@ -266,6 +410,7 @@ ufraw_data *ufraw_open(char *filename)
     uf->modFlags = 0;
     uf->TCAmodifier = NULL;
     uf->modifier = NULL;
+    uf->modifierKey[0] = '\0';
 #endif
     uf->inputExifBuf = NULL;
     uf->outputExifBuf = NULL;
@@ -397,21 +542,43 @@ void ufraw_get_image_dimensions(ufraw_data *uf)
     }
 }
 
-/* Get scaled crop coordinates in final image coordinates */
-void ufraw_get_scaled_crop(ufraw_data *uf, UFRectangle *crop)
+/* Scale the crop coordinates to a final image of the given size */
+static void ufraw_scale_crop(ufraw_data *uf, int width, int height,
+                             UFRectangle *crop)
 {
-    ufraw_image_data *img = ufraw_get_image(uf, ufraw_transform_phase, FALSE);
-
-    float scale_x = ((float)img->width) / uf->rotatedWidth;
-    float scale_y = ((float)img->height) / uf->rotatedHeight;
+    float scale_x = ((float)width) / uf->rotatedWidth;
+    float scale_y = ((float)height) / uf->rotatedHeight;
     crop->x = MAX(floor(uf->conf->CropX1 * scale_x), 0);
-    int x2 = MIN(ceil(uf->conf->CropX2 * scale_x), img->width);
+    int x2 = MIN(ceil(uf->conf->CropX2 * scale_x), width);
     crop->width = x2 - crop->x;
     crop->y = MAX(floor(uf->conf->CropY1 * scale_y), 0);
-    int y2 = MIN(ceil(uf->conf->CropY2 * scale_y), img->height);
+    int y2 = MIN(ceil(uf->conf->CropY2 * scale_y), height);
     crop->height = y2 - crop->y;
 }
 
+/* Get scaled crop coordinates in final image coordinates */
+void ufraw_get_scaled_crop(ufraw_data *uf, UFRectangle *crop)
+{
+    ufraw_image_data *img = ufraw_get_image(uf, ufraw_transform_phase, FALSE);
+    ufraw_scale_crop(uf, img->width, img->height, crop);
+}
+
+/* Check if the EXIF data that exiv2 reads is used before the image is
+ * saved. The EXIF data that is embedded in the output is read only when
+ * it is written, from the input map that is kept until then. */
+static gboolean ufraw_exif_needed(ufraw_data *uf)
+{
+    if (uf->conf->createID != no_id || uf->conf->type == fits_type)
+        return TRUE;
+#ifdef HAVE_LENSFUN
+    // The lens is found by the lens name, which dcraw does not read
+    if (!ufstring_is_equal(ufgroup_element(uf->conf->ufobject,
+                                           ufLensfunAuto), "no"))
+        return TRUE;
+#endif
+    return FALSE;
+}
+
 int ufraw_config(ufraw_data *uf, conf_data *rc, conf_data *conf, conf_data *cmd)
 {
     int status;
@@ -466,9 +633,18 @@ int ufraw_config(ufraw_data *uf, conf_data *rc, conf_data *conf, conf_data *cmd)
     strcpy(uf->conf->flashText, "");
     // lensText is used in ufraw_lensfun_init()
     if (!uf->conf->embeddedImage) {
-        if (ufraw_exif_read_input(uf) != UFRAW_SUCCESS) {
-            ufraw_message(UFRAW_SET_LOG, "Error reading EXIF data from %s\n",
-                          uf->filename);
+        /* exiv2 parses the whole file again. Without it the EXIF tags
+         * that dcraw read are used, and the EXIF data is only read if
+         * it is saved after all, see ufraw_exif_prepare_output(). It is
+         * then parsed from the input map, which is kept until then. The
+         * buffer of a decompressed raw file is too big to keep, so its
+         * EXIF data is always read now. */
+        uf->exifPending = uf->unzippedBuf == NULL && !ufraw_exif_needed(uf);
+        if (uf->exifPending || ufraw_exif_read_input(uf) != UFRAW_SUCCESS) {
+            if (!uf->exifPending)
+                ufraw_message(UFRAW_SET_LOG,
+                              "Error reading EXIF data from %s\n",
+                              uf->filename);
             // If exiv2 fails to read the EXIF data, use the EXIF tags read
             // by dcraw.
             g_strlcpy(uf->conf->exifSource, "DCRaw", max_name);
@@ -511,8 +687,10 @@ int ufraw_config(ufraw_data *uf, conf_data *rc, conf_data *conf, conf_data *cmd)
         g_snprintf(uf->conf->inputURI, max_path, "file://%s",
                    uf->conf->inputFilename);
         struct stat s;
-        fstat(fileno(raw->ifp), &s);
-        g_snprintf(uf->conf->inputModTime, max_name, "%d", (int)s.st_mtime);
+        // raw->ifp has no file descriptor if it reads from memory
+        if (g_stat(uf->filename, &s) == 0)
+            g_snprintf(uf->conf->inputModTime, max_name, "%d",
+                       (int)s.st_mtime);
     }
     if (strlen(uf->conf->outputFilename) == 0) {
         /* If output filename wasn't specified use input filename */
@@ -527,8 +705,12 @@ int ufraw_config(ufraw_data *uf, conf_data *rc, conf_data *conf, conf_data *cmd)
         g_strlcpy(uf->conf->outputFilename, filename, max_path);
         g_free(filename);
     }
+#ifndef HAVE_FMEMOPEN
+    /* With fmemopen() dcraw reads the raw data from this buffer and it is
+     * freed after dcraw_load_raw(). */
     g_free(uf->unzippedBuf);
     uf->unzippedBuf = NULL;
+#endif
     /* Set the EXIF data */
 #ifdef __MINGW32__
     /* MinG32 does not have ctime_r(). */
@@ -663,13 +845,30 @@ int ufraw_load_raw(ufraw_data *uf)
         uf->thumb.width = thumb.width;
         return ufraw_read_embedded(uf);
     }
-    if ((status = dcraw_load_raw(raw)) != DCRAW_SUCCESS) {
-        ufraw_message(UFRAW_SET_LOG, raw->message);
-        ufraw_message(status, raw->message);
-        if (status != DCRAW_WARNING) return status;
+    if (!ufraw_cache_load(uf)) {
+        status = dcraw_load_raw(raw);
+        if (status != DCRAW_SUCCESS) {
+            ufraw_message(UFRAW_SET_LOG, raw->message);
+            ufraw_message(status, raw->message);
+            if (status != DCRAW_WARNING) return status;
+        }
+        uf->raw_multiplier = ufraw_scale_raw(raw);
+        if (status == DCRAW_SUCCESS)
+            ufraw_cache_save(uf);
     }
+    return ufraw_prepare_loaded_raw(uf);
+}
+
+/* Set up the settings that depend on the raw image data */
+static int ufraw_prepare_loaded_raw(ufraw_data *uf)
+{
+    dcraw_data *raw = uf->raw;
+
+    // dcraw is done with the input file, compressed or not. The map is
+    // kept while the EXIF data may still be read from it.
+    if (!uf->exifPending)
+        ufraw_release_input(uf);
     uf->HaveFilters = raw->filters != 0;
-    uf->raw_multiplier = ufraw_scale_raw(raw);
     /* Canon EOS cameras require special exposure normalization */
     if (strcasecmp(uf->conf->make, "Canon") == 0 &&
             strncmp(uf->conf->model, "EOS", 3) == 0) {
@@ -741,6 +940,120 @@ int ufraw_load_raw(ufraw_data *uf)
     return UFRAW_SUCCESS;
 }
 
+/* Return the first phase of ufraw_convert_image() that is affected by
+ * the differences between the settings old and conf, or
+ * ufraw_develop_phase if the converted image is the same for both.
+ * ufraw_convert_image() leaves the result of the transform phase in the
+ * first phase buffer, so transform settings are counted as first phase
+ * settings.
+ */
+static UFRawPhase ufraw_conf_changed_phase(conf_data *old, conf_data *conf)
+{
+    int c;
+
+    /* Settings of the raw phase, including the white balance that
+     * dcraw_finalize_raw() applies */
+    if (old->threshold != conf->threshold ||
+            old->hotpixel != conf->hotpixel ||
+            strcmp(old->darkframeFile, conf->darkframeFile) != 0 ||
+            memcmp(old->despeckleWindow, conf->despeckleWindow,
+                   sizeof conf->despeckleWindow) != 0 ||
+            memcmp(old->despeckleDecay, conf->despeckleDecay,
+                   sizeof conf->despeckleDecay) != 0 ||
+            memcmp(old->despecklePasses, conf->despecklePasses,
+                   sizeof conf->despecklePasses) != 0)
+        return ufraw_raw_phase;
+    UFObject *oldChanMul = ufgroup_element(old->ufobject, ufChannelMultipliers);
+    UFObject *chanMul = ufgroup_element(conf->ufobject, ufChannelMultipliers);
+    for (c = 0; c < 4; c++)
+        if (ufnumber_array_value(oldChanMul, c) !=
+                ufnumber_array_value(chanMul, c))
+            return ufraw_raw_phase;
+#ifdef HAVE_LENSFUN
+    /* The TCA correction is applied in the raw phase. Any other lens
+     * change is handled the same way, for simplicity. */
+    char *oldLens = ufobject_xml(ufgroup_element(old->ufobject, ufLensfun), "");
+    char *lens = ufobject_xml(ufgroup_element(conf->ufobject, ufLensfun), "");
+    gboolean lensChanged = strcmp(oldLens, lens) != 0;
+    g_free(oldLens);
+    g_free(lens);
+    if (lensChanged)
+        return ufraw_raw_phase;
+#endif
+    /* The crop is part of the first phase settings, since it sets the
+     * size of the image and the part of the raw image to convert */
+    if (old->interpolation != conf->interpolation ||
+            old->smoothing != conf->smoothing ||
+            old->shrink != conf->shrink ||
+            old->size != conf->size ||
+            old->resizeFilter != conf->resizeFilter ||
+            old->orientation != conf->orientation ||
+            old->rotationAngle != conf->rotationAngle ||
+            old->CropX1 != conf->CropX1 || old->CropY1 != conf->CropY1 ||
+            old->CropX2 != conf->CropX2 || old->CropY2 != conf->CropY2 ||
+            old->autoCrop != conf->autoCrop ||
+            old->type == fits_type || conf->type == fits_type)
+        return ufraw_first_phase;
+    return ufraw_develop_phase;
+}
+
+/* Load the raw image of uf by taking over the one of old, which was loaded
+ * from the same raw file, together with its converted phases. uf should be
+ * configured and not loaded yet. Only the phases that are affected by the
+ * changes from old->conf to uf->conf are converted again by the next
+ * ufraw_convert_image(). old is closed and freed in any case.
+ */
+int ufraw_reuse_raw(ufraw_data *uf, ufraw_data *old)
+{
+    if (old->rgbMax == 0 || old->conf->embeddedImage ||
+            uf->conf->embeddedImage ||
+            strcmp(old->conf->inputFilename, uf->conf->inputFilename) != 0) {
+        ufraw_close_darkframe(old->conf);
+        ufraw_close(old);
+        g_free(old);
+        return ufraw_load_raw(uf);
+    }
+    void *raw = uf->raw;
+    uf->raw = old->raw;
+    old->raw = raw;
+    /* The input buffer of a compressed raw file goes along with it, unless
+     * the EXIF data of uf is still to be read from its own input map */
+    if (!uf->exifPending) {
+        void *unzippedBuf = uf->unzippedBuf;
+        uf->unzippedBuf = old->unzippedBuf;
+        old->unzippedBuf = unzippedBuf;
+        void *inputMap = uf->inputMap;
+        uf->inputMap = old->inputMap;
+        old->inputMap = inputMap;
+    }
+    void *rawCache = uf->rawCache;
+    uf->rawCache = old->rawCache;
+    old->rawCache = rawCache;
+    uf->raw_multiplier = old->raw_multiplier;
+    ufraw_image_data images[ufraw_phases_num];
+    memcpy(images, uf->Images, sizeof images);
+    memcpy(uf->Images, old->Images, sizeof images);
+    memcpy(old->Images, images, sizeof images);
+
+    int status = ufraw_prepare_loaded_raw(uf);
+    /* ufraw_set_wb() in ufraw_prepare_loaded_raw() invalidated all the
+     * phases. Whether the white balance really changed is decided by
+     * comparing the channel multipliers below. */
+    uf->convertedPhase = old->convertedPhase;
+    UFRawPhase phase = ufraw_conf_changed_phase(old->conf, uf->conf);
+    if (phase < ufraw_develop_phase) {
+        ufraw_invalidate_layer(uf, phase);
+        /* Set up the invalidated phase buffers, as ufraw_load_raw() does */
+        ufraw_get_image_dimensions(uf);
+    }
+    ufraw_message(UFRAW_SET_LOG, "Reusing %s from phase %d\n",
+                  uf->filename, uf->convertedPhase);
+    ufraw_close_darkframe(old->conf);
+    ufraw_close(old);
+    g_free(old);
+    return status;
+}
+
 /* Free any darkframe associated with conf */
 void ufraw_close_darkframe(conf_data *conf)
 {
@@ -754,14 +1067,17 @@ void ufraw_close_darkframe(conf_data *conf)
 
 void ufraw_close(ufraw_data *uf)
 {
+    ufraw_cache_release(uf);
     dcraw_close(uf->raw);
-    g_free(uf->unzippedBuf);
+    ufraw_release_input(uf);
     g_free(uf->raw);
     g_free(uf->inputExifBuf);
     g_free(uf->outputExifBuf);
     int i;
-    for (i = ufraw_raw_phase; i < ufraw_phases_num; i++)
+    for (i = ufraw_raw_phase; i < ufraw_phases_num; i++) {
         g_free(uf->Images[i].buffer);
+        g_free(uf->Images[i].valid);
+    }
     g_free(uf->thumb.buffer);
     developer_destroy(uf->developer);
     developer_destroy(uf->AutoDeveloper);
@@ -779,21 +1095,69 @@ void ufraw_close(ufraw_data *uf)
     ufraw_message(UFRAW_CLEAN, NULL);
 }
 
+/* Make the subarea grid match the image size. If the grid changes all
+ * subareas are marked invalid.
+ */
+static void ufraw_image_tiles_update(ufraw_image_data *img)
+{
+    if (img->tileSize <= 0)
+        img->tileSize = UFRAW_TILE_SIZE;
+    int tilesX = MAX((img->width + img->tileSize - 1) / img->tileSize, 1);
+    int tilesY = MAX((img->height + img->tileSize - 1) / img->tileSize, 1);
+    if (img->valid != NULL && img->tilesX == tilesX && img->tilesY == tilesY)
+        return;
+    g_free(img->valid);
+    img->tilesX = tilesX;
+    img->tilesY = tilesY;
+    img->valid = g_new0(guint8, tilesX * tilesY);
+}
+
+/* Return the number of subareas in the image.
+ * Subareas are numbered row by row, starting from the top-left corner.
+ */
+int ufraw_image_get_subarea_count(ufraw_image_data *img)
+{
+    ufraw_image_tiles_update(img);
+    return img->tilesX * img->tilesY;
+}
+
+/* Return TRUE if all the subareas of the image are up to date */
+gboolean ufraw_image_is_valid(ufraw_image_data *img)
+{
+    ufraw_image_tiles_update(img);
+    int i;
+    for (i = 0; i < img->tilesX * img->tilesY; i++)
+        if (!img->valid[i])
+            return FALSE;
+    return TRUE;
+}
+
+void ufraw_image_invalidate(ufraw_image_data *img)
+{
+    if (img->valid != NULL)
+        memset(img->valid, 0, img->tilesX * img->tilesY);
+}
+
+/* Mark all the subareas of the image as up to date */
+static void ufraw_image_validate(ufraw_image_data *img)
+{
+    ufraw_image_tiles_update(img);
+    memset(img->valid, 1, img->tilesX * img->tilesY);
+}
+
 /* Return the coordinates and the size of given image subarea.
- * There are always 32 subareas, numbered 0 to 31, ordered in a 4x8 matrix.
  */
 UFRectangle ufraw_image_get_subarea_rectangle(ufraw_image_data *img,
         unsigned saidx)
 {
-    int saw = (img->width + 3) / 4;
-    int sah = (img->height + 7) / 8;
-    int sax = saidx % 4;
-    int say = saidx / 4;
+    ufraw_image_tiles_update(img);
+    int sax = saidx % img->tilesX;
+    int say = saidx / img->tilesX;
     UFRectangle area;
-    area.x = saw * sax;
-    area.y = sah * say;
-    area.width = (sax < 3) ? saw : (img->width - saw * 3);
-    area.height = (say < 7) ? sah : (img->height - sah * 7);
+    area.x = img->tileSize * sax;
+    area.y = img->tileSize * say;
+    area.width = MIN(img->tileSize, img->width - area.x);
+    area.height = MIN(img->tileSize, img->height - area.y);
     return area;
 }
 
@@ -801,9 +1165,8 @@ UFRectangle ufraw_image_get_subarea_rectangle(ufraw_image_data *img,
  */
 unsigned ufraw_img_get_subarea_idx(ufraw_image_data *img, int x, int y)
 {
-    int saw = (img->width + 3) / 4;
-    int sah = (img->height + 7) / 8;
-    return (x / saw) + (y / sah) * 4;
+    ufraw_image_tiles_update(img);
+    return (x / img->tileSize) + (y / img->tileSize) * img->tilesX;
 }
 
 void ufraw_developer_prepare(ufraw_data *uf, DeveloperMode mode)
@@ -833,34 +1196,70 @@ void ufraw_developer_prepare(ufraw_data *uf, DeveloperMode mode)
     }
 }
 
-int ufraw_convert_image(ufraw_data *uf)
+/* Convert the raw image up to the develop phase, leaving the result in
+ * the first phase buffer */
+static void ufraw_convert_image_phases(ufraw_data *uf)
 {
-    uf->mark_hotpixels = FALSE;
-    ufraw_developer_prepare(uf, file_developer);
-    ufraw_convert_image_raw(uf, ufraw_raw_phase);
-
     ufraw_image_data *img = &uf->Images[ufraw_first_phase];
     ufraw_convert_prepare_first_buffer(uf, img);
-    ufraw_convert_image_first(uf, ufraw_first_phase);
-
-    UFRectangle area = { 0, 0, img->width, img->height };
     // prepare_transform has to be called before applying vignetting
     ufraw_image_data *img2 = &uf->Images[ufraw_transform_phase];
     ufraw_convert_prepare_transform_buffer(uf, img2, img->width, img->height);
+
+    /* The raw phase of an earlier conversion can be reused, unless only
+     * a window of it was converted. */
+    dcraw_data *raw = uf->raw;
+    ufraw_image_data *rawImg = &uf->Images[ufraw_raw_phase];
+    gboolean rawValid = uf->convertedPhase > ufraw_raw_phase &&
+                        rawImg->width == raw->raw.width &&
+                        rawImg->height == raw->raw.height;
+
+    /* Only the crop area is written out, so there is no need to convert
+     * the pixels outside of it. */
+    UFRectangle crop, source;
+    gboolean cropped = ufraw_crop_source_area(uf, img, img2, &crop, &source);
+    if (cropped && !rawValid)
+        ufraw_raw_window_init(uf, img, &source);
+    if (!rawValid)
+        ufraw_convert_image_raw(uf, ufraw_raw_phase);
+    ufraw_convert_image_first(uf, ufraw_first_phase);
+    ufraw_raw_window_free(uf);
+
+    UFRectangle area = { 0, 0, img->width, img->height };
+    if (cropped)
+        area = source;
 #ifdef HAVE_LENSFUN
     if (uf->modifier != NULL) {
         ufraw_convert_image_vignetting(uf, img, &area);
     }
 #endif
     if (img2->buffer != NULL) {
-        area.width = img2->width;
-        area.height = img2->height;
+        if (cropped) {
+            area = crop;
+        } else {
+            area.width = img2->width;
+            area.height = img2->height;
+        }
         /* Apply distortion, geometry and rotation */
         ufraw_convert_image_transform(uf, img, img2, &area);
         g_free(img->buffer);
+        g_free(img->valid);
         *img = *img2;
         img2->buffer = NULL;
+        img2->valid = NULL;
     }
+}
+
+int ufraw_convert_image(ufraw_data *uf)
+{
+    uf->mark_hotpixels = FALSE;
+    ufraw_developer_prepare(uf, file_developer);
+
+    /* An image that was already converted with the same settings only
+     * needs to be developed again, see ufraw_reuse_raw(). */
+    if (uf->convertedPhase < ufraw_develop_phase)
+        ufraw_convert_image_phases(uf);
+    uf->convertedPhase = ufraw_develop_phase;
     if (uf->conf->autoCrop && !uf->LoadingID) {
         ufraw_get_image_dimensions(uf);
         uf->conf->CropX1 = (uf->rotatedWidth - uf->autoCropWidth) / 2;
@@ -972,6 +1371,129 @@ static inline void ufraw_interpolate_pixel_linearly(ufraw_image_data *image, flo
 #undef SCALAR
 
 
+#ifdef HAVE_LENSFUN
+/*
+ * Source coordinates of the transform phase, sampled every
+ * UF_TRANSFORM_GRID pixels of the output image and interpolated linearly
+ * in between. They are needed when the image is rotated and corrected by
+ * lensfun, since lensfun can then not map a whole output row in one call.
+ * The grids are shared, so that images with the same lens settings,
+ * rotation and size compute theirs only once. Up to
+ * UF_TRANSFORM_CACHE_SIZE grids that are no longer used are kept.
+ */
+#define UF_TRANSFORM_GRID 8
+#define UF_TRANSFORM_CACHE_SIZE 4
+
+typedef struct {
+    char *key;
+    int refCount;
+    int width, height; /* Number of grid points */
+    float *coords;     /* Source x, y of each grid point */
+} ufraw_transform_grid;
+
+/* Most recently used first */
+static GList *ufraw_transform_grids = NULL;
+G_LOCK_DEFINE_STATIC(ufraw_transform_grids);
+
+/* Must be called with the grids locked */
+static void ufraw_transform_grid_trim(void)
+{
+    int unused = 0;
+    GList *l = ufraw_transform_grids;
+    while (l != NULL) {
+        GList *next = l->next;
+        ufraw_transform_grid *grid = l->data;
+        if (grid->refCount == 0 && ++unused > UF_TRANSFORM_CACHE_SIZE) {
+            g_free(grid->key);
+            g_free(grid->coords);
+            g_free(grid);
+            ufraw_transform_grids = g_list_delete_link(ufraw_transform_grids, l);
+        }
+        l = next;
+    }
+}
+
+static ufraw_transform_grid *ufraw_transform_grid_get(ufraw_data *uf,
+        ufraw_image_data *img, ufraw_image_data *outimg,
+        float sine, float cosine, float baseX, float baseY)
+{
+    char *key = g_strdup_printf("%s\n%.6f\n%d %d %d %d", uf->modifierKey,
+                                uf->conf->rotationAngle, img->width, img->height,
+                                outimg->width, outimg->height);
+    ufraw_transform_grid *grid = NULL;
+    GList *l;
+    G_LOCK(ufraw_transform_grids);
+    for (l = ufraw_transform_grids; l != NULL; l = l->next) {
+        grid = l->data;
+        if (strcmp(grid->key, key) == 0) {
+            grid->refCount++;
+            ufraw_transform_grids = g_list_remove_link(ufraw_transform_grids, l);
+            ufraw_transform_grids = g_list_concat(l, ufraw_transform_grids);
+            break;
+        }
+    }
+    G_UNLOCK(ufraw_transform_grids);
+    if (l != NULL) {
+        g_free(key);
+        return grid;
+    }
+    grid = g_new(ufraw_transform_grid, 1);
+    grid->key = key;
+    grid->refCount = 1;
+    grid->width = (outimg->width - 1) / UF_TRANSFORM_GRID + 2;
+    grid->height = (outimg->height - 1) / UF_TRANSFORM_GRID + 2;
+    grid->coords = g_new(float, 2 * grid->width * grid->height);
+    int i, j;
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static) default(none) \
+    shared(uf,grid,sine,cosine,baseX,baseY) private(i)
+#endif
+    for (j = 0; j < grid->height; j++) {
+        float y = j * UF_TRANSFORM_GRID;
+        for (i = 0; i < grid->width; i++) {
+            float x = i * UF_TRANSFORM_GRID;
+            lf_modifier_apply_geometry_distortion(uf->modifier,
+                                                  y * sine + baseX + x * cosine,
+                                                  y * cosine + baseY - x * sine, 1, 1,
+                                                  grid->coords + 2 * (j * grid->width + i));
+        }
+    }
+    G_LOCK(ufraw_transform_grids);
+    ufraw_transform_grids = g_list_prepend(ufraw_transform_grids, grid);
+    ufraw_transform_grid_trim();
+    G_UNLOCK(ufraw_transform_grids);
+    return grid;
+}
+
+static void ufraw_transform_grid_release(ufraw_transform_grid *grid)
+{
+    G_LOCK(ufraw_transform_grids);
+    grid->refCount--;
+    ufraw_transform_grid_trim();
+    G_UNLOCK(ufraw_transform_grids);
+}
+
+/* Interpolate the source coordinates of width pixels of row y */
+static void ufraw_transform_grid_row(const ufraw_transform_grid *grid,
+                                     int x0, int y, int width, float *coords)
+{
+    const float *row0 = grid->coords + 2 * (y / UF_TRANSFORM_GRID) * grid->width;
+    const float *row1 = row0 + 2 * grid->width;
+    float fy = (float)(y % UF_TRANSFORM_GRID) / UF_TRANSFORM_GRID;
+    int x, c;
+    for (x = x0; x < x0 + width; x++, coords += 2) {
+        const float *p0 = row0 + 2 * (x / UF_TRANSFORM_GRID);
+        const float *p1 = row1 + 2 * (x / UF_TRANSFORM_GRID);
+        float fx = (float)(x % UF_TRANSFORM_GRID) / UF_TRANSFORM_GRID;
+        for (c = 0; c < 2; c++) {
+            float top = p0[c] + fx * (p0[c + 2] - p0[c]);
+            float bottom = p1[c] + fx * (p1[c + 2] - p1[c]);
+            coords[c] = top + fy * (bottom - top);
+        }
+    }
+}
+#endif // HAVE_LENSFUN
+
 /* Apply distortion, geometry and rotation in a single pass */
 static void ufraw_convert_image_transform(ufraw_data *uf, ufraw_image_data *img,
         ufraw_image_data *outimg, UFRectangle *area)
@@ -990,28 +1512,44 @@ static void ufraw_convert_image_transform(ufraw_data *uf, ufraw_image_data *img,
     float baseY = img->height / 2 + outimg->width / 2 * sine - outimg->height / 2 * cosine;
 #ifdef HAVE_LENSFUN
     gboolean applyLF = uf->modifier != NULL && (uf->modFlags & UF_LF_TRANSFORM);
+    ufraw_transform_grid *grid = NULL;
+    // Rows that are not rotated are mapped by lensfun directly
+    if (applyLF && uf->conf->rotationAngle != 0)
+        grid = ufraw_transform_grid_get(uf, img, outimg, sine, cosine,
+                                        baseX, baseY);
 #endif
     int x, y;
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static) private(x)
+#endif
     for (y = area->y; y < area->y + area->height; y++) {
         guint8 *cur0 = outimg->buffer + y * outimg->rowstride;
         float srcX0 = y * sine + baseX;
         float srcY0 = y * cosine + baseY;
-        for (x = area->x; x < area->x + area->width; x++) {
-            guint16 *cur = (guint16 *)(cur0 + x * outimg->depth);
-            float srcX = srcX0 + x * cosine;
-            float srcY = srcY0 - x * sine;
+        float buff[2 * area->width];
 #ifdef HAVE_LENSFUN
-            if (applyLF) {
-                float buff[2];
-                lf_modifier_apply_geometry_distortion(uf->modifier,
-                                                      srcX, srcY, 1, 1, buff);
-                srcX = buff[0];
-                srcY = buff[1];
-            }
+        if (grid != NULL)
+            ufraw_transform_grid_row(grid, area->x, y, area->width, buff);
+        else if (applyLF)
+            lf_modifier_apply_geometry_distortion(uf->modifier,
+                                                  srcX0 + area->x, srcY0,
+                                                  area->width, 1, buff);
+        else
 #endif
-            ufraw_interpolate_pixel_linearly(img, srcX, srcY, (ufraw_image_type *)cur, -1);
+            for (x = 0; x < area->width; x++) {
+                buff[2 * x] = srcX0 + (area->x + x) * cosine;
+                buff[2 * x + 1] = srcY0 - (area->x + x) * sine;
+            }
+        for (x = 0; x < area->width; x++) {
+            guint16 *cur = (guint16 *)(cur0 + (area->x + x) * outimg->depth);
+            ufraw_interpolate_pixel_linearly(img, buff[2 * x], buff[2 * x + 1],
+                                             (ufraw_image_type *)cur, -1);
         }
     }
+#ifdef HAVE_LENSFUN
+    if (grid != NULL)
+        ufraw_transform_grid_release(grid);
+#endif
 }
 
 /*
@@ -1030,12 +1568,61 @@ static void ufraw_convert_image_transform(ufraw_data *uf, ufraw_image_data *img,
  * -	use ufraw_image_format()
  * -	use uf->rgbMax (check, must be about 64k)
  */
+/* Shave the hot pixels of one row, return their count */
+static int ufraw_shave_hotpixels_row(ufraw_data *uf, dcraw_image_type *row,
+                                     const dcraw_image_type *above,
+                                     const dcraw_image_type *below,
+                                     int width, int colors, unsigned delta)
+{
+    int w, c, i, count = 0;
+    unsigned t, v, hi;
+    dcraw_image_type *p = row + 1;
+
+    for (w = 1; w < width - 1; ++w, ++p) {
+        for (c = 0; c < colors; ++c) {
+            t = p[0][c];
+            if (t <= delta)
+                continue;
+            t -= delta;
+            v = p[-1][c];
+            if (v > t)
+                continue;
+            hi = v;
+            v = p[1][c];
+            if (v > t)
+                continue;
+            if (v > hi)
+                hi = v;
+            v = above[w][c];
+            if (v > t)
+                continue;
+            if (v > hi)
+                hi = v;
+            v = below[w][c];
+            if (v > t)
+                continue;
+            if (v > hi)
+                hi = v;
+            /* mark the pixel using the original hot value */
+            if (uf->mark_hotpixels) {
+                for (i = -10; i >= -20 && w + i >= 0; --i)
+                    memcpy(p[i], p[0], sizeof(p[i]));
+                for (i = 10; i <= 20 && w + i < width; ++i)
+                    memcpy(p[i], p[0], sizeof(p[i]));
+            }
+            p[0][c] = hi;
+            ++count;
+        }
+    }
+    return count;
+}
+
 static void ufraw_shave_hotpixels(ufraw_data *uf, dcraw_image_type *img,
                                   int width, int height, int colors,
                                   unsigned rgbMax)
 {
-    int w, h, c, i, count;
-    unsigned delta, t, v, hi;
+    int h, count;
+    unsigned delta;
     dcraw_image_type *p;
 
     uf->hotpixels = 0;
@@ -1047,48 +1634,99 @@ static void ufraw_shave_hotpixels(ufraw_data *uf, dcraw_image_type *img,
     #pragma omp parallel for schedule(static) default(none) \
     shared(uf,img,width,height,colors,rgbMax,delta) \
 reduction(+:count) \
-    private(h,p,w,c,t,v,hi,i)
+    private(h,p)
 #endif
     for (h = 1; h < height - 1; ++h) {
-        p = img + 1 + h * width;
-        for (w = 1; w < width - 1; ++w, ++p) {
-            for (c = 0; c < colors; ++c) {
-                t = p[0][c];
-                if (t <= delta)
-                    continue;
-                t -= delta;
-                v = p[-1][c];
-                if (v > t)
-                    continue;
-                hi = v;
-                v = p[1][c];
-                if (v > t)
-                    continue;
-                if (v > hi)
-                    hi = v;
-                v = p[-width][c];
-                if (v > t)
-                    continue;
-                if (v > hi)
-                    hi = v;
-                v = p[width][c];
-                if (v > t)
-                    continue;
-                if (v > hi)
-                    hi = v;
-                /* mark the pixel using the original hot value */
-                if (uf->mark_hotpixels) {
-                    for (i = -10; i >= -20 && w + i >= 0; --i)
-                        memcpy(p[i], p[0], sizeof(p[i]));
-                    for (i = 10; i <= 20 && w + i < width; ++i)
-                        memcpy(p[i], p[0], sizeof(p[i]));
-                }
-                p[0][c] = hi;
-                ++count;
+        p = img + h * width;
+        count += ufraw_shave_hotpixels_row(uf, p, p - width, p + width,
+                                           width, colors, delta);
+    }
+    uf->hotpixels = count;
+}
+
+/*
+ * Rows per band of ufraw_convert_raw_bands(). A band and the two row
+ * buffers of its thread should stay in the cache.
+ */
+#define UF_RAW_BAND 16
+
+/*
+ * Copy the raw image from src to dst, shave its hot pixels if 'shave' is
+ * set and apply dcraw_finalize_raw() in one sweep over bands of rows,
+ * instead of one pass over the whole image for each step. src and dst may
+ * be the same. Each row is shaved with the shaved values of the row above
+ * it, as in ufraw_shave_hotpixels(), except for the first row of a band.
+ */
+static void ufraw_convert_raw_bands(ufraw_data *uf, dcraw_data *raw,
+                                    dcraw_data *dark, gboolean shave,
+                                    const dcraw_image_type *src,
+                                    dcraw_image_type *dst)
+{
+    const int width = raw->raw.width, height = raw->raw.height;
+    const int colors = raw->raw.colors;
+    const int bands = (height + UF_RAW_BAND - 1) / UF_RAW_BAND;
+    /* The neighbour rows are needed before they are finalized */
+    const gboolean keepRows = shave || dark != NULL;
+    const gsize rowSize = width * sizeof(dcraw_image_type);
+    unsigned delta = shave ? raw->rgbMax / (uf->conf->hotpixel + 1.0) : 0;
+    dcraw_image_type *halo = NULL;
+    int b, count = 0;
+
+    /* When working in place, other threads change the rows next to a
+     * band. The two original rows at each band border are kept. */
+    if (src == dst && keepRows) {
+        halo = g_new(dcraw_image_type, 2 * bands * width);
+        for (b = 1; b < bands; b++)
+            memcpy(halo + 2 * b * width, src + (b * UF_RAW_BAND - 1) * width,
+                   2 * rowSize);
+    }
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static) reduction(+:count)
+#endif
+    for (b = 0; b < bands; b++) {
+        int y0 = b * UF_RAW_BAND;
+        int y1 = MIN(y0 + UF_RAW_BAND, height);
+        dcraw_image_type *prev = NULL, *cur = NULL;
+        if (keepRows) {
+            prev = g_new(dcraw_image_type, width);
+            cur = g_new(dcraw_image_type, width);
+        }
+        int y;
+        for (y = y0; y < y1; y++) {
+            dcraw_image_type *row = dst + y * width;
+            const dcraw_image_type *above = NULL, *below = NULL;
+            if (y > y0)
+                above = prev;
+            else if (y > 0)
+                above = halo != NULL ? halo + 2 * b * width : src + (y - 1) * width;
+            if (y + 1 < y1)
+                below = src + (y + 1) * width;
+            else if (y + 1 < height)
+                below = halo != NULL ? halo + (2 * b + 3) * width :
+                        src + (y + 1) * width;
+            if (src != dst)
+                memcpy(row, src + y * width, rowSize);
+            if (shave && above != NULL && below != NULL)
+                count += ufraw_shave_hotpixels_row(uf, row, above, below,
+                                                   width, colors, delta);
+            if (keepRows) {
+                memcpy(cur, row, rowSize);
+                dcraw_finalize_raw_row(raw, dark, uf->developer->rgbWB, y,
+                                       above, cur, below, row);
+                dcraw_image_type *swap = prev;
+                prev = cur;
+                cur = swap;
+            } else {
+                dcraw_finalize_raw_row(raw, dark, uf->developer->rgbWB, y,
+                                       NULL, row, NULL, row);
             }
         }
+        g_free(prev);
+        g_free(cur);
     }
-    uf->hotpixels = count;
+    g_free(halo);
+    if (shave)
+        uf->hotpixels = count;
 }
 
 static void ufraw_despeckle_line(guint16 *base, int step, int size, int window,
@@ -1203,6 +1841,13 @@ static gboolean ufraw_despeckle_active(ufraw_data *uf)
     return active;
 }
 
+/* When downsizing with --size, the raw image is shrunk by binning its
+ * pixels instead of being interpolated at full size. If the wanted size
+ * allows it, the binned image is kept UFRAW_SIZE_OVERSAMPLE times larger
+ * than the wanted size, so that the final dcraw_image_resize() still has
+ * enough samples per output pixel to avoid aliasing. */
+#define UFRAW_SIZE_OVERSAMPLE 2
+
 static int ufraw_calculate_scale(ufraw_data *uf)
 {
     /* In the first call to ufraw_calculate_scale() the crop coordinates
@@ -1228,12 +1873,185 @@ static int ufraw_calculate_scale(ufraw_data *uf)
         int cropHeight = uf->conf->CropY2 - uf->conf->CropY1;
         int cropWidth = uf->conf->CropX2 - uf->conf->CropX1;
         int cropSize = MAX(cropHeight, cropWidth);
-        if (cropSize / uf->conf->size >= 2)
+        if (cropSize / (uf->conf->size * UFRAW_SIZE_OVERSAMPLE) >= 2)
+            scale = cropSize / (uf->conf->size * UFRAW_SIZE_OVERSAMPLE);
+        else if (cropSize / uf->conf->size >= 2)
             scale = cropSize / uf->conf->size;
     }
     return scale;
 }
 
+/*
+ * When ufraw_convert_image() only needs a small crop of the image, the raw
+ * and first phases are run on a window of the raw image around it. The
+ * window covers the first phase pixels that the crop is converted from,
+ * plus a margin for the neighbourhoods of the denoising, interpolation and
+ * resizing. The first phase image keeps its full size, with the pixels
+ * outside of the window left black, so that the later phases and the crop
+ * coordinates are not affected.
+ */
+typedef struct {
+    UFRectangle area; /* In raw->width x raw->height coordinates */
+    dcraw_data raw, dark;
+} ufraw_raw_window;
+
+/* Margin in raw->raw.image pixels. The wavelet denoising reaches 31 pixels
+ * and the interpolations and color smoothing a few pixels more. */
+#define UFRAW_WINDOW_MARGIN 48
+/* The window is aligned to all color filter patterns: Bayer (2x8),
+ * Leaf (16x16) and X-Trans (6x6). */
+#define UFRAW_WINDOW_ALIGN 48
+/* A window larger than this part of the image is not worth the effort */
+#define UFRAW_WINDOW_MAX_AREA 0.7
+
+/* Copy the area of raw to win, which is otherwise a copy of raw */
+static void ufraw_raw_window_copy(dcraw_data *win, dcraw_data *raw,
+                                  const UFRectangle *area)
+{
+    int x = area->x >> raw->shrink;
+    int y = area->y >> raw->shrink;
+    int row;
+
+    *win = *raw;
+    win->width = area->width;
+    win->height = area->height;
+    win->raw.width = MIN((area->width + raw->shrink) >> raw->shrink,
+                         raw->raw.width - x);
+    win->raw.height = MIN((area->height + raw->shrink) >> raw->shrink,
+                          raw->raw.height - y);
+    win->raw.image = g_new(dcraw_image_type,
+                           win->raw.width * win->raw.height);
+    for (row = 0; row < win->raw.height; row++)
+        memcpy(win->raw.image + row * win->raw.width,
+               raw->raw.image + (y + row) * raw->raw.width + x,
+               win->raw.width * sizeof(dcraw_image_type));
+}
+
+/* Set uf->rawWindow to the part of the raw image that the source area of
+ * the first phase image img is converted from, if it is worth it. */
+static void ufraw_raw_window_init(ufraw_data *uf, ufraw_image_data *img,
+                                  const UFRectangle *source)
+{
+    dcraw_data *raw = uf->raw;
+    dcraw_data *dark = uf->conf->darkframe ? uf->conf->darkframe->raw : NULL;
+    int scale = ufraw_calculate_scale(uf);
+    int flip = uf->conf->orientation;
+
+    /* Fuji SuperCCD images are rotated by 45 degrees while shrinking, and
+     * the despeckling reaches arbitrarily far along rows and columns. */
+    if (raw->fuji_width != 0 || ufraw_despeckle_active(uf))
+        return;
+    if (dark != NULL && (dark->raw.width != raw->raw.width ||
+                         dark->raw.height != raw->raw.height))
+        return;
+#ifdef HAVE_LENSFUN
+    /* The TCA correction depends on the position in the whole image */
+    ufraw_prepare_tca(uf, raw->raw.width, raw->raw.height);
+    if (uf->TCAmodifier != NULL)
+        return;
+#endif
+    /* The source area in relative coordinates, with room for the
+     * resizing kernels of ufraw_convertshrink() */
+    double x0 = (double)(source->x - 4) / img->width;
+    double x1 = (double)(source->x + source->width + 4) / img->width;
+    double y0 = (double)(source->y - 4) / img->height;
+    double y1 = (double)(source->y + source->height + 4) / img->height;
+    double r0, r1, c0, c1, t;
+    /* Undo dcraw_flip_image() */
+    if (flip & 4) {
+        r0 = x0;
+        r1 = x1;
+        c0 = y0;
+        c1 = y1;
+    } else {
+        r0 = y0;
+        r1 = y1;
+        c0 = x0;
+        c1 = x1;
+    }
+    if (flip & 2) {
+        t = r0;
+        r0 = 1 - r1;
+        r1 = 1 - t;
+    }
+    if (flip & 1) {
+        t = c0;
+        c0 = 1 - c1;
+        c1 = 1 - t;
+    }
+    /* The margin also covers the rounding of the shrinking and of
+     * dcraw_image_stretch() */
+    int margin = (UFRAW_WINDOW_MARGIN << raw->shrink) + 2 * scale;
+    int align = UFRAW_WINDOW_ALIGN * scale;
+    int left = MAX((int)floor(c0 * raw->width) - margin, 0) / align * align;
+    int top = MAX((int)floor(r0 * raw->height) - margin, 0) / align * align;
+    int right = ((int)ceil(c1 * raw->width) + margin + align - 1) / align * align;
+    int bottom = ((int)ceil(r1 * raw->height) + margin + align - 1) / align * align;
+    right = MIN(right, raw->width);
+    bottom = MIN(bottom, raw->height);
+    if ((double)(right - left) * (bottom - top) >
+            UFRAW_WINDOW_MAX_AREA * raw->width * raw->height)
+        return;
+
+    ufraw_raw_window *win = g_new(ufraw_raw_window, 1);
+    win->area.x = left;
+    win->area.y = top;
+    win->area.width = right - left;
+    win->area.height = bottom - top;
+    ufraw_raw_window_copy(&win->raw, raw, &win->area);
+    win->dark.raw.image = NULL;
+    if (dark != NULL)
+        ufraw_raw_window_copy(&win->dark, dark, &win->area);
+    uf->rawWindow = win;
+    ufraw_message(UFRAW_SET_LOG, "Converting %dx%d raw pixels at %d,%d\n",
+                  win->area.width, win->area.height, left, top);
+}
+
+static void ufraw_raw_window_free(ufraw_data *uf)
+{
+    ufraw_raw_window *win = uf->rawWindow;
+    if (win == NULL)
+        return;
+    g_free(win->raw.raw.image);
+    g_free(win->dark.raw.image);
+    g_free(win);
+    uf->rawWindow = NULL;
+}
+
+/* Interpolate or shrink the raw window, and place the result in an image
+ * of the size that the whole raw image would give. */
+static void ufraw_convertshrink_window(ufraw_data *uf, dcraw_image_data *final,
+                                       int scale)
+{
+    ufraw_raw_window *win = uf->rawWindow;
+    dcraw_data *raw = uf->raw;
+    dcraw_image_data part;
+    int row;
+
+    part.image = NULL;
+    if (uf->HaveFilters && scale == 1)
+        dcraw_finalize_interpolate(&part, &win->raw, uf->conf->interpolation,
+                                   uf->conf->smoothing);
+    else
+        dcraw_finalize_shrink(&part, &win->raw, scale);
+
+    final->height = raw->height / scale;
+    final->width = raw->width / scale;
+    final->colors = part.colors;
+    final->image = g_realloc(final->image,
+                             final->height * final->width * sizeof(dcraw_image_type));
+    memset(final->image, 0,
+           final->height * final->width * sizeof(dcraw_image_type));
+    int x = win->area.x / scale;
+    int y = win->area.y / scale;
+    int width = MIN(part.width, final->width - x);
+    for (row = 0; row < part.height && y + row < final->height; row++)
+        memcpy(final->image + (y + row) * final->width + x,
+               part.image + row * part.width,
+               width * sizeof(dcraw_image_type));
+    g_free(part.image);
+}
+
 // Any change to ufraw_convertshrink() that might change the final image
 // dimensions should also be applied to ufraw_convert_prepare_first_buffer().
 static void ufraw_convertshrink(ufraw_data *uf, dcraw_image_data *final)
@@ -1241,7 +2059,9 @@ static void ufraw_convertshrink(ufraw_data *uf, dcraw_image_data *final)
     dcraw_data *raw = uf->raw;
     int scale = ufraw_calculate_scale(uf);
 
-    if (uf->HaveFilters && scale == 1)
+    if (uf->rawWindow != NULL)
+        ufraw_convertshrink_window(uf, final, scale);
+    else if (uf->HaveFilters && scale == 1)
         dcraw_finalize_interpolate(final, raw, uf->conf->interpolation,
                                    uf->conf->smoothing);
     else
@@ -1250,7 +2070,8 @@ static void ufraw_convertshrink(ufraw_data *uf, dcraw_image_data *final)
     dcraw_image_stretch(final, raw->pixel_aspect);
     if (uf->conf->size == 0 && uf->conf->shrink > 1) {
         dcraw_image_resize(final,
-                           scale * MAX(final->height, final->width) / uf->conf->shrink);
+                           scale * MAX(final->height, final->width) / uf->conf->shrink,
+                           dcraw_box_resize);
     }
     if (uf->conf->size > 0) {
         int finalSize = scale * MAX(final->height, final->width);
@@ -1271,7 +2092,8 @@ static void ufraw_convertshrink(ufraw_data *uf, dcraw_image_data *final)
             /* uf->conf->size holds the size of the cropped image.
              * We need to calculate from it the desired size of
              * the uncropped image. */
-            dcraw_image_resize(final, uf->conf->size * finalSize / cropSize);
+            dcraw_image_resize(final, uf->conf->size * finalSize / cropSize,
+                               uf->conf->resizeFilter);
         }
     }
 }
@@ -1284,23 +2106,64 @@ static void ufraw_convertshrink(ufraw_data *uf, dcraw_image_data *final)
 static void ufraw_convert_image_raw(ufraw_data *uf, UFRawPhase phase)
 {
     ufraw_image_data *img = &uf->Images[phase];
+    ufraw_raw_window *win = uf->rawWindow;
     dcraw_data *dark = uf->conf->darkframe ? uf->conf->darkframe->raw : NULL;
     dcraw_data *raw = uf->raw;
     dcraw_image_type *rawimage;
+    gboolean denoise = !uf->IsXTrans && uf->conf->threshold != 0;
 
-    ufraw_convert_import_buffer(uf, phase, &raw->raw);
+    if (win != NULL) {
+        raw = &win->raw;
+        if (dark != NULL)
+            dark = &win->dark;
+        /* The window is a copy already, it becomes the phase buffer */
+        g_free(img->buffer);
+        img->buffer = (guint8 *)raw->raw.image;
+        raw->raw.image = NULL;
+        img->height = raw->raw.height;
+        img->width = raw->raw.width;
+        img->depth = sizeof(dcraw_image_type);
+        img->rowstride = img->width * img->depth;
+    } else if (!denoise) {
+        /* The raw image is copied by ufraw_convert_raw_bands() */
+        g_free(img->buffer);
+        img->height = raw->raw.height;
+        img->width = raw->raw.width;
+        img->depth = sizeof(dcraw_image_type);
+        img->rowstride = img->width * img->depth;
+        img->buffer = g_malloc(img->height * img->rowstride);
+    } else {
+        ufraw_convert_import_buffer(uf, phase, &raw->raw);
+    }
     img->rgbg = raw->raw.colors == 4;
-    ufraw_shave_hotpixels(uf, (dcraw_image_type *)(img->buffer), img->width,
-                          img->height, raw->raw.colors, raw->rgbMax);
-    rawimage = raw->raw.image;
-    raw->raw.image = (dcraw_image_type *)img->buffer;
-    /* The threshold is scaled for compatibility */
-    if (!uf->IsXTrans) dcraw_wavelet_denoise(raw, uf->conf->threshold * sqrt(uf->raw_multiplier));
-    dcraw_finalize_raw(raw, dark, uf->developer->rgbWB);
-    raw->raw.image = rawimage;
+    if (!denoise) {
+        ufraw_convert_raw_bands(uf, raw, dark, uf->conf->hotpixel > 0.0,
+                                win != NULL ? (dcraw_image_type *)img->buffer :
+                                raw->raw.image,
+                                (dcraw_image_type *)img->buffer);
+    } else {
+        /* Denoising needs the whole shaved image before it is finalized */
+        ufraw_shave_hotpixels(uf, (dcraw_image_type *)(img->buffer),
+                              img->width, img->height, raw->raw.colors,
+                              raw->rgbMax);
+        rawimage = raw->raw.image;
+        raw->raw.image = (dcraw_image_type *)img->buffer;
+        /* The threshold is scaled for compatibility */
+        dcraw_wavelet_denoise(raw, uf->conf->threshold * sqrt(uf->raw_multiplier));
+        raw->raw.image = rawimage;
+        /* Finalized by the same rows as without denoising */
+        ufraw_convert_raw_bands(uf, raw, dark, FALSE,
+                                (dcraw_image_type *)img->buffer,
+                                (dcraw_image_type *)img->buffer);
+    }
+    /* Despeckling and the TCA correction cannot join the band sweep.
+     * Each despeckling pass runs along whole rows and then along whole
+     * columns, so no band is done before the whole image is. The TCA
+     * correction reads the red and blue channels at displaced positions,
+     * which lensfun does not bound to nearby rows. */
     ufraw_despeckle(uf, phase);
 #ifdef HAVE_LENSFUN
-    ufraw_prepare_tca(uf);
+    ufraw_prepare_tca(uf, img->width, img->height);
     if (uf->TCAmodifier != NULL) {
         ufraw_image_data inImg = *img;
         img->buffer = g_malloc(img->height * img->rowstride);
@@ -1319,7 +2182,8 @@ static void ufraw_convert_image_first(ufraw_data *uf, UFRawPhase phase)
 {
     ufraw_image_data *in = &uf->Images[phase - 1];
     ufraw_image_data *out = &uf->Images[phase];
-    dcraw_data *raw = uf->raw;
+    ufraw_raw_window *win = uf->rawWindow;
+    dcraw_data *raw = win != NULL ? &win->raw : uf->raw;
 
     dcraw_image_data final;
     final.image = (ufraw_image_type *)out->buffer;
@@ -1440,7 +2304,7 @@ static void ufraw_image_init(ufraw_image_data *img,
             img->depth == bitdepth && img->buffer != NULL)
         return;
 
-    img->valid = 0;
+    ufraw_image_invalidate(img);
     img->height = height;
     img->width = width;
     img->depth = bitdepth;
@@ -1622,13 +2486,13 @@ static void ufraw_convert_prepare_buffers(ufraw_data *uf, UFRawPhase phase)
             return;
         case ufraw_first_phase:
             ufraw_convert_prepare_first_buffer(uf, img);
-            return;
+            break;
         case ufraw_transform_phase:
             ufraw_convert_prepare_transform_buffer(uf, img, width, height);
-            return;
+            break;
         case ufraw_develop_phase:
             ufraw_image_init(img, width, height, 3);
-            return;
+            break;
         case ufraw_display_phase:
             if (uf->developer->working2displayTransform == NULL) {
                 g_free(img->buffer);
@@ -1638,10 +2502,14 @@ static void ufraw_convert_prepare_buffers(ufraw_data *uf, UFRawPhase phase)
             } else {
                 ufraw_image_init(img, width, height, 3);
             }
-            return;
+            break;
         default:
             g_warning("ufraw_convert_prepare_buffers: unsupported phase %d", phase);
+            return;
     }
+    /* Set up the subarea grid here, so that the threads computing
+     * subareas later on only read it. */
+    ufraw_image_tiles_update(img);
 }
 
 /*
@@ -1699,93 +2567,188 @@ ufraw_image_data *ufraw_get_image(ufraw_data *uf, UFRawPhase phase,
          * pixbuf. That can be fixed but is suboptimal anyway. The best
          * we can do is print a warning in case we need to finish the
          * conversion and finish it here. */
-        if (uf->Images[phase].valid != 0xffffffff) {
+        if (!ufraw_image_is_valid(&uf->Images[phase])) {
             g_warning("%s: fixing unfinished conversion for phase %d.\n",
                       G_STRFUNC, phase);
-            int i;
-            for (i = 0; i < 32; ++i)
+            int i, count = ufraw_image_get_subarea_count(&uf->Images[phase]);
+            for (i = 0; i < count; ++i)
                 ufraw_convert_image_area(uf, i, phase);
         }
     }
     return &uf->Images[phase];
 }
 
+/* Return the area of img that the transform phase subarea 'area' of outimg
+ * is interpolated from. The subarea border is mapped through the same
+ * rotation and lens distortion as in ufraw_convert_image_transform().
+ */
+static UFRectangle ufraw_transform_source_area(ufraw_data *uf,
+        ufraw_image_data *img, ufraw_image_data *outimg, UFRectangle *area)
+{
+    float sine = sin(uf->conf->rotationAngle * 2 * M_PI / 360);
+    float cosine = cos(uf->conf->rotationAngle * 2 * M_PI / 360);
+    float baseX = img->width / 2 - outimg->width / 2 * cosine - outimg->height / 2 * sine;
+    float baseY = img->height / 2 + outimg->width / 2 * sine - outimg->height / 2 * cosine;
+#ifdef HAVE_LENSFUN
+    gboolean applyLF = uf->modifier != NULL && (uf->modFlags & UF_LF_TRANSFORM);
+#endif
+    float minX = G_MAXFLOAT, minY = G_MAXFLOAT;
+    float maxX = -G_MAXFLOAT, maxY = -G_MAXFLOAT;
+    int x0 = area->x, x1 = area->x + area->width;
+    int y0 = area->y, y1 = area->y + area->height;
+    // Sample the border every 8 pixels or so
+    int i, p, n = MAX(MAX(area->width, area->height) / 8, 1);
+    for (i = 0; i <= n; i++) {
+        float x = x0 + (float)(x1 - x0) * i / n;
+        float y = y0 + (float)(y1 - y0) * i / n;
+        float border[4][2] = { { x, y0 }, { x, y1 }, { x0, y }, { x1, y } };
+        for (p = 0; p < 4; p++) {
+            float srcX = border[p][1] * sine + baseX + border[p][0] * cosine;
+            float srcY = border[p][1] * cosine + baseY - border[p][0] * sine;
+#ifdef HAVE_LENSFUN
+            if (applyLF) {
+                float buff[2];
+                lf_modifier_apply_geometry_distortion(uf->modifier,
+                                                      srcX, srcY, 1, 1, buff);
+                srcX = buff[0];
+                srcY = buff[1];
+            }
+#endif
+            minX = MIN(minX, srcX);
+            maxX = MAX(maxX, srcX);
+            minY = MIN(minY, srcY);
+            maxY = MAX(maxY, srcY);
+        }
+    }
+    // Linear interpolation also reads the pixels next to the mapped ones.
+    minX = CLAMP(floor(minX) - 1, 0, img->width);
+    maxX = CLAMP(ceil(maxX) + 2, 0, img->width);
+    minY = CLAMP(floor(minY) - 1, 0, img->height);
+    maxY = CLAMP(ceil(maxY) + 2, 0, img->height);
+    UFRectangle source;
+    source.x = minX;
+    source.y = minY;
+    source.width = MAX(maxX - minX, 0);
+    source.height = MAX(maxY - minY, 0);
+    return source;
+}
+
+/* Get the crop area in the final image coordinates of img2, or of img if
+ * there is no transform, and the area of img that it is converted from.
+ * Return FALSE if the crop is not known before the conversion, or if the
+ * pixels outside of it are still needed.
+ */
+static gboolean ufraw_crop_source_area(ufraw_data *uf, ufraw_image_data *img,
+                                       ufraw_image_data *img2, UFRectangle *crop, UFRectangle *source)
+{
+    if (uf->conf->CropX1 == -1 || (uf->conf->autoCrop && !uf->LoadingID))
+        return FALSE;
+    // The FITS writer flips the whole image before reading the crop area
+    if (uf->conf->type == fits_type)
+        return FALSE;
+    if (img2->buffer != NULL) {
+        ufraw_scale_crop(uf, img2->width, img2->height, crop);
+        *source = ufraw_transform_source_area(uf, img, img2, crop);
+    } else {
+        ufraw_scale_crop(uf, img->width, img->height, crop);
+        *source = *crop;
+    }
+    return crop->width > 0 && crop->height > 0 &&
+           source->width > 0 && source->height > 0;
+}
+
+/* Find the range of subareas that overlap area.
+ * Return FALSE if there are none.
+ */
+static gboolean ufraw_image_get_subarea_range(ufraw_image_data *img,
+        UFRectangle *area, int *tx0, int *ty0, int *tx1, int *ty1)
+{
+    ufraw_image_tiles_update(img);
+    if (area->width <= 0 || area->height <= 0)
+        return FALSE;
+    *tx0 = MAX(area->x, 0) / img->tileSize;
+    *ty0 = MAX(area->y, 0) / img->tileSize;
+    *tx1 = MIN((area->x + area->width - 1) / img->tileSize, img->tilesX - 1);
+    *ty1 = MIN((area->y + area->height - 1) / img->tileSize, img->tilesY - 1);
+    return *tx0 <= *tx1 && *ty0 <= *ty1;
+}
+
+/* Compute all the subareas of phase that overlap area.
+ * Return the image of the closest phase that is actually rendered.
+ */
+static ufraw_image_data *ufraw_convert_image_rect(ufraw_data *uf,
+        UFRectangle area, UFRawPhase phase)
+{
+    ufraw_convert_prepare_buffers(uf, phase);
+    while (phase > ufraw_first_phase && uf->Images[phase].buffer == NULL)
+        phase--;
+    if (phase <= ufraw_first_phase)
+        return ufraw_convert_image_area(uf, 0, phase);
+
+    ufraw_image_data *img = &uf->Images[phase];
+    int tx, ty, tx0, ty0, tx1, ty1;
+    if (ufraw_image_get_subarea_range(img, &area, &tx0, &ty0, &tx1, &ty1))
+        for (ty = ty0; ty <= ty1; ty++)
+            for (tx = tx0; tx <= tx1; tx++)
+                ufraw_convert_image_area(uf, tx + ty * img->tilesX, phase);
+    return img;
+}
+
 ufraw_image_data *ufraw_convert_image_area(ufraw_data *uf, unsigned saidx,
         UFRawPhase phase)
 {
     int yy;
     ufraw_image_data *out = &uf->Images[phase];
-
-    if (out->valid & (1 << saidx))
-        return out; // the subarea has been already computed
-
-    /* Get the subarea image for previous phase */
     ufraw_image_data *in = NULL;
-    if (phase > ufraw_raw_phase) {
-        in = ufraw_convert_image_area(uf, saidx, phase - 1);
+
+    if (phase <= ufraw_first_phase) {
+        /* dcraw processes the whole image at once, so these phases
+         * have no subareas of their own. */
+        if (ufraw_image_is_valid(out))
+            return out;
+        if (phase > ufraw_raw_phase)
+            in = ufraw_convert_image_area(uf, 0, phase - 1);
+        ufraw_convert_prepare_buffers(uf, phase);
+        if (phase == ufraw_raw_phase) {
+            ufraw_convert_image_raw(uf, phase);
+        } else {
+            ufraw_convert_image_first(uf, phase);
+#ifdef HAVE_LENSFUN
+            UFRectangle allArea = { 0, 0, out->width, out->height };
+            ufraw_convert_image_vignetting(uf, out, &allArea);
+#endif /* HAVE_LENSFUN */
+        }
+        ufraw_image_validate(out);
+        return out;
     }
     // ufraw_convert_prepare_buffers() may set out->buffer to NULL.
     ufraw_convert_prepare_buffers(uf, phase);
-    if (phase > ufraw_first_phase && out->buffer == NULL)
-        return in; // skip phase
+    if (out->buffer == NULL) // skip phase
+        return ufraw_convert_image_area(uf, saidx, phase - 1);
+
+    if (saidx >= (unsigned)ufraw_image_get_subarea_count(out) ||
+            out->valid[saidx])
+        return out; // the subarea has been already computed
 
     /* Get subarea coordinates */
     UFRectangle area = ufraw_image_get_subarea_rectangle(out, saidx);
+
+    /* Compute the parts of the previous phase that the subarea depends on.
+     * All phases after the transform map pixels one to one. */
+    if (phase == ufraw_transform_phase) {
+        in = ufraw_convert_image_area(uf, 0, phase - 1);
+        UFRectangle source = ufraw_transform_source_area(uf, in, out, &area);
+        in = ufraw_convert_image_rect(uf, source, phase - 1);
+    } else {
+        in = ufraw_convert_image_rect(uf, area, phase - 1);
+    }
     guint8 *dest = out->buffer + area.y * out->rowstride + area.x * out->depth;
-    guint8 *src = NULL;
-    if (in != NULL)
-        src = in->buffer + area.y * in->rowstride + area.x * in->depth;
+    guint8 *src = in->buffer + area.y * in->rowstride + area.x * in->depth;
 
     switch (phase) {
-        case ufraw_raw_phase:
-            ufraw_convert_image_raw(uf, phase);
-            out->valid = 0xffffffff;
-            return out;
-
-        case ufraw_first_phase:
-            ufraw_convert_image_first(uf, phase);
-            out->valid = 0xffffffff;
-#ifdef HAVE_LENSFUN
-            UFRectangle allArea = { 0, 0, out->width, out->height };
-            ufraw_convert_image_vignetting(uf, out, &allArea);
-#endif /* HAVE_LENSFUN */
-            return out;
-
-        case ufraw_transform_phase: {
-            /* Area calculation is not needed at the moment since
-             * ufraw_first_phase is not tiled yet. */
-            /*
-                        int yy;
-                        float *buff = g_new (float, (w < 8) ? 8 * 2 * 3 : w * 2 * 3);
-
-                        // Compute the previous stage subareas, if needed
-                        lf_modifier_apply_subpixel_geometry_distortion (
-                            uf->modifier, x, y, 1, 1, buff);
-                        lf_modifier_apply_subpixel_geometry_distortion (
-                            uf->modifier, x + w/2, y, 1, 1, buff + 2 * 3);
-                        lf_modifier_apply_subpixel_geometry_distortion (
-                            uf->modifier, x + w-1, y, 1, 1, buff + 4 * 3);
-                        lf_modifier_apply_subpixel_geometry_distortion (
-                            uf->modifier, x, y + h/2, 1, 1, buff + 6 * 3);
-                        lf_modifier_apply_subpixel_geometry_distortion (
-                            uf->modifier, x + w-1, y + h/2, 1, 1, buff + 8 * 3);
-                        lf_modifier_apply_subpixel_geometry_distortion (
-                            uf->modifier, x, y + h-1, 1, 1, buff + 10 * 3);
-                        lf_modifier_apply_subpixel_geometry_distortion (
-                            uf->modifier, x + w/2, y + h-1, 1, 1, buff + 12 * 3);
-                        lf_modifier_apply_subpixel_geometry_distortion (
-                            uf->modifier, x + w-1, y + h-1, 1, 1, buff + 14 * 3);
-
-                        for (yy = 0; yy < 8 * 2 * 3; yy += 2)
-                        {
-                            int idx = ufraw_img_get_subarea_idx (in, buff [yy], buff [yy + 1]);
-                            if (idx <= 31)
-                                ufraw_convert_image_area (uf, idx, phase - 1);
-                        }
-            */
+        case ufraw_transform_phase:
             ufraw_convert_image_transform(uf, in, out, &area);
-        }
-        break;
+            break;
 
         case ufraw_develop_phase:
             for (yy = 0; yy < area.height; yy++, dest += out->rowstride,
@@ -1806,11 +2769,9 @@ ufraw_image_data *ufraw_convert_image_area(ufraw_data *uf, unsigned saidx,
             return in;
     }
 
-#ifdef _OPENMP
-    #pragma omp critical
-#endif
-    // Mark the subarea as valid
-    out->valid |= (1 << saidx);
+    // Mark the subarea as valid. Every subarea has its own flag,
+    // so threads working on different subareas do not collide.
+    out->valid[saidx] = 1;
 
     return out;
 }
@@ -1953,18 +2914,94 @@ void ufraw_flip_image(ufraw_data *uf, int flip)
         ufraw_normalize_rotation(uf);
     }
     UFRawPhase phase;
-    for (phase = ufraw_first_phase; phase < ufraw_phases_num; phase++)
-        ufraw_flip_image_buffer(&uf->Images[phase], flip);
+    for (phase = ufraw_first_phase; phase < ufraw_phases_num; phase++) {
+        ufraw_image_data *img = &uf->Images[phase];
+        // The subarea grid is not flipped along with the buffer
+        gboolean valid = ufraw_image_is_valid(img);
+        ufraw_flip_image_buffer(img, flip);
+        if (valid)
+            ufraw_image_validate(img);
+        else
+            ufraw_image_invalidate(img);
+    }
 }
 
 void ufraw_invalidate_layer(ufraw_data *uf, UFRawPhase phase)
 {
+    uf->convertedPhase = MIN(uf->convertedPhase, phase);
     for (; phase < ufraw_phases_num; phase++) {
-        uf->Images[phase].valid = 0;
+        ufraw_image_invalidate(&uf->Images[phase]);
         uf->Images[phase].invalidate_event = TRUE;
     }
 }
 
+/* Invalidate the subareas of phase that overlap area, given in the
+ * coordinates of that phase, and the subareas of the later phases that
+ * depend on them. The raw and first phases are converted whole, so they
+ * are invalidated whole, but only the transform phase subareas that are
+ * interpolated from area follow them.
+ */
+void ufraw_invalidate_area(ufraw_data *uf, UFRawPhase phase, UFRectangle area)
+{
+    if (phase < ufraw_first_phase) {
+        ufraw_invalidate_layer(uf, phase);
+        return;
+    }
+    uf->convertedPhase = MIN(uf->convertedPhase, phase);
+    if (phase == ufraw_first_phase) {
+        ufraw_image_data *in = &uf->Images[ufraw_first_phase];
+        ufraw_image_invalidate(in);
+        in->invalidate_event = TRUE;
+        phase++;
+        ufraw_image_data *out = &uf->Images[ufraw_transform_phase];
+        if (out->buffer != NULL) {
+            // Map area through the dependency of each transform subarea
+            int i, tiles = ufraw_image_get_subarea_count(out);
+            for (i = 0; i < tiles; i++) {
+                if (!out->valid[i])
+                    continue;
+                UFRectangle tile = ufraw_image_get_subarea_rectangle(out, i);
+                UFRectangle source =
+                    ufraw_transform_source_area(uf, in, out, &tile);
+                if (source.x < area.x + area.width &&
+                        area.x < source.x + source.width &&
+                        source.y < area.y + area.height &&
+                        area.y < source.y + source.height)
+                    out->valid[i] = 0;
+            }
+            // The later phases map pixels one to one.
+            area.x = area.y = 0;
+            area.width = area.height = 0;
+            for (i = 0; i < tiles; i++) {
+                if (out->valid[i])
+                    continue;
+                UFRectangle tile = ufraw_image_get_subarea_rectangle(out, i);
+                if (area.width == 0) {
+                    area = tile;
+                    continue;
+                }
+                int x1 = MAX(area.x + area.width, tile.x + tile.width);
+                int y1 = MAX(area.y + area.height, tile.y + tile.height);
+                area.x = MIN(area.x, tile.x);
+                area.y = MIN(area.y, tile.y);
+                area.width = x1 - area.x;
+                area.height = y1 - area.y;
+            }
+            phase++;
+        }
+    }
+    for (; phase < ufraw_phases_num; phase++) {
+        ufraw_image_data *img = &uf->Images[phase];
+        int tx, ty, tx0, ty0, tx1, ty1;
+        if (img->buffer == NULL ||
+                !ufraw_image_get_subarea_range(img, &area, &tx0, &ty0, &tx1, &ty1))
+            continue;
+        for (ty = ty0; ty <= ty1; ty++)
+            for (tx = tx0; tx <= tx1; tx++)
+                img->valid[tx + ty * img->tilesX] = 0;
+    }
+}
+
 void ufraw_invalidate_tca_layer(ufraw_data *uf)
 {
     ufraw_invalidate_layer(uf, ufraw_raw_phase);
@@ -1999,8 +3036,9 @@ void ufraw_invalidate_despeckle_layer(ufraw_data *uf)
 void ufraw_invalidate_whitebalance_layer(ufraw_data *uf)
 {
     ufraw_invalidate_layer(uf, ufraw_develop_phase);
-    uf->Images[ufraw_raw_phase].valid = 0;
+    ufraw_image_invalidate(&uf->Images[ufraw_raw_phase]);
     uf->Images[ufraw_raw_phase].invalidate_event = TRUE;
+    uf->convertedPhase = ufraw_raw_phase;
 
     /* Despeckling is sensitive for WB changes because it is nonlinear. */
     if (ufraw_despeckle_active(uf))
@@ -2017,6 +3055,86 @@ void ufraw_invalidate_smoothing_layer(ufraw_data *uf)
     ufraw_invalidate_layer(uf, ufraw_first_phase);
 }
 
+/* The presets of each (make, model, name) triplet and of each camera are
+ * consecutive in wb_preset[], with the tunings in increasing order.
+ * The index maps them to their span in the table.
+ */
+typedef struct {
+    int first, count;
+} wb_preset_span;
+
+static char *wb_preset_key(const char *make, const char *model,
+                           const char *name)
+{
+    char *m1 = g_ascii_strdown(make, -1);
+    char *m2 = g_ascii_strdown(model, -1);
+    char *key = name == NULL ? g_strconcat(m1, "\n", m2, NULL) :
+                g_strconcat(m1, "\n", m2, "\n", name, NULL);
+    g_free(m1);
+    g_free(m2);
+    return key;
+}
+
+static void wb_preset_index_add(GHashTable *index, char *key,
+                                int first, int count)
+{
+    // Like the linear search used to, keep the first span of a key.
+    if (g_hash_table_lookup(index, key) != NULL) {
+        g_free(key);
+        return;
+    }
+    wb_preset_span *span = g_new(wb_preset_span, 1);
+    span->first = first;
+    span->count = count;
+    g_hash_table_insert(index, key, span);
+}
+
+static gpointer wb_preset_index_build(gpointer data)
+{
+    (void)data;
+    GHashTable *index = g_hash_table_new_full(g_str_hash, g_str_equal,
+                        g_free, g_free);
+    int first, i;
+    for (first = 0; first < wb_preset_count; first = i) {
+        const wb_data *p = &wb_preset[first];
+        for (i = first + 1; i < wb_preset_count &&
+                g_ascii_strcasecmp(wb_preset[i].make, p->make) == 0 &&
+                g_ascii_strcasecmp(wb_preset[i].model, p->model) == 0; i++);
+        wb_preset_index_add(index, wb_preset_key(p->make, p->model, NULL),
+                            first, i - first);
+    }
+    for (first = 0; first < wb_preset_count; first = i) {
+        const wb_data *p = &wb_preset[first];
+        for (i = first + 1; i < wb_preset_count &&
+                strcmp(wb_preset[i].name, p->name) == 0 &&
+                g_ascii_strcasecmp(wb_preset[i].make, p->make) == 0 &&
+                g_ascii_strcasecmp(wb_preset[i].model, p->model) == 0; i++);
+        wb_preset_index_add(index, wb_preset_key(p->make, p->model, p->name),
+                            first, i - first);
+    }
+    return index;
+}
+
+/* Return the presets of the camera with the given WB name, or all the
+ * presets of the camera if name is NULL. The number of presets is
+ * returned in count. Return NULL if there are none.
+ */
+const wb_data *wb_preset_find(const char *make, const char *model,
+                              const char *name, int *count)
+{
+    static GOnce once = G_ONCE_INIT;
+    GHashTable *index = g_once(&once, wb_preset_index_build, NULL);
+    char *key = wb_preset_key(make, model, name);
+    wb_preset_span *span = g_hash_table_lookup(index, key);
+    g_free(key);
+    if (span == NULL) {
+        *count = 0;
+        return NULL;
+    }
+    *count = span->count;
+    return &wb_preset[span->first];
+}
+
 int ufraw_set_wb(ufraw_data *uf, gboolean interactive)
 {
     dcraw_data *raw = uf->raw;
@@ -2114,7 +3232,6 @@ int ufraw_set_wb(ufraw_data *uf, gboolean interactive)
         ufnumber_array_set(chanMul, chanMulArray);
         ufnumber_set(wbTuning, 0);
     } else {
-        int lastTuning = -1;
         char model[max_name];
         if (strcasecmp(uf->conf->make, "Minolta") == 0 &&
                 (strncmp(uf->conf->model, "ALPHA", 5) == 0 ||
@@ -2125,63 +3242,48 @@ int ufraw_set_wb(ufraw_data *uf, gboolean interactive)
         } else {
             g_strlcpy(model, uf->conf->model, max_name);
         }
-        for (i = 0; i < wb_preset_count; i++) {
-            if (ufarray_is_equal(wb, wb_preset[i].name) &&
-                    !strcasecmp(uf->conf->make, wb_preset[i].make) &&
-                    !strcasecmp(model, wb_preset[i].model)) {
-                if (ufnumber_value(wbTuning) == wb_preset[i].tuning) {
-                    double chanMulArray[4] = {1, 1, 1, 1 };
-                    for (c = 0; c < uf->colors; c++)
-                        chanMulArray[c] = wb_preset[i].channel[c];
-                    ufnumber_array_set(chanMul, chanMulArray);
-                    break;
-                } else if (ufnumber_value(wbTuning) < wb_preset[i].tuning) {
-                    if (lastTuning == -1) {
-                        /* wbTuning was set to a value smaller than possible */
-                        ufnumber_set(wbTuning, wb_preset[i].tuning);
-                        double chanMulArray[4] = {1, 1, 1, 1 };
-                        for (c = 0; c < uf->colors; c++)
-                            chanMulArray[c] = wb_preset[i].channel[c];
-                        ufnumber_array_set(chanMul, chanMulArray);
-                        break;
-                    } else {
-                        /* Extrapolate WB tuning values:
-                         * f(x) = f(a) + (x-a)*(f(b)-f(a))/(b-a) */
-                        double chanMulArray[4] = {1, 1, 1, 1 };
-                        for (c = 0; c < uf->colors; c++)
-                            chanMulArray[c] = wb_preset[i].channel[c] +
-                                              (ufnumber_value(wbTuning) - wb_preset[i].tuning) *
-                                              (wb_preset[lastTuning].channel[c] -
-                                               wb_preset[i].channel[c]) /
-                                              (wb_preset[lastTuning].tuning -
-                                               wb_preset[i].tuning);
-                        ufnumber_array_set(chanMul, chanMulArray);
-                        break;
-                    }
-                } else if (ufnumber_value(wbTuning) > wb_preset[i].tuning) {
-                    lastTuning = i;
-                }
-            } else if (lastTuning != -1) {
-                /* wbTuning was set to a value larger than possible */
-                ufnumber_set(wbTuning, wb_preset[lastTuning].tuning);
-                double chanMulArray[4] = {1, 1, 1, 1 };
-                for (c = 0; c < uf->colors; c++)
-                    chanMulArray[c] = wb_preset[lastTuning].channel[c];
-                ufnumber_array_set(chanMul, chanMulArray);
-                break;
-            }
+        int count;
+        const wb_data *preset = wb_preset_find(uf->conf->make, model,
+                                               ufobject_string_value(wb), &count);
+        if (preset == NULL) {
+            ufobject_set_string(wb, uf_manual_wb);
+            ufraw_set_wb(uf, interactive);
+            return UFRAW_WARNING;
         }
-        if (i == wb_preset_count) {
-            if (lastTuning != -1) {
-                /* wbTuning was set to a value larger than possible */
-                ufnumber_set(wbTuning, wb_preset[lastTuning].tuning);
-                ufnumber_array_set(chanMul, wb_preset[lastTuning].channel);
-            } else {
-                ufobject_set_string(wb, uf_manual_wb);
-                ufraw_set_wb(uf, interactive);
-                return UFRAW_WARNING;
-            }
+        /* Find the first preset whose tuning is not smaller than wbTuning */
+        double tuning = ufnumber_value(wbTuning);
+        int lo = 0, hi = count;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (preset[mid].tuning < tuning)
+                lo = mid + 1;
+            else
+                hi = mid;
         }
+        double chanMulArray[4] = {1, 1, 1, 1 };
+        if (lo == count) {
+            /* wbTuning was set to a value larger than possible */
+            ufnumber_set(wbTuning, preset[count - 1].tuning);
+            for (c = 0; c < uf->colors; c++)
+                chanMulArray[c] = preset[count - 1].channel[c];
+        } else if (tuning == preset[lo].tuning) {
+            for (c = 0; c < uf->colors; c++)
+                chanMulArray[c] = preset[lo].channel[c];
+        } else if (lo == 0) {
+            /* wbTuning was set to a value smaller than possible */
+            ufnumber_set(wbTuning, preset[0].tuning);
+            for (c = 0; c < uf->colors; c++)
+                chanMulArray[c] = preset[0].channel[c];
+        } else {
+            /* Extrapolate WB tuning values:
+             * f(x) = f(a) + (x-a)*(f(b)-f(a))/(b-a) */
+            const wb_data *a = &preset[lo], *b = &preset[lo - 1];
+            for (c = 0; c < uf->colors; c++)
+                chanMulArray[c] = a->channel[c] + (tuning - a->tuning) *
+                                  (b->channel[c] - a->channel[c]) /
+                                  (b->tuning - a->tuning);
+        }
+        ufnumber_array_set(chanMul, chanMulArray);
     }
     /* (1/chanMul)[4] = (1/preMul)[4][4] * cam_rgb[4][3] * rgbWB[3]
      * Therefore:
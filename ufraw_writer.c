@@ -18,6 +18,9 @@
 #include "ufraw_colorspaces.h"
 #ifdef HAVE_LIBTIFF
 #include <tiffio.h>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
 #endif
 #ifdef HAVE_LIBJPEG
 #include <jerror.h>
@@ -86,14 +89,32 @@ static int ppm_row_writer(ufraw_data *uf, void *volatile out, void *pixbuf,
 }
 
 #ifdef HAVE_LIBTIFF
-// There seem to be no way to get the libtiff message without a static variable
-// Therefore the folloing code is not thread-safe.
-static char ufraw_tiff_message[max_path];
+// There seem to be no way to get the libtiff message without a static
+// variable, so the message is kept per thread.
+static char *ufraw_tiff_message(void)
+{
+#if GLIB_CHECK_VERSION(2,32,0)
+    static GPrivate key = G_PRIVATE_INIT(g_free);
+    char *message = g_private_get(&key);
+    if (message == NULL) {
+        message = g_new0(char, max_path);
+        g_private_set(&key, message);
+    }
+#else
+    static GStaticPrivate key = G_STATIC_PRIVATE_INIT;
+    char *message = g_static_private_get(&key);
+    if (message == NULL) {
+        message = g_new0(char, max_path);
+        g_static_private_set(&key, message, g_free);
+    }
+#endif
+    return message;
+}
 
 static void tiff_messenger(const char *module, const char *fmt, va_list ap)
 {
     (void)module;
-    vsnprintf(ufraw_tiff_message, max_path, fmt, ap);
+    vsnprintf(ufraw_tiff_message(), max_path, fmt, ap);
 }
 
 int tiff_row_writer(ufraw_data *uf, void *volatile out, void *pixbuf,
@@ -106,13 +127,94 @@ int tiff_row_writer(ufraw_data *uf, void *volatile out, void *pixbuf,
         if (TIFFWriteScanline(out, pixbuf + i * rowStride, row + i, 0) < 0) {
             // 'errno' does seem to contain useful information
             ufraw_set_error(uf, _("Error creating file."));
-            ufraw_set_error(uf, ufraw_tiff_message);
-            ufraw_tiff_message[0] = '\0';
+            ufraw_set_error(uf, ufraw_tiff_message());
+            ufraw_tiff_message()[0] = '\0';
             return UFRAW_ERROR;
         }
     }
     return UFRAW_SUCCESS;
 }
+
+#ifdef HAVE_LIBZ
+/* Rows in each strip of a zip compressed TIFF file. The strips in a batch
+ * of DEVELOP_BATCH rows, which must be a multiple of it, are compressed
+ * in parallel. */
+#define TIFF_STRIP_ROWS 8
+
+/* Compress the strips with zlib ourselves, applying the horizontal
+ * predictor the same way libtiff does, and write them out in order. */
+static int tiff_zip_row_writer(ufraw_data *uf, void *volatile out,
+                               void *pixbuf, int row, int width, int height, int grayscale,
+                               int bitDepth)
+{
+    int byteDepth = bitDepth > 8 ? 2 : 1;
+    int samples = grayscale ? 1 : 3;
+    int rowStride = width * 3 * byteDepth;
+    int lineSize = width * samples * byteDepth;
+    int strips = (height + TIFF_STRIP_ROWS - 1) / TIFF_STRIP_ROWS;
+    guint8 **stripBuf = g_new(guint8 *, strips);
+    uLongf *stripSize = g_new(uLongf, strips);
+    int s, status = UFRAW_SUCCESS;
+
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic) default(shared) private(s)
+#endif
+    for (s = 0; s < strips; s++) {
+        int rows = MIN(height - s * TIFF_STRIP_ROWS, TIFF_STRIP_ROWS);
+        guint8 *strip = g_new(guint8, rows * lineSize);
+        int r, i;
+        for (r = 0; r < rows; r++) {
+            guint8 *line = strip + r * lineSize;
+            memcpy(line, (guint8 *)pixbuf + (s * TIFF_STRIP_ROWS + r) * rowStride,
+                   lineSize);
+            // Horizontal differencing, from right to left
+            if (byteDepth == 2) {
+                guint16 *line16 = (guint16 *)line;
+                for (i = width * samples - 1; i >= samples; i--)
+                    line16[i] -= line16[i - samples];
+            } else {
+                for (i = width * samples - 1; i >= samples; i--)
+                    line[i] -= line[i - samples];
+            }
+        }
+        stripSize[s] = compressBound(rows * lineSize);
+        stripBuf[s] = g_new(guint8, stripSize[s]);
+        if (compress2(stripBuf[s], &stripSize[s], strip, rows * lineSize,
+                      Z_BEST_COMPRESSION) != Z_OK)
+            stripSize[s] = 0;
+        g_free(strip);
+    }
+    for (s = 0; s < strips; s++) {
+        if (status == UFRAW_SUCCESS && (stripSize[s] == 0 ||
+                                        TIFFWriteRawStrip(out, row / TIFF_STRIP_ROWS + s,
+                                                stripBuf[s], stripSize[s]) < 0)) {
+            ufraw_set_error(uf, _("Error creating file."));
+            ufraw_set_error(uf, ufraw_tiff_message());
+            ufraw_tiff_message()[0] = '\0';
+            status = UFRAW_ERROR;
+        }
+        g_free(stripBuf[s]);
+    }
+    g_free(stripBuf);
+    g_free(stripSize);
+    return status;
+}
+#endif /*HAVE_LIBZ*/
+
+#ifdef TIFF_BIGTIFF_VERSION
+/* Classic TIFF files are limited to 4GB. The crop area is given before
+ * any scaling, so this is an upper bound of the image size. */
+static gboolean tiff_needs_bigtiff(ufraw_data *uf)
+{
+    gint64 width = MAX(uf->conf->CropX2 - uf->conf->CropX1, 0);
+    gint64 height = MAX(uf->conf->CropY2 - uf->conf->CropY1, 0);
+    int bitDepth = uf->conf->profile[out_profile]
+                   [uf->conf->profileIndex[out_profile]].BitDepth;
+    gint64 size = width * height * 3 * (bitDepth == 16 ? 2 : 1);
+    // Leave some room for the tags and the strip offsets
+    return size > G_GINT64_CONSTANT(0xF0000000);
+}
+#endif
 #endif /*HAVE_LIBTIFF*/
 
 #ifdef HAVE_LIBJPEG
@@ -193,14 +295,258 @@ int png_row_writer(ufraw_data *uf, void *volatile out, void *pixbuf,
     (void)uf;
     (void)row;
     (void)grayscale;
+    png_structp png = out;
     int rowStride = width * (bitDepth > 8 ? 6 : 3);
-
+    jmp_buf jmpbuf;
+
+    /* Return the error instead of jumping out of ufraw_write_image_data(),
+     * which might still be developing the next rows. */
+    memcpy(jmpbuf, png_jmpbuf(png), sizeof(jmp_buf));
+    if (setjmp(png_jmpbuf(png))) {
+        memcpy(png_jmpbuf(png), jmpbuf, sizeof(jmp_buf));
+        return UFRAW_ERROR;
+    }
     int i;
     for (i = 0; i < height; i++)
-        png_write_row(out, (guint8 *)pixbuf + rowStride * i);
+        png_write_row(png, (guint8 *)pixbuf + rowStride * i);
 
+    memcpy(png_jmpbuf(png), jmpbuf, sizeof(jmp_buf));
     return UFRAW_SUCCESS;
 }
+
+#if defined(_OPENMP) && defined(HAVE_LIBZ)
+/* Parallel PNG encoding, in the way of pigz: the rows are filtered and
+ * deflated in chunks of PNG_CHUNK_ROWS rows on all threads. Each chunk is
+ * a raw deflate stream primed with the previous 32KB of data and ended
+ * with a sync flush, so that together they form a single zlib stream.
+ * It is written out with png_write_chunk() instead of png_write_row(). */
+#define PNG_CHUNK_ROWS 8
+#define PNG_WINDOW_SIZE 32768
+
+typedef struct {
+    png_structp png;
+    int height;
+    int pixelBytes, rowBytes;
+    guint8 *prevRow; /* The last row of the previous batch, unfiltered */
+    guint8 window[PNG_WINDOW_SIZE]; /* The last filtered bytes */
+    int windowLen;
+    uLong adler;
+} png_parallel_writer;
+
+static png_parallel_writer *png_parallel_writer_new(png_structp png,
+        int width, int height, int grayscale, int bitDepth)
+{
+    png_parallel_writer *w = g_new0(png_parallel_writer, 1);
+    w->png = png;
+    w->height = height;
+    w->pixelBytes = (grayscale ? 1 : 3) * (bitDepth > 8 ? 2 : 1);
+    w->rowBytes = width * w->pixelBytes;
+    w->prevRow = g_new(guint8, w->rowBytes);
+    w->adler = adler32(0L, Z_NULL, 0);
+    return w;
+}
+
+static void png_parallel_writer_free(png_parallel_writer *w)
+{
+    if (w == NULL)
+        return;
+    g_free(w->prevRow);
+    g_free(w);
+}
+
+static inline int png_paeth_predictor(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+static inline guint8 png_filter_byte(int type, const guint8 *row,
+                                     const guint8 *prev, int i, int bpp)
+{
+    int a = i >= bpp ? row[i - bpp] : 0;
+    int b = prev != NULL ? prev[i] : 0;
+    int c = i >= bpp && prev != NULL ? prev[i - bpp] : 0;
+    switch (type) {
+        case PNG_FILTER_VALUE_SUB:
+            return row[i] - a;
+        case PNG_FILTER_VALUE_UP:
+            return row[i] - b;
+        case PNG_FILTER_VALUE_AVG:
+            return row[i] - (a + b) / 2;
+        case PNG_FILTER_VALUE_PAETH:
+            return row[i] - png_paeth_predictor(a, b, c);
+        default:
+            return row[i];
+    }
+}
+
+/* Filter the row with the filter that gives the smallest sum of absolute
+ * differences, the same heuristic that libpng uses. */
+static void png_filter_row(guint8 *dst, const guint8 *row, const guint8 *prev,
+                           int rowBytes, int bpp)
+{
+    unsigned sum[PNG_FILTER_VALUE_LAST] = { 0 };
+    int type, best = PNG_FILTER_VALUE_NONE, i;
+    for (i = 0; i < rowBytes; i++) {
+        int x = row[i];
+        int a = i >= bpp ? row[i - bpp] : 0;
+        int b = prev != NULL ? prev[i] : 0;
+        int c = i >= bpp && prev != NULL ? prev[i - bpp] : 0;
+        sum[PNG_FILTER_VALUE_NONE] += abs((signed char)x);
+        sum[PNG_FILTER_VALUE_SUB] += abs((signed char)(x - a));
+        sum[PNG_FILTER_VALUE_UP] += abs((signed char)(x - b));
+        sum[PNG_FILTER_VALUE_AVG] += abs((signed char)(x - (a + b) / 2));
+        sum[PNG_FILTER_VALUE_PAETH] +=
+            abs((signed char)(x - png_paeth_predictor(a, b, c)));
+    }
+    for (type = 1; type < PNG_FILTER_VALUE_LAST; type++)
+        if (sum[type] < sum[best])
+            best = type;
+    dst[0] = best;
+    for (i = 0; i < rowBytes; i++)
+        dst[i + 1] = png_filter_byte(best, row, prev, i, bpp);
+}
+
+static int png_parallel_row_writer(ufraw_data *uf, void *volatile out,
+                                   void *pixbuf, int row, int width, int height, int grayscale,
+                                   int bitDepth)
+{
+    (void)grayscale;
+    png_parallel_writer *w = out;
+    int pixbufStride = width * (bitDepth > 8 ? 6 : 3);
+    int lineSize = w->rowBytes + 1;
+    int chunks = (height + PNG_CHUNK_ROWS - 1) / PNG_CHUNK_ROWS;
+    gboolean last = row + height >= w->height;
+    guint8 *rows = g_new(guint8, height * w->rowBytes);
+    guint8 *filtered = g_new(guint8, height * lineSize);
+    guint8 **zBuf = g_new(guint8 *, chunks);
+    uLong *zLen = g_new(uLong, chunks);
+    uLong *adler = g_new(uLong, chunks);
+    int r, c, status = UFRAW_SUCCESS;
+
+    /* PNG samples are big-endian */
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static) default(shared) private(r)
+#endif
+    for (r = 0; r < height; r++) {
+        guint8 *src = (guint8 *)pixbuf + r * pixbufStride;
+        guint8 *dst = rows + r * w->rowBytes;
+        if (bitDepth > 8) {
+            guint16 *src16 = (guint16 *)src;
+            int i;
+            for (i = 0; i < w->rowBytes / 2; i++) {
+                dst[2 * i] = src16[i] >> 8;
+                dst[2 * i + 1] = src16[i] & 0xFF;
+            }
+        } else {
+            memcpy(dst, src, w->rowBytes);
+        }
+    }
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static) default(shared) private(r)
+#endif
+    for (r = 0; r < height; r++) {
+        const guint8 *prev = r > 0 ? rows + (r - 1) * w->rowBytes :
+                             row > 0 ? w->prevRow : NULL;
+        png_filter_row(filtered + r * lineSize, rows + r * w->rowBytes, prev,
+                       w->rowBytes, w->pixelBytes);
+    }
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic) default(shared) private(c)
+#endif
+    for (c = 0; c < chunks; c++) {
+        int start = c * PNG_CHUNK_ROWS * lineSize;
+        int len = MIN(height - c * PNG_CHUNK_ROWS, PNG_CHUNK_ROWS) * lineSize;
+        int flush = last && c == chunks - 1 ? Z_FINISH : Z_SYNC_FLUSH;
+        z_stream z;
+        memset(&z, 0, sizeof z);
+        deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                     Z_FILTERED);
+        if (c > 0)
+            deflateSetDictionary(&z, filtered + start - MIN(start, PNG_WINDOW_SIZE),
+                                 MIN(start, PNG_WINDOW_SIZE));
+        else if (w->windowLen > 0)
+            deflateSetDictionary(&z, w->window, w->windowLen);
+        // Leave room for the sync flush marker
+        zLen[c] = deflateBound(&z, len) + 16;
+        zBuf[c] = g_new(guint8, zLen[c]);
+        z.next_in = filtered + start;
+        z.avail_in = len;
+        z.next_out = zBuf[c];
+        z.avail_out = zLen[c];
+        int ret = deflate(&z, flush);
+        if (flush == Z_FINISH ? ret != Z_STREAM_END :
+                ret != Z_OK || z.avail_in != 0 || z.avail_out == 0)
+            zLen[c] = 0;
+        else
+            zLen[c] -= z.avail_out;
+        deflateEnd(&z);
+        adler[c] = adler32(adler32(0L, Z_NULL, 0), filtered + start, len);
+    }
+
+    /* Collect the chunks into one IDAT chunk, starting with the zlib
+     * header and ending with the Adler-32 checksum of the whole stream. */
+    gsize size = 0;
+    for (c = 0; c < chunks; c++) {
+        if (zLen[c] == 0)
+            status = UFRAW_ERROR;
+        size += zLen[c];
+    }
+    guint8 *idat = g_new(guint8, size + 6);
+    guint8 *p = idat;
+    if (row == 0) {
+        *p++ = 0x78;
+        *p++ = 0xDA;
+    }
+    for (c = 0; c < chunks; c++) {
+        memcpy(p, zBuf[c], zLen[c]);
+        p += zLen[c];
+        w->adler = adler32_combine(w->adler, adler[c],
+                                   MIN(height - c * PNG_CHUNK_ROWS, PNG_CHUNK_ROWS) * lineSize);
+        g_free(zBuf[c]);
+    }
+    if (last) {
+        *p++ = w->adler >> 24;
+        *p++ = w->adler >> 16;
+        *p++ = w->adler >> 8;
+        *p++ = w->adler;
+    }
+    if (status != UFRAW_SUCCESS) {
+        ufraw_set_error(uf, "deflate: %s.", zError(Z_STREAM_ERROR));
+    } else {
+        jmp_buf jmpbuf;
+        memcpy(jmpbuf, png_jmpbuf(w->png), sizeof(jmp_buf));
+        if (setjmp(png_jmpbuf(w->png)))
+            status = UFRAW_ERROR;
+        else
+            png_write_chunk(w->png, (png_bytep)"IDAT", idat, p - idat);
+        memcpy(png_jmpbuf(w->png), jmpbuf, sizeof(jmp_buf));
+    }
+
+    /* Keep what the next batch needs */
+    memcpy(w->prevRow, rows + (height - 1) * w->rowBytes, w->rowBytes);
+    int total = height * lineSize;
+    if (total >= PNG_WINDOW_SIZE) {
+        memcpy(w->window, filtered + total - PNG_WINDOW_SIZE, PNG_WINDOW_SIZE);
+        w->windowLen = PNG_WINDOW_SIZE;
+    } else {
+        int keep = MIN(w->windowLen, PNG_WINDOW_SIZE - total);
+        memmove(w->window, w->window + w->windowLen - keep, keep);
+        memcpy(w->window + keep, filtered, total);
+        w->windowLen = keep + total;
+    }
+    g_free(idat);
+    g_free(adler);
+    g_free(zLen);
+    g_free(zBuf);
+    g_free(filtered);
+    g_free(rows);
+    return status;
+}
+#endif /*_OPENMP && HAVE_LIBZ*/
 #endif /*HAVE_LIBPNG*/
 
 #if defined(HAVE_LIBCFITSIO) && defined(_WIN32)
@@ -217,40 +563,102 @@ static struct tm *localtime_r(const time_t *timep, struct tm *result)
 }
 #endif /*HAVE_LIBCFITSIO && _WIN32*/
 
-void ufraw_write_image_data(
-    ufraw_data *uf, void * volatile out,
-    const UFRectangle *Crop, int bitDepth, int grayscaleMode,
-    int (*row_writer)(ufraw_data *, void * volatile, void *, int, int, int, int, int))
+/* Rows of the crop area that are developed together */
+typedef struct {
+    ufraw_data *uf;
+    const UFRectangle *Crop;
+    int bitDepth, grayscaleMode;
+    int row0;
+    guint8 *pixbuf;
+} develop_batch;
+
+static void develop_batch_rows(develop_batch *batch)
 {
-    int row, row0;
+    ufraw_data *uf = batch->uf;
+    const UFRectangle *Crop = batch->Crop;
+    int row;
     int rowStride = uf->Images[ufraw_first_phase].width;
     ufraw_image_type *rawImage =
         (ufraw_image_type *)uf->Images[ufraw_first_phase].buffer;
+    int byteDepth = (batch->bitDepth + 7) / 8;
+
+#ifdef _OPENMP
+    #pragma omp parallel for default(shared) private(row)
+#endif
+    for (row = 0; row < DEVELOP_BATCH; row++) {
+        if (row + batch->row0 >= Crop->height)
+            continue;
+        guint8 *rowbuf = &batch->pixbuf[row * Crop->width * 3 * byteDepth];
+        develop(rowbuf,
+                rawImage[(Crop->y + row + batch->row0)*rowStride + Crop->x],
+                uf->developer, batch->bitDepth, Crop->width);
+        if (batch->grayscaleMode)
+            grayscale_buffer(rowbuf, Crop->width, batch->bitDepth);
+    }
+}
+
+static gpointer develop_batch_thread(gpointer data)
+{
+    develop_batch_rows(data);
+    return NULL;
+}
+
+/* With conf->pipelineWrite, the next batch of rows is developed in another
+ * thread while the row writer compresses the current one. The row writer
+ * itself always runs in the calling thread, since libjpeg and libpng
+ * report errors with longjmp(), and so does progress(), which may run the
+ * GTK main loop. */
+int ufraw_write_image_data(
+    ufraw_data *uf, void * volatile out,
+    const UFRectangle *Crop, int bitDepth, int grayscaleMode,
+    int (*row_writer)(ufraw_data *, void * volatile, void *, int, int, int, int, int))
+{
     int byteDepth = (bitDepth + 7) / 8;
-    guint8 *pixbuf8 = g_new(guint8,
-                            Crop->width * 3 * byteDepth * DEVELOP_BATCH);
+    int status = UFRAW_SUCCESS;
+    gboolean pipeline = uf->conf->pipelineWrite;
+#if !GLIB_CHECK_VERSION(2,32,0)
+    pipeline = pipeline && g_thread_supported();
+#endif
+    develop_batch batch[2];
+    int i;
+    for (i = 0; i < 2; i++) {
+        batch[i].uf = uf;
+        batch[i].Crop = Crop;
+        batch[i].bitDepth = bitDepth;
+        batch[i].grayscaleMode = grayscaleMode;
+        batch[i].pixbuf = g_new(guint8,
+                                Crop->width * 3 * byteDepth * DEVELOP_BATCH);
+    }
 
     progress(PROGRESS_SAVE, -Crop->height);
-    for (row0 = 0; row0 < Crop->height; row0 += DEVELOP_BATCH) {
-        progress(PROGRESS_SAVE, DEVELOP_BATCH);
-#ifdef _OPENMP
-        #pragma omp parallel for default(shared) private(row)
+    batch[0].row0 = 0;
+    develop_batch_rows(&batch[0]);
+    for (i = 0; batch[i % 2].row0 < Crop->height; i++) {
+        develop_batch *current = &batch[i % 2];
+        develop_batch *next = &batch[(i + 1) % 2];
+        GThread *thread = NULL;
+        next->row0 = current->row0 + DEVELOP_BATCH;
+        if (pipeline && next->row0 < Crop->height) {
+#if GLIB_CHECK_VERSION(2,32,0)
+            thread = g_thread_new("ufraw-develop", develop_batch_thread, next);
+#else
+            thread = g_thread_create(develop_batch_thread, next, TRUE, NULL);
 #endif
-        for (row = 0; row < DEVELOP_BATCH; row++) {
-            if (row + row0 >= Crop->height)
-                continue;
-            guint8 *rowbuf = &pixbuf8[row * Crop->width * 3 * byteDepth];
-            develop(rowbuf, rawImage[(Crop->y + row + row0)*rowStride + Crop->x],
-                    uf->developer, bitDepth, Crop->width);
-            if (grayscaleMode)
-                grayscale_buffer(rowbuf, Crop->width, bitDepth);
         }
-        int batchHeight = MIN(Crop->height - row0, DEVELOP_BATCH);
-        if (row_writer(uf, out, pixbuf8, row0, Crop->width, batchHeight,
-                       grayscaleMode, bitDepth) != UFRAW_SUCCESS)
+        int batchHeight = MIN(Crop->height - current->row0, DEVELOP_BATCH);
+        status = row_writer(uf, out, current->pixbuf, current->row0,
+                            Crop->width, batchHeight, grayscaleMode, bitDepth);
+        if (thread != NULL)
+            g_thread_join(thread);
+        progress(PROGRESS_SAVE, DEVELOP_BATCH);
+        if (status != UFRAW_SUCCESS)
             break;
+        if (thread == NULL && next->row0 < Crop->height)
+            develop_batch_rows(next);
     }
-    g_free(pixbuf8);
+    g_free(batch[0].pixbuf);
+    g_free(batch[1].pixbuf);
+    return status;
 }
 
 int ufraw_write_image(ufraw_data *uf)
@@ -291,21 +699,26 @@ int ufraw_write_image(ufraw_data *uf)
     if (uf->conf->type == tiff_type) {
         TIFFSetErrorHandler(tiff_messenger);
         TIFFSetWarningHandler(tiff_messenger);
-        ufraw_tiff_message[0] = '\0';
+        ufraw_tiff_message()[0] = '\0';
+        const char *mode = "w";
+#ifdef TIFF_BIGTIFF_VERSION
+        if (tiff_needs_bigtiff(uf))
+            mode = "w8";
+#endif
         if (!strcmp(uf->conf->outputFilename, "-")) {
             out = TIFFFdOpen(fileno((FILE *)stdout),
-                             uf->conf->outputFilename, "w");
+                             uf->conf->outputFilename, mode);
         } else {
             char *filename =
                 uf_win32_locale_filename_from_utf8(uf->conf->outputFilename);
-            out = TIFFOpen(filename, "w");
+            out = TIFFOpen(filename, mode);
             uf_win32_locale_filename_free(filename);
         }
         if (out == NULL) {
             ufraw_set_error(uf, _("Error creating file."));
-            ufraw_set_error(uf, ufraw_tiff_message);
+            ufraw_set_error(uf, ufraw_tiff_message());
             ufraw_set_error(uf, g_strerror(errno));
-            ufraw_tiff_message[0] = '\0';
+            ufraw_tiff_message()[0] = '\0';
             return ufraw_get_status(uf);
         }
     } else
@@ -423,10 +836,19 @@ int ufraw_write_image(ufraw_data *uf)
             }
             cmsCloseProfile(hOutProfile);
         }
-        TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(out, 0));
-
-        ufraw_write_image_data(uf, out, &Crop, BitDepth, grayscaleMode,
-                               tiff_row_writer);
+#ifdef HAVE_LIBZ
+        if (uf->conf->losslessCompress) {
+            TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, TIFF_STRIP_ROWS);
+            ufraw_write_image_data(uf, out, &Crop, BitDepth, grayscaleMode,
+                                   tiff_zip_row_writer);
+        } else
+#endif
+        {
+            TIFFSetField(out, TIFFTAG_ROWSPERSTRIP,
+                         TIFFDefaultStripSize(out, 0));
+            ufraw_write_image_data(uf, out, &Crop, BitDepth, grayscaleMode,
+                                   tiff_row_writer);
+        }
 
 #endif /*HAVE_LIBTIFF*/
 #ifdef HAVE_LIBJPEG
@@ -529,6 +951,9 @@ int ufraw_write_image(ufraw_data *uf)
         png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING,
                           uf, png_error_handler, png_warning_handler);
         png_infop info = png_create_info_struct(png);
+#if defined(_OPENMP) && defined(HAVE_LIBZ)
+        png_parallel_writer * volatile parallel = NULL;
+#endif
         if (setjmp(png_jmpbuf(png))) {
             char *message = g_strdup(ufraw_get_message(uf));
             ufraw_message_reset(uf);
@@ -536,6 +961,9 @@ int ufraw_write_image(ufraw_data *uf)
                             uf->conf->outputFilename);
             ufraw_set_error(uf, message);
             g_free(message);
+#if defined(_OPENMP) && defined(HAVE_LIBZ)
+            png_parallel_writer_free(parallel);
+#endif
             png_destroy_write_struct(&png, &info);
         } else {
             png_init_io(png, out);
@@ -602,10 +1030,27 @@ int ufraw_write_image(ufraw_data *uf)
             if (BitDepth != 8 && G_BYTE_ORDER == G_LITTLE_ENDIAN)
                 png_set_swap(png); // Swap byte order to big-endian
 
-            ufraw_write_image_data(uf, png, &Crop, BitDepth, grayscaleMode,
-                                   png_row_writer);
-
-            png_write_end(png, NULL);
+#if defined(_OPENMP) && defined(HAVE_LIBZ)
+            /* With a single thread libpng is just as fast */
+            if (omp_get_max_threads() > 1) {
+                parallel = png_parallel_writer_new(png, Crop.width, Crop.height,
+                                                   grayscaleMode, BitDepth);
+                if (ufraw_write_image_data(uf, parallel, &Crop, BitDepth,
+                                           grayscaleMode, png_parallel_row_writer) !=
+                        UFRAW_SUCCESS)
+                    longjmp(png_jmpbuf(png), 1);
+                png_write_chunk(png, (png_bytep)"IEND", NULL, 0);
+                png_write_flush(png);
+                png_parallel_writer_free(parallel);
+                parallel = NULL;
+            } else
+#endif
+            {
+                if (ufraw_write_image_data(uf, png, &Crop, BitDepth, grayscaleMode,
+                                           png_row_writer) != UFRAW_SUCCESS)
+                    longjmp(png_jmpbuf(png), 1);
+                png_write_end(png, NULL);
+            }
             png_destroy_write_struct(&png, &info);
         }
 #endif /*HAVE_LIBPNG*/
@@ -767,16 +1212,30 @@ int ufraw_write_image(ufraw_data *uf)
     }
 #ifdef HAVE_LIBTIFF
     if (uf->conf->type == tiff_type) {
+        int exifStatus = UFRAW_CANCEL;
+#if TIFFLIB_VERSION >= 20111221
+        /* Add the EXIF directory before closing the file, instead of
+         * letting exiv2 rewrite the whole file after it is closed.
+         * A pipe cannot be read back to rewrite the image directory. */
+        if (uf->conf->embedExif && ufraw_tiff_message()[0] == '\0' &&
+                !ufraw_is_error(uf) &&
+                strcmp(uf->conf->outputFilename, "-") != 0)
+            exifStatus = ufraw_exif_write_tiff(uf, out);
+#endif
         TIFFClose(out);
-        if (ufraw_tiff_message[0] != '\0') {
+        if (ufraw_tiff_message()[0] != '\0') {
             if (!ufraw_is_error(uf)) {   // Error was not already set before
                 ufraw_set_error(uf, _("Error creating file."));
-                ufraw_set_error(uf, ufraw_tiff_message);
+                ufraw_set_error(uf, ufraw_tiff_message());
             }
-            ufraw_tiff_message[0] = '\0';
-        } else {
-            if (uf->conf->embedExif)
-                ufraw_exif_write(uf);
+            ufraw_tiff_message()[0] = '\0';
+        } else if (exifStatus == UFRAW_ERROR) {
+            ufraw_set_error(uf, _("Error writing the EXIF data of '%s'."),
+                            uf->conf->outputFilename);
+        } else if (exifStatus == UFRAW_CANCEL && uf->conf->embedExif &&
+                   !ufraw_is_error(uf)) {
+            /* Metadata that only exiv2 can write */
+            ufraw_exif_write(uf);
         }
     } else
 #endif